@@ -6,6 +6,13 @@
 #include <graehl/shared/serialize_batch.hpp>
 #include <graehl/shared/time_space_report.hpp>
 #include <graehl/shared/periodic.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace graehl {
 
@@ -22,10 +29,11 @@ struct cached_derivs
   training_corpus &corpus;
   WFST::deriv_cache_opts const& copt;
   bool cached;
+  cached_derivs *shared;  // a --threads random restart (or gibbs chain) worker's: whose (in memory) derivations it reads
 
   unsigned size()
   {
-    return cached?derivs.size():corpus.size();
+    return cached?(shared?shared->derivs.size():derivs.size()):corpus.size();
   }
   double n_output() const
   {
@@ -33,12 +41,38 @@ struct cached_derivs
   }
 
   cached_derivs(WFST &x, cascade_parameters const& cascade, training_corpus &corpus, WFST::deriv_cache_opts const& copt)
-      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt)
+      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize, copt.disk_cache_lz4), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt), shared()
   {
+    derivs.set_read_ahead(copt.read_ahead);
     if ((cached = copt.cache()))
       cache_derivations();
     first = true; // for non-caching
   }
+
+  // counts from shared's derivations, which must be in memory and shareable (see share_derivations)
+  explicit cached_derivs(cached_derivs &shared)
+      : x(shared.x), derivs(false, ""), arcs(shared.x), cascade(shared.cascade), corpus(shared.corpus), copt(shared.copt), cached(true), shared(shared.shared ? shared.shared : &shared), first(false)
+  {}
+
+  // so threads may use the (in memory) derivations at once (see derivations::make_shareable)
+  void share_derivations(bool keep_plan, bool keep_order)
+  {
+    assert(cached && !derivs.use_file);
+    for (unsigned i = 0, n = derivs.store.size(); i < n; ++i)
+      derivs.store[i].make_shareable(keep_plan, keep_order);
+  }
+  bool can_share() const
+  {
+    return cached && !derivs.use_file;
+  }
+
+  // the i-th (0-based) cached derivations.  unlike derivs[i] (which moves a read cursor if on disk), shared
+  // in-memory derivations may be looked up this way from several threads
+  derivations &deriv(unsigned i)
+  {
+    if (shared) return shared->deriv(i);
+    return derivs.use_file ? derivs[i] : derivs.store[i];
+  }
   bool first;
 
   template <class F>
@@ -51,6 +85,14 @@ struct cached_derivs
       foreach_deriv(f, 0);
   }
 
+  // --disk-cache-lz4: since the last call
+  void log_read_stats(std::ostream &log)
+  {
+    if (!cached || !derivs.compressed()) return;
+    log << " (disk cache: " << derivs.lz4buf.read_stats << ")";
+    derivs.lz4buf.read_stats.clear();
+  }
+
   static void warn_no_derivations(WFST const& x, IOSymSeq const& s, unsigned n)
   {
     Config::warn() << "No derivations in transducer for input/output #"<<n<<":\n";
@@ -64,7 +106,10 @@ struct cached_derivs
     bool fem = od&&first;
     if (fem)
       cascade.arcids(aid);
-    if (cached) {
+    if (shared) {
+      for (unsigned i = 0, n = shared->derivs.store.size(); i < n; ++i)
+        f(i + 1, shared->derivs.store[i]);
+    } else if (cached) {
       unsigned n = 0;
       for (derivs.rewind(); derivs.advance();) {
         ++n;
@@ -114,27 +159,162 @@ struct cached_derivs
     wfst_io_index io(x);
     unsigned n = 1;
     derivs.clear();
-    for (Examples::const_iterator i = ex.begin(), end = ex.end();
-         i!=end ; ++i, ++n) {
+    if (copt.threads > 1 && ex.has2())
+      cache_derivations_parallel(io);
+    else {
+      for (Examples::const_iterator i = ex.begin(), end = ex.end();
+           i!=end ; ++i, ++n) {
+        num_progress(log, n, 10, 70,".","\n");
+        derivations &d = derivs.start_new();
+        corpus.clear_counts();
+        if (!d.init_and_compute(x, io, arcs, i->i, i->o, i->weight, n, cache_backward, prune)) {
+          warn_no_derivations(x, *i, n);
+          derivs.drop_new();
+        } else {
+#ifdef DEBUG_DERIVATIONS_EXTRA
+          Config::debug() << "Derivations in transducer for input/output #"<<n<<" (final="<<d.final()<<"):\n";
+          i->print(Config::debug(), x,"\n");
+          printGraph(d.graph(), Config::debug());
+#endif
+          derivs.keep_new();
+          corpus.count(*i);
+        }
+      }
+    }
+    log << "\n";
+    derivs.mark_end();
+    if (derivs.compressed()) {
+      log << "Disk cache: " << derivs.lz4buf.write_stats << "\n";
+      derivs.lz4buf.write_stats.clear();
+    } else if (derivs.use_file)
+      log << "Cached derivations in " << derivs.stored_in() << ": " << derivs.stored_bytes() * 1e-6 << " MB\n";
+    log << derivations::global_stats;
+  }
+
+  // --threads: workers take the next example and compute its derivations into a slot: its place in derivs
+  // if in memory, else one of a ring of a few per thread, reused once this thread has saved it.  this thread
+  // takes the examples in order (progress, warnings, corpus counts, stats, keep or drop), so the cache and
+  // log are as if built serially
+  struct parallel_build {
+    std::vector<IOSymSeq const*> examples;
+    wfst_io_index const* io;
+    derivations *slots;
+    std::unique_ptr<derivations[]> ring;
+    std::size_t n_slots;
+    fixed_array<derivations::statistics> stats;  // each example's derivations::global_stats
+    std::unique_ptr<char[]> built;  // 0: not yet, 1: kept, 2: no derivations
+    std::size_t next;  // for a worker to take
+    std::size_t n_taken;  // by this thread
+    std::size_t taking;  // the one this thread waits for
+    unsigned workers_waiting;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable built_one, took_one;
+  };
+
+  void cache_worker(parallel_build &p)
+  {
+    for (;;) {
+      std::size_t i;
+      {
+        std::unique_lock<std::mutex> lock(p.mutex);
+        while (p.next < p.examples.size() && p.next >= p.n_taken + p.n_slots && !p.error) {
+          ++p.workers_waiting;
+          p.took_one.wait(lock);
+          --p.workers_waiting;
+        }
+        if (p.next >= p.examples.size() || p.error) return;
+        i = p.next++;
+      }
+      IOSymSeq const& e = *p.examples[i];
+      char result = 0;
+      std::exception_ptr error;
+      try {
+        derivations::global_stats = derivations::statistics();
+        result = p.slots[i % p.n_slots].init_and_compute(x, *p.io, arcs, e.i, e.o, e.weight, (unsigned)i + 1,
+                                                         copt.cache_backward(), copt.prune()) ? 1 : 2;
+        p.stats[i] = derivations::global_stats;
+      } catch (...) {
+        error = std::current_exception();
+      }
+      bool wake;
+      {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.built[i] = result;
+        if (error && !p.error) p.error = error;
+        wake = p.taking == i || p.error;
+      }
+      if (wake) p.built_one.notify_one();
+    }
+  }
+
+  void cache_derivations_parallel(wfst_io_index const& io)
+  {
+    std::ostream &log = Config::log();
+    parallel_build p;
+    for (List<IOSymSeq>::const_iterator i = corpus.examples.begin(), end = corpus.examples.end(); i!=end ; ++i)
+      p.examples.push_back(&*i);
+    std::size_t N = p.examples.size();
+    unsigned T = copt.threads < N ? copt.threads : (unsigned)N;
+    p.io = &io;
+    std::unique_ptr<bool[]> drop;
+    if (derivs.use_file) {
+      p.n_slots = 4 * T < N ? 4 * T : N;
+      p.ring.reset(new derivations[p.n_slots]);
+      p.slots = p.ring.get();
+    } else {
+      p.n_slots = N;
+      p.slots = derivs.start_n_new(N);
+      drop.reset(new bool[N]);
+    }
+    p.stats.reinit(N);
+    p.built.reset(new char[N]());
+    p.next = p.n_taken = 0;
+    p.taking = (std::size_t)-1;
+    p.workers_waiting = 0;
+    thread_group workers;
+    for (unsigned t = 0; t < T; ++t)
+      workers.create_thread(&cached_derivs::cache_worker, this, std::ref(p));
+    for (std::size_t i = 0; i < N; ++i) {
+      unsigned n = (unsigned)i + 1;
       num_progress(log, n, 10, 70,".","\n");
-      derivations &d = derivs.start_new();
+      bool kept;
+      {
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.taking = i;
+        while (!p.built[i] && !p.error) p.built_one.wait(lock);
+        if (p.error) break;
+        kept = p.built[i] == 1;
+      }
+      IOSymSeq const& e = *p.examples[i];
+      derivations &d = p.slots[i % p.n_slots];
       corpus.clear_counts();
-      if (!d.init_and_compute(x, io, arcs, i->i, i->o, i->weight, n, cache_backward, prune)) {
-        warn_no_derivations(x, *i, n);
-        derivs.drop_new();
-      } else {
+      derivations::global_stats.add(p.stats[i], !kept);
+      if (!kept)
+        warn_no_derivations(x, e, n);
+      else {
 #ifdef DEBUG_DERIVATIONS_EXTRA
         Config::debug() << "Derivations in transducer for input/output #"<<n<<" (final="<<d.final()<<"):\n";
-        i->print(Config::debug(), x,"\n");
+        e.print(Config::debug(), x,"\n");
         printGraph(d.graph(), Config::debug());
 #endif
-        derivs.keep_new();
-        corpus.count(*i);
+        if (derivs.use_file)
+          derivs.keep(d);
+        corpus.count(e);
+      }
+      if (drop) drop[i] = !kept;
+      bool wake;
+      {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        ++p.n_taken;
+        wake = p.workers_waiting;
       }
+      if (wake) p.took_one.notify_all();
     }
-    log << "\n";
-    derivs.mark_end();
-    log << derivations::global_stats;
+    p.took_one.notify_all();  // (after an error)
+    workers.join_all();
+    if (p.error) std::rethrow_exception(p.error);
+    if (drop) derivs.drop_marked(drop.get());
   }
 };
 
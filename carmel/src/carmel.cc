@@ -36,12 +36,21 @@
 #include <ctime>
 #include <carmel/src/fst.h>
 #include <carmel/src/cascade.h>
+#include <carmel/src/lazy_compose.h>
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/string_to.hpp>
 #include <graehl/shared/split.hpp>
 #include <graehl/shared/split_noquote.hpp>
 #include <boost/config.hpp>
 #include <graehl/shared/random.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <graehl/shared/lru_cache.hpp>
+#include <graehl/shared/lz4.hpp>  // the definitions (GRAEHL__SINGLE_MAIN) for --disk-cache-lz4
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
 
 #define DEBUG_CASCADE 0
 
@@ -240,12 +249,44 @@ struct carmel_main {
               : (flags[(unsigned)':'] ? WFST::cache_forward_backward
                                       : (flags[(unsigned)'?'] ? WFST::cache_forward : WFST::cache_nothing));
     copt.do_prune = !have_opt("cache-no-prune");
-    if (have_opt("disk-cache-derivations")) {
+    topt.scaled_fb = have_opt("scaled-fb");
+    topt.log_sum_fb = have_opt("log-sum-fb");
+    topt.log_add = text_long_opts["log-sum-fb"] == "fast" ? log_add_fast : log_add_exact;
+    topt.squarem = have_opt("squarem");
+    if (have_opt("online-em")) {
+      get_default_opt("online-em", topt.online_batch, "1000");
+      get_opt("online-em-alpha", topt.online_alpha);
+      if (!(topt.online_alpha > .5 && topt.online_alpha <= 1))
+        Config::warn() << "--online-em-alpha=" << topt.online_alpha
+                       << " is outside (.5,1], so stepwise EM may not converge.\n";
+    }
+    double threads;
+    if (get_opt("threads", threads) && threads > 1) topt.threads = copt.threads = (unsigned)threads;
+    bool compact = have_opt("compact-derivations");
+    if (have_opt("disk-cache-derivations") || compact) {
       copt.cache_level = WFST::cache_disk;
-      copt.disk_cache_filename = set_default_text("disk-cache-derivations", "/tmp/carmel.derivations.XXXXXX");
-      get_default_opt("disk-cache-bufsize", copt.disk_cache_bufsize, "1M");
-      Config::log() << "Disk cache of derivations will be created at " << copt.disk_cache_filename
-                    << " using read buffer of " << copt.disk_cache_bufsize << " bytes.\n";
+      if (compact) {
+        copt.disk_cache_filename.clear();  // serialize_batch keeps the records in memory
+        Config::log() << "Derivations will be cached in memory, serialized compactly.\n";
+        if (have_opt("disk-cache-derivations"))
+          Config::warn() << "--compact-derivations overrides --disk-cache-derivations.\n";
+      } else {
+        copt.disk_cache_filename = set_default_text("disk-cache-derivations", "/tmp/carmel.derivations.XXXXXX");
+        get_default_opt("disk-cache-bufsize", copt.disk_cache_bufsize, "1M");
+        Config::log() << "Disk cache of derivations will be created at " << copt.disk_cache_filename
+                      << " using read buffer of " << copt.disk_cache_bufsize << " bytes.\n";
+      }
+      if (have_opt("disk-cache-lz4")) {
+        get_default_opt("disk-cache-lz4", copt.disk_cache_lz4, "1M");
+        if (copt.disk_cache_lz4)
+          Config::log() << "Compressing it with lz4 in blocks of " << copt.disk_cache_lz4 << " bytes.\n";
+      }
+      if (have_opt("disk-cache-read-ahead")) {
+        get_default_opt("disk-cache-read-ahead", copt.read_ahead, "16");
+        if (copt.read_ahead)
+          Config::log() << "Reading up to " << std::max(copt.read_ahead, 2u)
+                        << " cached derivations ahead, in a separate thread.\n";
+      }
     }
     return true;
   }
@@ -269,6 +310,8 @@ struct carmel_main {
       gopt.include_self = have_opt("include-self");
       gopt.random_start = have_opt("random-start");
       get_opt("crp-restarts", gopt.restarts);
+      get_opt("crp-threads", gopt.block_threads);
+      get_opt("crp-sync", gopt.sync_every);
       gopt.argmax_final = have_opt("crp-argmax-final");
       gopt.argmax_sum = have_opt("crp-argmax-sum");
       gopt.norm_order = have_opt("norm-order");
@@ -377,22 +420,150 @@ struct carmel_main {
   }
 
   void print_kbest(unsigned kPaths, WFST* result) {
-    unsigned kPathsLeft = kPaths;
-    if (result->valid()) {
-      wfst_paths_printer pp(*result, cout, flags);
-      result->visit_kbest(kPaths, pp);
-      kPathsLeft -= pp.n_paths;
-      if (pp.best_w.isZero())
-        ++n_0prob;
-      else {
-        non0_viterbi_prob(pp.best_w);
+    if (!result_pending) {
+      kbest_stats(write_kbest(cout, kPaths, result));
+      return;
+    }
+    std::ostringstream out;
+    out.copyfmt(cout);
+    Weight best = write_kbest(out, kPaths, result);
+    print_result(out.str(), best);
+  }
+
+  void print_kbest(unsigned kPaths, lazy_cascade& lazy) {
+    if (!result_pending) {
+      kbest_stats(write_kbest(cout, kPaths, lazy));
+      return;
+    }
+    std::ostringstream out;
+    out.copyfmt(cout);
+    Weight best = write_kbest(out, kPaths, lazy);
+    print_result(out.str(), best);
+  }
+
+  // --result-cache=N: the k-best output of the N most recently used distinct -b input lines
+  struct batch_result {
+    std::string out;
+    Weight best;
+    unsigned length;  // input symbols
+  };
+  typedef lru_cache<std::string, batch_result> result_cache_t;
+  result_cache_t result_cache;
+  bool cache_results;
+  bool result_pending;  // the next print_kbest's output is cached for result_key
+  std::string result_key;
+  unsigned result_length;
+
+  // whitespace runs (outside quoted symbols) are all the same; so are leading and trailing ones
+  static std::string normalize_line(std::string const& line) {
+    std::string r;
+    bool quoted = false, space = false;
+    for (std::string::const_iterator i = line.begin(), e = line.end(); i != e; ++i) {
+      char c = *i;
+      if (!quoted && std::isspace((unsigned char)c)) {
+        space = true;
+        continue;
       }
-    } else {
-      n_0prob++;
+      if (space && !r.empty()) r.push_back(' ');
+      space = false;
+      r.push_back(c);
+      if (c == '\\' && quoted && i + 1 != e)
+        r.push_back(*++i);
+      else if (c == '"')
+        quoted = !quoted;
+    }
+    return r;
+  }
+
+  // -b -k with nothing random or kept across lines (other than the viterbi ppx); those lines' output
+  // depends only on the line
+  bool cache_batch_results(int kPaths, unsigned nGenerate) {
+    std::size_t n = result_cache_entries();
+    if (!n || !flags[(unsigned)'b']) return false;
+    if (kPaths < 1 || nGenerate || real_cascade()) goto uncached;
+    {
+      char const* per_line_flags = "tS1cFxygG";
+      for (char const* f = per_line_flags; *f; ++f)
+        if (flags[(unsigned)*f]) goto uncached;
+      char const* per_line_opts[] = {"sum", "post-b", "random-set"};
+      for (unsigned i = 0; i < sizeof(per_line_opts) / sizeof(per_line_opts[0]); ++i) {
+        double v;
+        if (get_opt(per_line_opts[i], v) && v) goto uncached;
+      }
+    }
+    result_cache.set_capacity(n);
+    return cache_results = true;
+  uncached:
+    Config::warn() << "--result-cache only handles -b -k without training, sums, -c/-F or randomness; "
+                      "composing every line.\n";
+    return false;
+  }
+
+  std::size_t result_cache_entries() {
+    double n;
+    return get_opt("result-cache", n) && n >= 1 ? (std::size_t)n : 0;
+  }
+
+  // next, the output for an input line with key (normalized) and length symbols is written and cached
+  void cache_next_result(std::string const& key, unsigned length) {
+    result_pending = true;
+    result_key = key;
+    result_length = length;
+  }
+
+  void print_result(std::string const& out, Weight best) {
+    cout << out;
+    kbest_stats(best);
+    if (!result_pending) return;
+    result_pending = false;
+    batch_result r;
+    r.out = out;
+    r.best = best;
+    r.length = result_length;
+    result_cache.insert(result_key, r);
+  }
+
+  void log_result_cache() {
+    if (!cache_results) return;
+    Config::log() << "--result-cache:";
+    result_cache.stats(Config::log());
+    Config::log() << "\n";
+  }
+
+  // the k best paths to out, then fill lines for any missing.  returns the best path's weight (0 if none)
+  Weight write_kbest(std::ostream& out, unsigned kPaths, WFST* result) {
+    if (!result->valid()) return write_kbest_fill(out, kPaths, 0);
+    wfst_paths_printer pp(*result, out, flags);
+    result->visit_kbest(kPaths, pp);
+    return write_kbest_fill(out, kPaths, &pp);
+  }
+
+  Weight write_kbest(std::ostream& out, unsigned kPaths, lazy_cascade& lazy) {
+    if (!lazy.valid()) return write_kbest_fill(out, kPaths, 0);
+    wfst_paths_printer pp(lazy.result(), out, flags);
+    lazy.visit_kbest(kPaths, pp);
+    return write_kbest_fill(out, kPaths, &pp);
+  }
+
+  Weight write_kbest_fill(std::ostream& out, unsigned kPaths, wfst_paths_printer const* pp) {
+    unsigned kPathsLeft = kPaths;
+    Weight best;
+    if (pp) {
+      kPathsLeft -= pp->n_paths;
+      best = pp->best_w;
     }
     for (unsigned fill = 0; fill < kPathsLeft; ++fill) {
-      if (!(flags[(unsigned)'W'] || flags[(unsigned)'@'])) cout << '0';
-      cout << "\n";
+      if (!(flags[(unsigned)'W'] || flags[(unsigned)'@'])) out << '0';
+      out << "\n";
+    }
+    return best;
+  }
+
+  void kbest_stats(Weight best_w) {
+    if (best_w.isZero())
+      ++n_0prob;
+    else {
+      non0_viterbi_prob(best_w);
     }
   }
 
@@ -532,16 +703,37 @@ struct carmel_main {
 
   bool prunePath() const { return flags[(unsigned)'w'] || flags[(unsigned)'z']; }
 
+  // --lazy-compose: k-best only, with nothing that needs (or changes) the whole composition
+  bool lazy_compose(int kPaths, unsigned nGenerate, WFST* const* chain, unsigned nChain, unsigned nTarget) {
+    if (!have_opt("lazy-compose") || kPaths < 1 || nChain < 2 || nGenerate || real_cascade()) return false;
+    char const* eager_flags = "tSnv1AN%xycgGFpwzC";
+    for (char const* f = eager_flags; *f; ++f)
+      if (flags[(unsigned)*f]) return false;
+    char const* eager_opts[] = {"sum", "post-b", "random-set", "constant-weight", "final-sink", "openfst-roundtrip",
+                                "minimize-compositions", "minimize-all-compositions"};
+    if (WFST::composeLimits.any()) return false;
+    for (unsigned i = 0; i < sizeof(eager_opts) / sizeof(eager_opts[0]); ++i) {
+      double v;
+      if (get_opt(eager_opts[i], v) && v) return false;
+    }
+    for (unsigned i = 0; i < nChain; ++i)
+      if (i != nTarget && !lazy_cascade::costs_nonnegative(*chain[i])) {  // input lines are all 1
+        Config::warn() << "--lazy-compose: arcs with weight > 1; composing eagerly.\n";
+        return false;
+      }
+    return true;
+  }
+
   void normalize(WFST* result) { result->normalize(norm_method); }
 
   void post_train_normalize(WFST* result) {
     if (flags[(unsigned)'t'] && (flags[(unsigned)'p'] || prunePath())) result->normalize(norm_method);
   }
 
-  void maybe_constant_weight(WFST* result) {
-    Weight c;
-    if (get_opt("constant-weight", c)) {
-      Config::log() << "Setting all (non-locked) arcs in result to weight " << c << std::endl;
+  void maybe_constant_weight(WFST* result, std::ostream& log = Config::log()) {
+    if (result_opts.constant_weight) {
+      Weight c = result_opts.weight;
+      log << "Setting all (non-locked) arcs in result to weight " << c << std::endl;
       result->set_constant_weights(c);
     }
   }
@@ -615,8 +807,16 @@ struct carmel_main {
     return true;
   }
 
+  // post_compose for a --threads worker: no sums, --post-b or randomness
+  void post_compose_parallel(WFST* result, std::ostream& log) {
+    maybe_constant_weight(result, log);
+    maybe_sink(result);
+    if (flags[(unsigned)'v']) result->invert();
+    if (flags[(unsigned)'n']) normalize(result);
+  }
+
   void maybe_sink(WFST* result) {
-    if (long_opts["final-sink"]) result->ensure_final_sink();
+    if (result_opts.final_sink) result->ensure_final_sink();
   }
 
 
@@ -625,6 +825,8 @@ struct carmel_main {
     maybe_project(result);
     if (flags[(unsigned)'Y'])
       result->writeGraphViz(o);
+    else if (have_opt("write-binary"))
+      result->writeBinary(o);
     else {
       result->writeLegible(o, show0);
     }
@@ -637,13 +839,14 @@ struct carmel_main {
 
   void minimize(WFST* result) {
     if (flags[(unsigned)'C'])
-      result->consolidateArcs(!long_opts["consolidate-max"], !long_opts["consolidate-unclamped"]);
+      result->consolidateArcs(!result_opts.consolidate_max, !result_opts.consolidate_unclamped);
     if (!flags[(unsigned)'d']) result->reduce();
   }
 
   struct shrink_monitor {
-    shrink_monitor(char const* name, WFST& result, bool print, bool& changed)
-        : name(name), result(result), print(print), changed(changed) {
+    shrink_monitor(char const* name, WFST& result, bool print, bool& changed,
+                   std::ostream& log = Config::log())
+        : name(name), result(result), print(print), changed(changed), log(log) {
       st = result.size();
       arc = result.numArcs();
     }
@@ -651,35 +854,36 @@ struct carmel_main {
     WFST& result;
     bool print;
     bool& changed;
+    std::ostream& log;
     unsigned st, arc;
     ~shrink_monitor() {
       unsigned nst = result.size(), narc = result.numArcs();
       if (nst != st || narc != arc) {
         changed = true;
-        if (print) Config::log() << ' ' << name << "-> " << nst << '/' << narc;
+        if (print) log << ' ' << name << "-> " << nst << '/' << narc;
       }
     }
   };
 
 
   bool shrink(WFST* result, bool print = true, bool do_prune = true, bool openfst_min = false,
-              char const* end = "\n") {
+              char const* end = "\n", std::ostream& log = Config::log()) {
     WFST& w = *result;
     bool changed = false;
     print = print && !flags[(unsigned)'q'];
     {
-      shrink_monitor m("reduce", w, print, changed);
+      shrink_monitor m("reduce", w, print, changed, log);
       minimize(result);
     }
     if (do_prune) {
-      shrink_monitor m("prune", w, print, changed);
+      shrink_monitor m("prune", w, print, changed, log);
       prune(result);
     }
     if (openfst_min) {
-      shrink_monitor m("openfst-minimize", w, print, changed);
+      shrink_monitor m("openfst-minimize", w, print, changed, log);
       openfst_minimize(result);
     }
-    if (print) Config::log() << end;
+    if (print) log << end;
     return changed;
   }
 
@@ -744,10 +948,50 @@ struct carmel_main {
     prod_sum_pre = 1;
     number_from = 0;
     no_compose = false;
+    cache_results = false;
+    result_pending = false;
+  }
+
+  void parse_compose_opts() {
+    compose_limits& l = WFST::composeLimits;
+    std::string text;
+    if (set_text("compose-beam", text)) {  // e.g. 10ln, which get_opt can't read
+      Weight beam;
+      readParam(&beam, text.c_str(), 0);
+      l.beam = std::fabs(beam.getLogImp());  // a probability-like 1e-3 means 1000
+    }
+    double n;
+    if (get_opt("compose-layer-states", n) && n >= 1) l.layer_states = (unsigned)n;
+    if (get_opt("compose-max-states", n) && n >= 1) l.max_states = (unsigned)n;
+    if (have_opt("compose-max-bytes")) {
+      size_t_bytes b;
+      get_default_opt("compose-max-bytes", b, "0");
+      l.max_bytes = b;
+    }
+  }
+
+  // the options minimize, maybe_constant_weight and maybe_sink use, read once so that --threads workers
+  // never look in (or, with operator[], insert into) long_opts
+  struct result_options {
+    bool consolidate_max, consolidate_unclamped;
+    bool constant_weight;
+    Weight weight;  // for constant_weight
+    bool final_sink;
+  };
+  result_options result_opts;
+
+  void parse_result_opts() {
+    double v;
+    result_opts.consolidate_max = get_opt("consolidate-max", v) && v;
+    result_opts.consolidate_unclamped = get_opt("consolidate-unclamped", v) && v;
+    result_opts.constant_weight = get_opt("constant-weight", result_opts.weight);
+    result_opts.final_sink = get_opt("final-sink", v) && v;
   }
 
   void parse_opts() {
+    parse_result_opts();
     parse_cache_opts();
+    parse_compose_opts();
     parse_gibbs_opts();
     parse_fem_opts();
     no_compose = have_opt("no-compose");
@@ -857,6 +1101,341 @@ struct carmel_main {
   void write_trained(std::string const& suffix = "trained") {
     fems.write_trained(suffix, flags, fem_filenames.begin(), show0);
   }
+
+  // --threads=N: number of parallel_batch workers, or 0 to process -b lines one at a time.  only for -k
+  // output with nothing that keeps totals across lines (other than the viterbi ppx) or draws random numbers
+  unsigned batch_threads(int kPaths, unsigned nGenerate) {
+    double n;
+    if (!get_opt("threads", n) || n < 2) return 0;
+    if (!flags[(unsigned)'b'] || kPaths < 1 || nGenerate || real_cascade()) return 0;
+    char const* serial_flags = "tS1cgGwz";
+    for (char const* f = serial_flags; *f; ++f)
+      if (flags[(unsigned)*f]) goto serial;
+    {
+      char const* serial_opts[] = {"sum", "post-b", "random-set", "openfst-roundtrip", "minimize-compositions",
+                                   "minimize-all-compositions"};
+      for (unsigned i = 0; i < sizeof(serial_opts) / sizeof(serial_opts[0]); ++i) {
+        double v;
+        if (get_opt(serial_opts[i], v) && v) goto serial;
+      }
+    }
+    return (unsigned)n;
+  serial:
+    Config::warn() << "--threads only handles -b -k without training, sums, path pruning or randomness; using "
+                      "1 thread.\n";
+    return 0;
+  }
+
+  // --precompose: -b with at least two transducers besides the input line, and nothing that composes (or
+  // prunes) differently for the whole cascade than for the input line's part of it
+  bool precompose_ok(unsigned nChain, unsigned nTarget) {
+    if (!have_opt("precompose") || !flags[(unsigned)'b'] || !~nTarget || nChain < 3 || real_cascade())
+      return false;
+    char const* per_line_flags = "tSApwz";
+    for (char const* f = per_line_flags; *f; ++f)
+      if (flags[(unsigned)*f]) {
+        Config::warn() << "--precompose: not with -" << *f << "; composing each line with every transducer.\n";
+        return false;
+      }
+    return true;
+  }
+
+  // true if file exists and is no older than any of inputs
+  static bool up_to_date(std::string const& file, std::vector<char const*> const& inputs) {
+    struct stat f, in;
+    if (stat(file.c_str(), &f)) return false;
+    for (unsigned i = 0; i < inputs.size(); ++i)
+      if (stat(inputs[i], &in) || !S_ISREG(in.st_mode) || in.st_mtime > f.st_mtime) return false;
+    return true;
+  }
+
+  // first line of a --precompose-cache: the options and transducer files the composition was made with.
+  // padded so that with its newline it's a multiple of 8 long, and the binary image after it stays aligned
+  std::string precompose_key(std::vector<char const*> const& names) {
+    std::ostringstream k;
+    k << "carmel precompose-cache";
+    for (char const* f = "amrCdK"; *f; ++f) k << " -" << *f << flags[(unsigned)*f];
+    char const* ol[] = {"minimize-compositions", "minimize-all-compositions", "minimize-sum", "consolidate-max",
+                        "consolidate-unclamped"};
+    for (unsigned i = 0; i < sizeof(ol) / sizeof(ol[0]); ++i) k << " --" << ol[i] << "=" << long_opts[ol[i]];
+    // what changes the transducers as they're loaded (-K above)
+    char const* tl[] = {"exponents", "normby", "load-fem-param", "number-from"};
+    for (unsigned i = 0; i < sizeof(tl) / sizeof(tl[0]); ++i)
+      k << " --" << tl[i] << "=" << text_long_opts[tl[i]];
+    k << " --freeze-arcs=" << have_opt("freeze-arcs") << " :";
+    for (unsigned i = 0; i < names.size(); ++i) k << " " << names[i];
+    std::string key = k.str();
+    key.resize((key.size() + 8) / 8 * 8 - 1, ' ');
+    return key;
+  }
+
+  // the composition of all of chain but chain[nTarget], composed in the same order as the per-line loop
+  // would (or loaded from --precompose-cache, if that's newer than all of them and any --load-fem-param,
+  // and was made with the same options and files).  NEW; NULL if invalid
+  WFST* precompose(std::vector<WFST*> const& chain, unsigned nTarget, std::vector<char const*> const& names) {
+    std::vector<WFST*> fixed;
+    std::vector<char const*> fixed_names;
+    for (unsigned i = 0; i < chain.size(); ++i)
+      if (i != nTarget) {
+        fixed.push_back(chain[i]);
+        fixed_names.push_back(names[i]);
+      }
+    unsigned n = fixed.size();
+    bool q = flags[(unsigned)'q'], r = flags[(unsigned)'r'];
+    std::string cache;
+    std::string key = precompose_key(fixed_names), line;
+    std::vector<char const*> deps(fixed_names);
+    if (!fem_inparam.empty()) deps.push_back(fem_inparam.c_str());
+    if (set_text("precompose-cache", cache) && long_opts["random-set"]) {
+      Config::warn() << "--precompose-cache: not with --random-set; composing without it.\n";
+      cache.clear();
+    }
+    if (!cache.empty() && up_to_date(cache, deps)) {
+      ifstream in(cache.c_str(), std::ios::binary);
+      if (getline(in, line) && line == key) {
+        WFST* w = NEW WFST();
+        if (WFST::is_binary(in) && w->readBinary(cache, key.size() + 1)) {
+          if (!q) Config::log() << "Precomposed cascade loaded from " << cache << std::endl;
+          return w;
+        }
+        delete w;
+      } else if (!q)
+        Config::log() << "--precompose-cache " << cache << " was made with other options or transducers\n";
+    }
+    if (!q) Config::log() << "Precomposing the " << n << " transducers besides the input line";
+    cascade_parameters cascade;  // trivial
+    cascade.prepare_compose();
+    WFST* result = r ? fixed[n - 1] : fixed[0];
+    bool om = long_opts["minimize-compositions"] || long_opts["minimize-all-compositions"];
+    for (unsigned i = (r ? n - 2 : 1); r ? ~i : i < n; r ? --i : ++i) {
+      WFST& t1 = r ? *fixed[i] : *result;
+      WFST& t2 = r ? *result : *fixed[i];
+      WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a']);
+      if (result != fixed[r ? n - 1 : 0]) delete result;
+      result = next;
+      if (!q) Config::log() << "\n\t(" << result->size() << " states / " << result->numArcs() << " arcs";
+      if (!result->valid()) {
+        Config::warn() << ")\n--precompose: empty or invalid result of composition with transducer \""
+                       << fixed_names[i] << "\"; composing each line with every transducer.\n";
+        delete result;
+        return 0;
+      }
+      shrink(result, true, false, om, ")");
+    }
+    if (!q) Config::log() << std::endl;
+    if (!cache.empty()) {
+      std::ofstream out(cache.c_str(), std::ios::binary);
+      out << key << '\n';
+      result->writeBinary(out);
+      if (!out) Config::warn() << "--precompose-cache: couldn't write " << cache << "\n";
+    }
+    return result;
+  }
+};
+
+// --threads=N: -b input lines are composed with the cascade, and their k-best paths found, by N workers.
+// the cascade (every transducer but the input line) is shared and only read; each line gets its own
+// composition results and scratch.  a bounded window of lines is in flight; each line's output and log
+// text is buffered, and written (and counted in the viterbi ppx) in input order by the reading thread
+struct parallel_batch {
+  struct line {
+    unsigned lineno;
+    std::string text;
+    std::ostringstream out, log;
+    unsigned length;  // input symbols
+    Weight best;
+    bool done, bad;
+    bool cached;  // out is from --result-cache
+    std::string key;
+  };
+
+  // lazy: --lazy-compose, with the chain's costs_to_final (all but nTarget's)
+  parallel_batch(carmel_main& cm, bool* flags, WFST* const* _chain, unsigned nChain, unsigned nTarget, int kPaths,
+                 lazy_cascade::final_costs const* lazy, WFST* weightSource, int labelStart)
+      : cm(cm)
+      , flags(flags)
+      , chain(nChain)
+      , nTarget(nTarget)
+      , kPaths(kPaths)
+      , lazy(lazy)
+      , weightSource(weightSource)
+      , labelStart(labelStart)
+      , eof(false) {
+    for (unsigned i = 0; i < nChain; ++i) chain[i] = i == nTarget ? 0 : _chain[i];
+  }
+
+  // reads lines until EOF; false if one couldn't be parsed (after writing everything before it)
+  bool run(std::istream& in, unsigned nThreads, unsigned& input_lineno) {
+    thread_group workers;
+    for (unsigned i = 0; i < nThreads; ++i) workers.create_thread(&parallel_batch::worker, this);
+    std::size_t max_window = 4 * nThreads;
+    bool ok = true;
+    std::string buf;
+    while (ok) {
+      bool more = (bool)getline(in, buf);
+      std::unique_lock<std::mutex> lock(mutex);
+      if (more) {
+        line* l = NEW line;
+        l->lineno = ++input_lineno;
+        l->text.swap(buf);
+        l->done = l->bad = l->cached = false;
+        window.push_back(l);
+        if (!from_cache(*l)) {
+          todo.push_back(l);
+          work.notify_one();
+        }
+      } else {
+        eof = true;
+        work.notify_all();
+      }
+      while (!window.empty() && (window.front()->done || window.size() >= max_window || !more)) {
+        while (!window.front()->done) finished.wait(lock);
+        line* l = window.front();
+        window.pop_front();
+        lock.unlock();
+        ok = ok && write(*l);
+        delete l;
+        lock.lock();
+      }
+      if (!more) break;
+    }
+    if (!ok) {
+      std::lock_guard<std::mutex> lock(mutex);
+      eof = true;
+      todo.clear();
+      work.notify_all();
+    }
+    workers.join_all();
+    for (std::deque<line*>::iterator i = window.begin(), e = window.end(); i != e; ++i) delete *i;
+    return ok;
+  }
+
+ private:
+  carmel_main& cm;
+  bool* flags;
+  std::vector<WFST*> chain;  // NULL at nTarget
+  unsigned nTarget;
+  int kPaths;
+  lazy_cascade::final_costs const* lazy;  // NULL: compose eagerly
+  WFST* weightSource;
+  int labelStart;
+
+  std::mutex mutex;
+  std::condition_variable work, finished;
+  std::deque<line*> window;  // input order, not yet written
+  std::deque<line*> todo;
+  bool eof;
+
+  bool write(line& l) {
+    if (l.bad) {
+      Config::warn() << "Couldn't handle input line: " << l.text << "\n";
+      return false;
+    }
+    Config::log() << l.log.str();
+    if (cm.cache_results && !l.cached) cm.cache_next_result(l.key, l.length);
+    cm.print_result(l.out.str(), l.best);
+    cm.n_symbols += l.length;
+    return true;
+  }
+
+  // the cache is only used by the reading thread (here and in write)
+  bool from_cache(line& l) {
+    if (!cm.cache_results) return false;
+    l.key = carmel_main::normalize_line(l.text);
+    carmel_main::batch_result const* c = cm.result_cache.find(l.key);
+    if (!c) return false;
+    if (!flags[(unsigned)'q']) l.log << "Input line " << l.lineno << ": " << l.text << "\t(cached)" << std::endl;
+    l.out << c->out;
+    l.best = c->best;
+    l.length = c->length;
+    return l.cached = l.done = true;
+  }
+
+  void worker() {
+    WFST::output_format(flags);  // per-thread defaults
+    for (;;) {
+      line* l;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (todo.empty() && !eof) work.wait(lock);
+        if (todo.empty()) return;
+        l = todo.front();
+        todo.pop_front();
+      }
+      process(*l);
+      std::lock_guard<std::mutex> lock(mutex);
+      l->done = true;
+      finished.notify_one();
+    }
+  }
+
+  void process(line& l) {
+    bool q = flags[(unsigned)'q'], r = flags[(unsigned)'r'];
+    l.out.copyfmt(cout);
+    l.log.copyfmt(Config::log());
+    l.log.tie(0);  // (copyfmt copies cerr's tie to cout, which the main thread is writing)
+    WFST* target;
+    if (flags[(unsigned)'P']) {
+      target = NEW WFST(l.text.c_str(), l.length, 1);
+    } else {
+      target = NEW WFST(l.text.c_str());
+      l.length = target->numStates() - 1;
+    }
+    if (!target->valid()) {
+      l.bad = true;
+      delete target;
+      return;
+    }
+    if (!q) l.log << "Input line " << l.lineno << ": " << l.text;
+    std::vector<WFST*> c(chain);
+    c[nTarget] = target;
+    unsigned nChain = c.size();
+    cm.minimize(target);  // the starting result, as in the serial loop (-b: always the input line)
+    if (nChain < 2) cm.prune(target);
+    if (lazy) {
+      if (!q) l.log << std::endl;
+      lazy_cascade lc(&c[0], nChain, r, flags[(unsigned)'m'], flags[(unsigned)'a'], lazy);
+      l.best = cm.write_kbest(l.out, kPaths, lc);
+      if (!q)
+        l.log << "\t(lazy: expanded " << lc.n_expanded() << " of " << lc.n_states() << " states)" << std::endl;
+      delete target;
+      return;
+    }
+    cascade_parameters cascade;  // trivial
+    WFST* result = r ? c[nChain - 1] : c[0];
+    bool first = true;
+    for (unsigned i = (r ? nChain - 2 : 1); (r ? ~i : i < nChain) && result->valid();
+         (r ? --i : ++i), first = false) {
+      WFST& t1 = (r ? *c[i] : *result);
+      WFST& t2 = (r ? *result : *c[i]);
+      WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a']);
+      if (!first) delete result;
+      result = next;
+      if (!q) l.log << "\n\t(" << result->size() << " states / " << result->numArcs() << " arcs";
+      if (!result->valid()) {
+        l.log << ")\nEmpty or invalid result of composition with transducer \"" << cm.filenames[i] << "\".\n";
+        break;
+      }
+      bool nok = i != (r ? 0 : nChain - 1);
+      cm.shrink(result, true, nok, false, ")", l.log);
+    }
+    if (result->valid()) {
+      if (!q) l.log << std::endl;
+      cm.post_compose_parallel(result, l.log);
+      if (weightSource) result->assignWeights(*weightSource);
+      if (flags[(unsigned)'N']) {
+        if (labelStart > 0)
+          result->numberArcsFrom(labelStart);
+        else if (labelStart == 0)
+          result->lockArcs();
+        else
+          result->unTieGroups();
+      }
+    }
+    l.best = cm.write_kbest(l.out, kPaths, result);
+    if (result != target) delete result;
+    delete target;
+  }
 };
 
 
@@ -1194,7 +1773,11 @@ int
     for (i = 0; i < nInputs; ++i) {
       if (i != nTarget) {
         WFST* w = chain + i;
-        PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K']);
+        if (inputs[i] != &cin && WFST::is_binary(*inputs[i])) {
+          PLACEMENT_NEW(w) WFST();
+          w->readBinary(filenames[i]);
+        } else
+          PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K']);
         cm.fem_add(w, filenames[i]);
         if (i < exponents.size()) w->raisePower(exponents[i]);
         if (!flags[(unsigned)'m'] && nInputs > 1) w->unNameStates();
@@ -1243,11 +1826,52 @@ int
 
     cm.fem_in();
 
+    if (cm.have_opt("freeze-arcs") && !flags[(unsigned)'t'])
+      for (i = 0; i < nChain; ++i)
+        if (i != nTarget) chain[i].freeze();
+
+    // what each input line is composed with: chain, or (--precompose) the input line and the composition of
+    // the rest.  iTarget is the input line's position
+    std::vector<WFST*> chain_p(nChain);
+    std::vector<char const*> chain_names(nChain);
+    for (i = 0; i < nChain; ++i) {
+      chain_p[i] = chain + i;
+      chain_names[i] = filenames[i];
+    }
+    unsigned iTarget = nTarget;
+    WFST* precomposed = 0;
+    if (cm.precompose_ok(nChain, nTarget) && (precomposed = cm.precompose(chain_p, nTarget, chain_names))) {
+      iTarget = flags[(unsigned)'r'] ? 1 : 0;
+      chain_p.resize(2);
+      chain_p[iTarget] = chain + nTarget;
+      chain_p[1 - iTarget] = precomposed;
+      chain_names.resize(2);
+      chain_names[iTarget] = filenames[nTarget];
+      chain_names[1 - iTarget] = "(precomposed)";
+    }
+    unsigned nCompose = chain_p.size();
+    bool lazy = cm.lazy_compose(kPaths, nGenerate, &chain_p[0], nCompose, iTarget);
+    // A* heuristics for the machines that stay as they are; the input line's, and the first's (which
+    // cm.minimize may change), are computed per lazy_cascade
+    std::vector<lazy_cascade::final_costs> to_final(nCompose);
+    if (lazy)
+      for (i = 0; i < nCompose; ++i)
+        if (i != iTarget && i != (flags[(unsigned)'r'] ? nCompose - 1 : 0))
+          lazy_cascade::costs_to_final(*chain_p[i], to_final[i]);
+    unsigned nThreads = cm.batch_threads(kPaths, nGenerate);
+    cm.cache_batch_results(kPaths, nGenerate);
+
     if (cm.no_compose) {
       cm.fem_stats();
     } else {
       if (cm.have_opt("cascade-stats")) cm.fem_stats();
       for (;;) {  // input transducer from string line reading loop
+        if (nThreads) {  // all the lines at once
+          parallel_batch batch(cm, flags, &chain_p[0], nCompose, iTarget, kPaths, lazy ? &to_final[0] : 0,
+                               flags[(unsigned)'A'] ? weightSource : 0, labelStart);
+          if (!batch.run(*line_in, nThreads, input_lineno)) return -3;
+          goto fail_ntarget;
+        }
         if (~nTarget) {  // if to construct a finite state from input
           if (!*line_in) {
           fail_ntarget:
@@ -1259,6 +1883,18 @@ int
           //*line_in >> ws; // changed in Carmel 6.9 - don't skip empty lines; we want to treat them as the
           // same as a line with *e* on it (empty string)
           if (!getline(*line_in, buf)) goto fail_ntarget;
+          std::string key;
+          if (cm.cache_results) {
+            key = carmel_main::normalize_line(buf);
+            if (carmel_main::batch_result const* c = cm.result_cache.find(key)) {  // skip it all
+              ++input_lineno;
+              cm.n_symbols += c->length;
+              if (!flags[(unsigned)'q'])
+                Config::log() << "Input line " << input_lineno << ": " << buf << "\t(cached)" << std::endl;
+              cm.print_result(c->out, c->best);
+              continue;
+            }
+          }
           unsigned length;
           if (flags[(unsigned)'P']) {  // need a permutation lattice instead
             PLACEMENT_NEW(&chain[nTarget]) WFST(buf.c_str(), length, 1);
@@ -1268,6 +1904,7 @@ int
             // it.  each addl letter adds 1 state.
           }
           cm.n_symbols += length;
+          if (cm.cache_results) cm.cache_next_result(key, length);
 
           CHECKLEAK(input_lineno);
           ++input_lineno;
@@ -1285,14 +1922,14 @@ int
 
 
         bool r = flags[(unsigned)'r'];
-        result = (r ? &chain[nChain - 1] : &chain[0]);
+        result = r ? chain_p[nCompose - 1] : chain_p[0];
         cm.minimize(result);
         if (nInputs < 2) cm.prune(result);
 #ifdef DEBUGCOMPOSE
         Config::debug() << "\nStarting composition chain: result is chain[" << (unsigned)(result - chain) << "]\n";
 #endif
 
-        if (nChain < 2 && !cascade.trivial) {
+        if (nCompose < 2 && !cascade.trivial) {
           cascade.set_trivial();
         }
 
@@ -1300,7 +1937,7 @@ int
         bool first = true;
         cascade.add(result);
         bool anycomposed = false;
-        for (i = (r ? nChain - 2 : 1); (r ? ~i : i < nChain) && result->valid();
+        for (i = (r ? nCompose - 2 : 1); !lazy && (r ? ~i : i < nCompose) && result->valid();
              (r ? --i : ++i), first = false) {
           // composition loop
           ++n_compositions;
@@ -1308,13 +1945,13 @@ int
           Config::debug() << "----------\ncomposing result with chain[" << i << "] into next\n";
 #endif
           // composition happens here:
-          cascade.add(chain + i);
+          cascade.add(chain_p[i]);
           if (first)
             cascade.prepare_compose();
           else
             cascade.prepare_compose(r);
-          WFST& t1 = (r ? chain[i] : *result);
-          WFST& t2 = (r ? *result : chain[i]);
+          WFST& t1 = (r ? *chain_p[i] : *result);
+          WFST& t2 = (r ? *result : *chain_p[i]);
           WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a']);
 #ifndef NODELETE
 #ifdef DEBUGCOMPOSE
@@ -1336,12 +1973,12 @@ int
 #endif
 
           if (!result->valid()) {
-            Config::warn() << ")\nEmpty or invalid result of composition with transducer \"" << filenames[i]
+            Config::warn() << ")\nEmpty or invalid result of composition with transducer \"" << chain_names[i]
                            << "\".\n";
             cm.print_kbest(kPaths, result);
             goto nextInput;
           }
-          bool finalcompose = i == (r ? 0 : nChain - 1);
+          bool finalcompose = i == (r ? 0 : nCompose - 1);
           bool om = long_opts["minimize-compositions"] >= n_compositions
                     || long_opts["minimize-all-compositions"];
           bool nok = !(kPaths > 0 && finalcompose);
@@ -1353,6 +1990,15 @@ int
                                              || long_opts["train-cascade-compress-always"]);
           anycomposed = true;
         }
+        if (lazy) {
+          if (!flags[(unsigned)'q']) Config::log() << std::endl;
+          lazy_cascade lc(&chain_p[0], nCompose, r, flags[(unsigned)'m'], flags[(unsigned)'a'], &to_final[0]);
+          cm.print_kbest(kPaths, lc);
+          if (!flags[(unsigned)'q'])
+            Config::log() << "\t(lazy: expanded " << lc.n_expanded() << " of " << lc.n_states() << " states)"
+                          << std::endl;
+          goto nextInput;
+        }
         if (!anycomposed) cascade.set_composed(result);
         if (!flags[(unsigned)'q']) Config::log() << std::endl;
 
@@ -1393,20 +2039,40 @@ int
           if (flags[(unsigned)'S']) {
             n_pairs = 0;
             if (pairStream) {
+              std::size_t n_cache = cm.result_cache_entries();
+              lru_cache<std::string, Weight> sums(n_cache);  // by normalized input line \n output line
+              string outbuf;
               for (;;) {
                 getline(*pairStream, buf);
                 if (!*pairStream) break;
                 ++input_lineno;
-                WFST::symbol_ids ins(*result, buf.c_str(), kInput, input_lineno);
-                getline(*pairStream, buf);
+                getline(*pairStream, outbuf);
                 if (!*pairStream) break;
                 ++input_lineno;
-                WFST::symbol_ids outs(*result, buf.c_str(), kOutput, input_lineno);
-                Weight prob = result->sumOfAllPaths(ins, outs);
+                Weight const* cached = 0;
+                std::string key;
+                if (n_cache) {
+                  key = carmel_main::normalize_line(buf) + '\n' + carmel_main::normalize_line(outbuf);
+                  cached = sums.find(key);
+                }
+                Weight prob;
+                if (cached)
+                  prob = *cached;
+                else {
+                  WFST::symbol_ids ins(*result, buf.c_str(), kInput, input_lineno - 1);
+                  WFST::symbol_ids outs(*result, outbuf.c_str(), kOutput, input_lineno);
+                  prob = result->sumOfAllPaths(ins, outs);
+                  if (n_cache) sums.insert(key, prob);
+                }
                 ++n_pairs;
                 prod_prob *= prob;
                 cout << prob << std::endl;
               }
+              if (n_cache) {
+                Config::log() << "--result-cache:";
+                sums.stats(Config::log());
+                Config::log() << "\n";
+              }
             } else {
               List<unsigned> empty_list;
               n_pairs = 1;
@@ -1505,8 +2171,8 @@ int
         // WFSTs. That is why we check if the result is one of them and if it is
         // we don't delete it.
         isInChain = false;
-        for (unsigned i = 0; i < nChain; i++)
-          if (result == &chain[i]) isInChain = true;
+        for (unsigned i = 0; i < nCompose; i++)
+          if (result == chain_p[i]) isInChain = true;
         if (!isInChain) {
 #ifdef DEBUGCOMPOSE
           Config::debug() << "deleting result at end of processing\n";
@@ -1523,6 +2189,7 @@ int
         if (!flags[(unsigned)'b']) break;
       }  // end of all input
       cm.report_batch();
+      cm.log_result_cache();
     }
 
     cm.fem_out();
@@ -1533,6 +2200,7 @@ int
     }
 
 #ifndef NODELETE
+    delete precomposed;
     for (i = 0; i < nChain; ++i)
       if (i != nTarget) chainMemory[i].~WFST();
 //  if ( flags[(unsigned)'A'] )
@@ -1650,8 +2318,8 @@ void usageHelp(void) {
           "results\n\t\tdefault seed = current time\n-L n\t\twhile generating input/output p";
   cout << "airs with -g or -G, give up if\n\t\tfinal state isn't reached after n steps (default n=1000)\n-T "
           "n\t\tduring composit";
-  cout << "ion, index arcs in a hash table when the\n\t\tproduct of the num";
-  cout << "ber of arcs of two states is greater than n \n\t\t(by default, n";
+  cout << "ion, when a state has more than n arcs, match\n\t\tthe other's labels in it by galloping ";
+  cout << "(doubling then\n\t\tbinary) search; smaller ones are scanned (by default, n";
   cout << " = 32)\n-N n\t\tassign each arc in the result transducer a uniq";
   cout << "ue parameter-tie group number\n\t\tstarting at n and counting up.  If n is 0 (";
   cout << "the special group\n\t\tfor unchangeable arcs), all the arcs are ";
@@ -1764,6 +2432,24 @@ void usageHelp(void) {
   cout << "\n--matrix-fb : use a n*m*s matrix (n=input sentence length, m=output len, s=# states) for "
           "training, rather than a sparse derivations lattice (not recommended, but may be faster in some "
           "cases without caching i.e. -: or -?)";
+  cout << "\n--scaled-fb : compute training forward/backward over the derivations lattice with doubles kept in "
+          "range by power-of-2 scale factors, instead of logarithms.  usually faster; results "
+          "may differ in the last digits";
+  cout << "\n--log-sum-fb : in training forward/backward (without --scaled-fb), sum all the paths into a state "
+          "at once, as max + log(1 + sum(exp(w - max))): one exp per arc but the largest and one log per state, "
+          "instead of an exp and a log per arc.  --log-sum-fb=fast uses polynomial exp and log (within 2e-8 of "
+          "the exact log sum), also when merging --threads count blocks.  results may differ in the last digits";
+  cout << "\n--online-em=1000 : stepwise (online) EM: reestimate the weights after every this many training "
+          "examples, from a running average of expected counts (starting from the initial weights) that moves "
+          "toward each batch's by step size (k+1)^-alpha for the k-th batch.  an iteration (-M) is one pass over the corpus; its perplexity is "
+          "accumulated while the weights change.  often reaches batch EM's perplexity in a few passes"
+          "\n--online-em-alpha=.7 : the step size exponent alpha for --online-em, in (.5,1]; smaller forgets "
+          "earlier batches faster";
+  cout << "\n--squarem : accelerate EM (SQUAREM): after every 2 EM steps, extrapolate the weights along them, "
+          "with a step length estimated from how the 2 steps differ (and limited to 4 times the last limit "
+          "it reached).  if the next E-step shows no improvement, go back to the plain EM step.  the number "
+          "of E-steps at extrapolated weights and their mean step length are logged.  not with -o, "
+          "--online-em or --train-cascade";
   cout << "\n"
           "--disk-cache-derivations=/tmp/derivations.template.XXXXXX : use the provided filename (optional) "
           "to cache more derivations than would fit into memory.  XXXXXX is replaced with a "
@@ -1771,6 +2457,14 @@ void usageHelp(void) {
           "\n"
           "--disk-cache-bufsize=1M : unless 0, replace the default file read buffer with one of this many "
           "bytes (k=1000, K = 1024, M=1024K, etc)"
+          "\n--disk-cache-lz4=1M : with --disk-cache-derivations, compress the cache file with lz4, in blocks "
+          "of this many bytes.  the bytes and the time spent on I/O and on lz4 are logged for each iteration"
+          "\n--compact-derivations : cache derivations in memory, but serialized as for "
+          "--disk-cache-derivations: only states and arc ids, delta coded, which is several times smaller "
+          "than -? or -: (but slower to read back, and no --threads).  may be combined with --disk-cache-lz4"
+          "\n--disk-cache-read-ahead=16 : with --disk-cache-derivations or --compact-derivations, a thread reads "
+          "(and decompresses) this many (at least 2) derivations ahead of the one being used, so that reading "
+          "overlaps with computing"
           "\n--cache-no-prune : don't prune unreachable states in derivation cache (not recommended)."
           "\n";
   cout << "\n"
@@ -1786,6 +2480,41 @@ void usageHelp(void) {
   cout << "\n"
           "--sum : show (before and after --post-b) product of final transducer's sum-of-paths "
           "(acyclic-correct only), as prob and per-input-ppx.\n"
+          "--freeze-arcs : after loading (and any --normby etc.), pack the arcs of each input transducer "
+          "into one contiguous array sorted by (source, input, output), for faster read-only use (-b "
+          "composition, k-best, sum of paths).  anything that modifies a transducer unpacks it again.  "
+          "ignored when training\n"
+          "--write-binary : write the resulting transducer in carmel's binary format instead of text (to the "
+          "output file, or stdout).  an input transducer file in binary format is recognized and memory-mapped "
+          "instead of parsed: loading is nearly instant, and it is shared by concurrent carmel processes.  "
+          "binary transducers are only read by builds of carmel with the same weight type\n"
+          "--lazy-compose : for -k (and -b -k) only, compose on the fly: search for the best paths through the "
+          "composition of all the inputs, computing each composed state's arcs only when the search first leaves "
+          "it (A*, guided by each input's best costs to its final state).  much less work when k is small.  "
+          "falls back to normal composition with training, --sum, -S, pruning (incl. --compose-*), -n, and other "
+          "options that need the whole result, or if any arc has weight > 1\n"
+          "--compose-beam=10ln : while composing, expand the states a breadth-first layer at a time, and only "
+          "those whose best path from the start is within this ratio of the layer's best (compare -w, which "
+          "prunes only after the whole composition exists).  a ratio below 1 means its reciprocal\n"
+          "--compose-layer-states=N : while composing, expand only the N best states of each breadth-first "
+          "layer\n"
+          "--compose-max-states=N : stop expanding a composition once it has N states\n"
+          "--compose-max-bytes=4G : stop expanding a composition once it (roughly) uses this much memory.  "
+          "the unexpanded states are dead ends, and are removed\n"
+          "--precompose : with -b, compose the transducers besides the input line once, up front (reduced, and "
+          "openfst-minimized with --minimize-compositions), so each line needs only one composition.  a win when "
+          "that composition is small; not with training, -A, -p/-w/-z\n"
+          "--precompose-cache=file : with --precompose, load the composition from this file (binary format) if "
+          "it's newer than all of those transducers' files (and --load-fem-param) and was made from the same files "
+          "with the same composition and loading options (-K, --exponents, --normby ...); otherwise write it "
+          "there.  not with --random-set\n"
+          "--result-cache=N : with -b -k, remember the output for the N most recently used distinct input "
+          "lines (ignoring extra whitespace), so repeated lines skip composition and search; with -S, the sums "
+          "for the N most recent distinct pairs.  not with training, --sum, -c, -F, -1, --random-set or --post-b\n"
+          "--threads=N : use N threads for -b -k (N lines at a time, output in input order), for training "
+          "with derivations cached in memory, for building the derivation cache, and for -! and "
+          "--crp-restarts restarts.  whatever can't be split uses 1 thread.  trained weights are the same for "
+          "any N > 1, but may differ from 1 thread's in the last digits\n"
 
       ;
 
@@ -1827,7 +2556,16 @@ void usageHelp(void) {
          "derivation from initial weights).  typical settings are --burnin=2000 -M 10000\n"
          "--crp-restarts : number of additional runs (0 means just 1 run), using cache-prob at the final "
          "iteration select the best for .trained and --print-to output.  --init-em affects each start.  "
-         "TESTME: print-every with path weights may screw up start weights\n"
+         "TESTME: print-every with path weights may screw up start weights.  with --threads, restarts after "
+         "the first draw from their own random streams (so differ from 1 thread), and are logged in order when "
+         "all are done\n"
+         "--crp-threads=n : (approximate) split the examples among n threads, each resampling its examples "
+         "against its own copy of the counts; the threads' samples are merged into the counts every "
+         "--crp-sync examples.  needs derivations in memory.  the log shows how stale (total count "
+         "difference) the threads' counts got\n"
+         "--crp-sync=n : with --crp-threads, merge after each thread resamples n examples (default 0: 16 "
+         "times per iteration).  merging less often is faster, but the threads' staler counts can leave the "
+         "chain at a worse corpus prob than 1 thread's\n"
          "--high-temp=n : (default 1) raise probs to 1/temp power before making each choice - deterministic "
          "annealing for --unsupervised\n"
          "--low-temp=n : (default 1) temperature at final iteration (linear interpolation from high->low)\n"
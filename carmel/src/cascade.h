@@ -140,10 +140,10 @@ struct cascade_parameters {
       o << "#" << b.id;
       return;
     }
-    const List<GraphArc>& st = states[s].arcs;
+    const GraphState::arcs_type& st = states[s].arcs;
     bool ornode = st.has2();
     if (ornode) o << "(OR";
-    for (List<GraphArc>::const_iterator l = st.const_begin(), end = st.const_end(); l != end; ++l) {
+    for (GraphState::arcs_type::const_iterator l = st.const_begin(), end = st.const_end(); l != end; ++l) {
       if (ornode) o << " ";
       GraphArc const& a = *l;
       chain_t p = (*this)[arcs.ac(a).arc];
@@ -374,6 +374,7 @@ struct cascade_parameters {
       : pcomposed(0)
       , debug(debug)  //,tempnode(NULL,NULL)
   {
+    prepare_compose();  // a trivial cascade is never prepared but still passed to compose
     if ((trivial = !remember_cascade)) return;
 
     // chains.push_back(0); // we don't mind using a 0 index since we don't use groupids at all when cascade
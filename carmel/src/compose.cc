@@ -9,8 +9,7 @@
 namespace graehl {
 
 unsigned WFST::indexThreshold = 12;
-unsigned TrioKey::gAStates = 0;
-unsigned TrioKey::gBStates = 0;
+compose_limits WFST::composeLimits;
 
 
 // FIXME: use stringstream so there are no artifical name length limits
@@ -97,124 +96,180 @@ struct TrioNamer {
   }
 };
 
-//#define OLDCOMPOSEARC
 #ifdef DEBUGCOMPOSE
 #define DUMPARC(a, b, c, d) Config::debug() << "arc" << FSTArc(a, b, c, d)
 #else
 #define DUMPARC(a, b, c, d)
 #endif
 
-#ifdef OLDCOMPOSEARC
-#define COMPOSEARC                                                          \
-  do {                                                                      \
-    if ((pDest = find_second(stateMap, triDest))) {                         \
-      states[sourceState].addArc(FSTArc(in, out, *pDest, weight));          \
-    } else {                                                                \
-      add(stateMap, triDest, numStates());                                  \
-      trioID.num = numStates();                                             \
-      trioID.tri = triDest;                                                 \
-      queue.push(trioID);                                                   \
-      states[sourceState].addArc(FSTArc(in, out, trioID.num, weight));      \
-      push_back(states);                                                    \
-      if (namedStates) {                                                    \
-        stateNames.add(namer.make(triDest.qa, triDest.qb, triDest.filter)); \
-      }                                                                     \
-    }                                                                       \
-  } while (0)
-#else
+composer::composer(cascade_parameters& cascade, WFST& result, WFST& a, WFST& b, bool namedStates,
+                   bool preserveGroups, bool lazy, composer* a_lazy, composer* b_lazy, double const* a_h,
+                   double const* b_h)
+    : n_expanded(0)
+    , stateMap(2 * (a.numStates() + b.numStates()))  // assign state numbers to composite states in the
+                                                      // order they are first visited
+    , cascade(cascade)
+    , result(result)
+    , a(a)
+    , b(b)
+    , a_lazy(a_lazy)
+    , b_lazy(b_lazy)
+    , namedStates(namedStates)
+    , preserveGroups(preserveGroups)
+    , lazy(lazy)
+    , a_h(a_h)
+    , b_h(b_h)
+    , use_h(lazy && (a_lazy ? a_lazy->use_h : a_h != 0) && (b_lazy ? b_lazy->use_h : b_h != 0))
+    , map(NEW unsigned[a.alphabet(kOutput).size()])
+    , namer(NEW TrioNamer(MAX_STATENAME_LEN + 1, a, b))
+    , va(a.states, kOutput, map, WFST::indexThreshold)
+    , vb(b.states, kInput, 0, WFST::indexThreshold)
+    , arcStateMap(preserveGroups ? 2 * (a.numStates() + b.numStates()) : 8)
+    , limits(0)
+    , n_arcs(0)
+// of course you may need 2*a*b+k states; this is just to get a larger initial table
+{
+  WFST::alphabet_type& aout = a.alphabet(kOutput), & bin = b.alphabet(kInput);
+  Assert(aout.verify());
+  Assert(bin.verify());
+  aout.computeMap(bin, map);  // find matching symbols in interfacing alphabet
+  Assert(map[0] == 0);  // *e* always 0
 
-// uses: stateMap[triDest] states, queue, in, out, weight, [namedStates,stateNames,namer,buf]
-
-#define COMPOSEARC_GROUP(g)                                                                             \
-  do {                                                                                                  \
-    hash_traits<HashTable<TrioKey, unsigned> >::insert_result_type i;                                   \
-    if ((i = stateMap.insert(HashTable<TrioKey, unsigned>::value_type(triDest, numStates()))).second) { \
-      trioID.num = numStates();                                                                         \
-      trioID.tri = triDest;                                                                             \
-      queue.push(trioID);                                                                               \
-      push_back(states);                                                                                \
-      if (namedStates) stateNames.add(namer.make(triDest.qa, triDest.qb, triDest.filter), trioID.num);  \
-    } else                                                                                              \
-      trioID.num = i.first->second;                                                                     \
-    states[sourceState].addArc(FSTArc(in, out, trioID.num, weight, g));                                 \
-    DUMPARC(in, out, trioID.num, weight);                                                               \
-  } while (0)
-
-#define COMPOSEARC COMPOSEARC_GROUP(FSTArc::no_group)
-#endif
+  result.states.clear();
+  if (namedStates) {
+    result.stateNames.clear();
+    result.named_states = true;
+  } else {
+    result.named_states = false;
+  }
+  state(TrioKey(0, 0, 0));  // add the initial state
+}
 
+composer::~composer() {
+  delete[] map;
+  delete namer;
+}
 
-WFST::WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool groups) {
-  init_index();
-  alph[0] = alph[1] = 0;
-  owner_alph[0] = owner_alph[1] = 0;
-  set_compose(cascade, a, b, namedStates, groups);
+unsigned composer::add_state() {
+  unsigned s = result.numStates();
+  push_back(result.states);
+  result.states[s].use_arena(result.arc_arena);
+  if (lazy) {  // mediate states (added directly) get their arcs immediately and are never final
+    trio.at_grow(s) = TrioKey((unsigned)~0, (unsigned)~0, 0);
+    expanded.at_grow(s) = 1;
+  }
+  if (limits) fwd.at_grow(s) = HUGE_VAL;
+  return s;
 }
 
-WFST::WFST(WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
-  init_index();
-  alph[0] = alph[1] = 0;
-  owner_alph[0] = owner_alph[1] = 0;
-  cascade_parameters c;
-  set_compose(c, a, b, namedStates, preserveGroups);
+unsigned composer::state(TrioKey const& t) {
+  hash_traits<state_map>::insert_result_type i;
+  if (!(i = stateMap.insert(state_map::value_type(t, result.numStates()))).second) return i.first->second;
+  unsigned s = add_state();
+  if (namedStates) result.stateNames.add(namer->make(t.qa, t.qb, t.filter), s);
+  if (lazy) {
+    trio[s] = t;
+    expanded[s] = 0;
+    if (use_h) h.at_grow(s) = h_parts(t.qa, t.qb);
+  } else {
+    TrioID id;
+    id.num = s;
+    id.tri = t;
+    queue.push(id);
+  }
+  return s;
 }
 
+void composer::add_arc(FSTArc::group_t g) {
+  unsigned dest = state(triDest);
+  result.states[sourceState].addArc(FSTArc(in, out, dest, weight, g));
+  DUMPARC(in, out, dest, weight);
+  if (limits) {
+    ++n_arcs;
+    relax(dest, fwd[sourceState] + weight.getCost());
+  }
+}
 
-void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
-  deleteAlphabet();
-  owner_alph[0] = owner_alph[1] = 0;
-  alph[0] = a.alph[0];
-  alph[1] = b.alph[1];
-  alphabet_type& aout = a.alphabet(kOutput), & bin = b.alphabet(kInput);
+void composer::relax_mediate(unsigned s, double cost) {
+  if (cost >= fwd[s]) return;
+  fwd[s] = cost;
+  State::Arcs const& arcs = result.states[s].arcs;
+  for (State::Arcs::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a)
+    relax(a->dest, cost + a->weight.getCost());
+}
 
-  states.reserve(a.numStates() + b.numStates());
+// states, their arcs, and the hash/queue entries that find them
+bool composer::over_budget() const {
+  unsigned n = result.numStates();
+  if (limits->max_states && n >= limits->max_states) return true;
+  return limits->max_bytes
+         && n * (sizeof(State) + sizeof(TrioID) + 4 * sizeof(void*)) + n_arcs * (sizeof(FSTArc) + sizeof(void*))
+                >= limits->max_bytes;
+}
 
-  const unsigned EMPTY = epsilon_index;
-  if (!(a.valid() && b.valid())) {
-    invalidate();
-    return;
+bool composer::is_final(unsigned s) const {
+  if (!lazy || s >= trio.size()) return false;
+  TrioKey const& t = trio[s];
+  if (t.qa == (unsigned)~0) return false;
+  return (a_lazy ? a_lazy->is_final(t.qa) : t.qa == a.final) && (b_lazy ? b_lazy->is_final(t.qb) : t.qb == b.final);
+}
+
+bool composer::expand_all(compose_limits const* limits_) {
+  if (limits_ && limits_->any()) {
+    limits = limits_;
+    fwd.at_grow(0) = 0;  // start
+    return expand_layers();
+  }
+  while (queue.notEmpty()) {
+    TrioID id = queue.top();
+    queue.pop();
+    expand(id.num, id.tri);
   }
+  return true;
+}
 
-  unsigned* map = NEW unsigned[aout.size()];
-  unsigned* revMap = NEW unsigned[bin.size()];
-  Assert(aout.verify());
-  Assert(bin.verify());
-  TrioNamer namer(MAX_STATENAME_LEN + 1, a, b);
-  aout.computeMap(bin, map);  // find matching symbols in interfacing alphabet
-  bin.computeMap(aout, revMap);
-  Assert(map[0] == 0);
-  Assert(revMap[0] == 0);  // *e* always 0
-  TrioKey::gAStates = a.numStates();  // used in hash function
-  TrioKey::gBStates = b.numStates();
-
-  HashTable<TrioKey, unsigned> stateMap(2 * (a.numStates() + b.numStates()));  // assign state numbers
-  // to composite states in the order they are first visited
-
-  List<TrioID> queue;
-  unsigned sourceState = ~0;
-#ifdef OLDCOMPOSEARC
-  unsigned* pDest;
-#endif
-  unsigned in, out;
-  Weight weight;
-  TrioKey triSource, triDest;
-  TrioID trioID;
-  trioID.num = 0;
-  trioID.tri = TrioKey(0, 0, 0);
-  states.clear();
-
-  stateMap[trioID.tri] = 0;  // add the initial state
-  push_back(states);
-  if (namedStates) {
-    stateNames.clear();
-    stateNames.add(namer.make(0, 0, 0), 0);
-    named_states = true;
-  } else {
-    named_states = false;
+namespace {
+struct better_fwd {
+  dynamic_array<double> const& fwd;
+  better_fwd(dynamic_array<double> const& fwd) : fwd(fwd) {}
+  bool operator()(TrioID const& a, TrioID const& b) const {
+    return fwd[a.num] < fwd[b.num] || (fwd[a.num] == fwd[b.num] && a.num < b.num);
   }
-  queue.push(trioID);
+};
+}
 
-  List<HalfArc>* matches;
+// each layer is the states first reached from the one before
+bool composer::expand_layers() {
+  std::vector<TrioID> layer;
+  while (queue.notEmpty()) {
+    layer.clear();
+    for (; queue.notEmpty(); queue.pop()) layer.push_back(queue.top());
+    std::sort(layer.begin(), layer.end(), better_fwd(fwd));
+    std::size_t n = layer.size();
+    if (limits->layer_states && n > limits->layer_states) n = limits->layer_states;
+    double worst = fwd[layer[0].num] + limits->beam;
+    for (std::size_t i = 0; i < n && fwd[layer[i].num] <= worst; ++i) {
+      if (over_budget()) return false;
+      expand(layer[i].num, layer[i].tri);
+    }
+  }
+  return true;
+}
+
+#define COMPOSEARC_GROUP(g) add_arc(g)
+
+void composer::expand(unsigned source, TrioKey const& triSource) {
+  const unsigned EMPTY = WFST::epsilon_index;
+  typedef compose_arcs::iterator arc_it;
+  arc_it l, lend, leps, r, rend, reps;
+  if (a_lazy) a_lazy->expand(triSource.qa);
+  if (b_lazy) b_lazy->expand(triSource.qb);
+  ++n_expanded;
+  sourceState = source;
+  va.range(triSource.qa, &l, &lend);
+  vb.range(triSource.qb, &r, &rend);
+  leps = va.lower_bound(l, lend, EMPTY + 1);
+  reps = vb.lower_bound(r, rend, EMPTY + 1);
 
   if (preserveGroups) {  // use simpler 2 state filter since e transitions cannot be merged anyhow
     /* 2 state filter:
@@ -223,95 +278,80 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
        0->1 or 1->1 : *e*:c from *e*:c (in r)
     */
     // FIXME: -a ... kbest paths look nothing like non -a.  find the bug!
-    HashTable<HalfArcState, unsigned> arcStateMap(
-        2 * (a.numStates() + b.numStates()));  // of course you may need
-    // 2*a*b+k states; this is
-    // just to get a larger
-    // initial table
     // a mediate state has a name like: bstate,"m"->astate, where "m" is a letter in the interface (output of
     // a, input of b)
-    while (queue.notEmpty()) {
-      sourceState = queue.top().num;
-      triSource = queue.top().tri;
-      queue.pop();
-      State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
-      qa->indexBy(kOutput);
-      qb->indexBy(kInput);
-      const HashTable<UnsignedKey, List<HalfArc> >& aindex = *qa->index;
-      for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ll = aindex.begin(); ll != aindex.end();
-           ++ll) {
+    if (triSource.filter == 0) {
+      out = EMPTY;
+      triDest.filter = 0;
+      triDest.qb = triSource.qb;
+      for (arc_it e = l; e != leps; ++e) {
+        FSTArc const* la = *e;  // arc from a
+        weight = la->weight;
+        triDest.qa = la->dest;
+        in = la->in;
+        COMPOSEARC_GROUP(cascade.record1(la));
+      }
+    }
+    for (arc_it ml = leps, mr = reps; ml != lend && mr != rend;) {
+      unsigned kl = va.key(**ml), kr = vb.key(**mr);
+      if (kl < kr)
+        ml = va.lower_bound(ml, lend, kr);
+      else if (kr < kl)
+        mr = vb.lower_bound(mr, rend, kl);
+      else {
+        arc_it lgroup = va.lower_bound(ml, lend, kl + 1), rgroup = vb.lower_bound(mr, rend, kl + 1);
         HalfArcState mediate;
-        mediate.l_hiddenLetter = ll->first;
+        mediate.l_hiddenLetter = (*ml)->out;
         mediate.r_source = triSource.qb;
-        if (ll->first == EMPTY) {
-          if (triSource.filter == 0) {
-            out = EMPTY;
+        for (; ml != lgroup; ++ml) {
+          FSTArc const* la = *ml;
+          mediate.l_dest = la->dest;
+          unsigned mediateState = result.numStates();
+          typedef HashTable<HalfArcState, unsigned> HAT;
+          hash_traits<HAT>::insert_result_type ins;
+          if ((ins = arcStateMap.insert(HAT::value_type(mediate, mediateState))).second) {
+            // populate new mediateState
+            add_state();
+            if (use_h) h.at_grow(mediateState) = h_parts(mediate.l_dest, mediate.r_source);
+            if (limits) fwd[mediateState] = fwd[source] + la->weight.getCost();
+            if (namedStates)
+              result.stateNames.add(
+                  namer->make_mediate(mediate.l_dest, mediate.r_source, mediate.l_hiddenLetter), mediateState);
+            sourceState = mediateState;
+            triDest.qa = mediate.l_dest;
+            in = EMPTY;
             triDest.filter = 0;
-            triDest.qb = triSource.qb;
-            for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
-                 l != end; ++l) {
-              HalfArc const& la = *l;  // arc from a
-              weight = la->weight;
-              triDest.qa = la->dest;
-              in = la->in;
-              COMPOSEARC_GROUP(cascade.record1(la));
-            }
-          }
-        } else if ((matches = find_second(*qb->index, (UnsignedKey)map[mediate.l_hiddenLetter]))) {
-          for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
-               l != end; ++l) {
-            HalfArc const& la = *l;
-            mediate.l_dest = la->dest;
-            unsigned mediateState = numStates();
-            typedef HashTable<HalfArcState, unsigned> HAT;
-            hash_traits<HAT>::insert_result_type ins;
-            if ((ins = arcStateMap.insert(HAT::value_type(mediate, mediateState))).second) {
-              // populate new mediateState
-              push_back(states);
-              if (namedStates)
-                stateNames.add(namer.make_mediate(mediate.l_dest, mediate.r_source, mediate.l_hiddenLetter),
-                               mediateState);
-              unsigned temp = sourceState;
-              {
-                sourceState = mediateState;
-                triDest.qa = mediate.l_dest;
-                in = EMPTY;
-                triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                     r != end; ++r) {
-                  HalfArc const& ra = *r;  // arc from b
-                  Assert(map[la->out] == ra->in);
-                  out = ra->out;
-                  triDest.qb = ra->dest;
-                  weight = ra->weight;
-                  COMPOSEARC_GROUP(cascade.record2(ra));
-                }
-              }
-              sourceState = temp;
-            } else {
-              mediateState = ins.first->second;
+            for (arc_it e = mr; e != rgroup; ++e) {
+              FSTArc const* ra = *e;  // arc from b
+              Assert(map[la->out] == ra->in);
+              out = ra->out;
+              triDest.qb = ra->dest;
+              weight = ra->weight;
+              COMPOSEARC_GROUP(cascade.record2(ra));
             }
-            states[sourceState].addArc(FSTArc(la->in, EMPTY, mediateState, la->weight,
-                                              cascade.record1(la)));  // arc from a
+            sourceState = source;
+          } else {
+            mediateState = ins.first->second;
+            if (limits) relax_mediate(mediateState, fwd[source] + la->weight.getCost());
           }
+          if (limits) ++n_arcs;
+          result.states[sourceState].addArc(
+              FSTArc(la->in, EMPTY, mediateState, la->weight, cascade.record1(la)));  // arc from a
         }
-      }
-      if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
-        in = EMPTY;
-        triDest.qa = triSource.qa;
-        triDest.filter = 1;
-        for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end(); r != end;
-             ++r) {
-          HalfArc const& ra = *r;
-          Assert(ra->in == EMPTY);
-          out = ra->out;
-          weight = ra->weight;
-          triDest.qb = ra->dest;  // arc from b
-          COMPOSEARC_GROUP(cascade.record2(ra));
-        }
+        mr = rgroup;
       }
     }
-
+    in = EMPTY;
+    triDest.qa = triSource.qa;
+    triDest.filter = 1;
+    for (arc_it e = r; e != reps; ++e) {
+      FSTArc const* ra = *e;
+      Assert(ra->in == EMPTY);
+      out = ra->out;
+      weight = ra->weight;
+      triDest.qb = ra->dest;  // arc from b
+      COMPOSEARC_GROUP(cascade.record2(ra));
+    }
   } else {
     // 3 state filter:
     /* composing l.r
@@ -321,185 +361,136 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
        0->2 or 2->2 : *e*:c from *e*:c in r
        2->0 or 1->0 : a:c from a:b (l) b:c (r) where b != *e*
     */
-
-    while (queue.notEmpty()) {
-      sourceState = queue.top().num;
-      triSource = queue.top().tri;
-      queue.pop();
-      State* larger;
-      State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
-      if (qa->size > qb->size) {
-        larger = qa;
-      } else {
-        larger = qb;
-      }
-      if (larger->size > WFST::indexThreshold) {
-        larger->indexBy(larger == qa ? kOutput : kInput);  // create hash table
-        if (larger == qb) {  // qb (rhs transducer) is larger
-          for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
-               ++l) {
-            in = l->in;
-            triDest.qa = l->dest;
-            if (l->out == EMPTY) {
-              if (triSource.filter != 2) {
-                out = EMPTY;
-                weight = l->weight;
-                triDest.filter = 1;
-                triDest.qb = triSource.qb;
-                COMPOSEARC_GROUP(cascade.record1(&*l));
-              }
-              if (triSource.filter == 0)
-                if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
-                  triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                       r != end; ++r) {
-                    Assert((*r)->in == EMPTY);
-                    out = (*r)->out;
-                    weight = l->weight * (*r)->weight;
-                    triDest.qb = (*r)->dest;
-                    COMPOSEARC_GROUP(cascade.record(&*l, *r));
-                  }
-                }
-            } else {
-              if ((matches = find_second(*qb->index, (UnsignedKey)map[l->out]))) {
-                triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                     r != end; ++r) {
-                  Assert(map[l->out] == (*r)->in);
-                  out = (*r)->out;  // FIXME: uninit
-                  weight = l->weight * (*r)->weight;
-                  triDest.qb = (*r)->dest;
-                  COMPOSEARC_GROUP(cascade.record(&*l, *r));
-                }
-              }
-            }
-          }
-          if (triSource.filter != 1 && (matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
-            in = EMPTY;
-            triDest.qa = triSource.qa;
-            triDest.filter = 2;
-            for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                 r != end; ++r) {
-              Assert((*r)->in == EMPTY);
-              out = (*r)->out;
-              weight = (*r)->weight;
-              triDest.qb = (*r)->dest;
-              COMPOSEARC_GROUP(cascade.record2(*r));
-            }
-          }
-        } else {  // qa (lhs transducer) is larger
-          // FIXME: total duplicated code from above case, except switching order of in/out.  a macro could
-          // factor this w/ no runtime cost
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
-               ++r) {
-            out = r->out;
-            triDest.qb = r->dest;
-            if (r->in == EMPTY) {
-              if (triSource.filter != 1) {
-                in = EMPTY;
-                weight = r->weight;
-                triDest.filter = 2;
-                triDest.qa = triSource.qa;
-                COMPOSEARC_GROUP(cascade.record2(&*r));
-              }
-              if (triSource.filter == 0)
-                if ((matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
-                  triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                       l != end; ++l) {
-                    Assert((*l)->out == EMPTY);
-                    in = (*l)->in;
-                    weight = (*l)->weight * r->weight;
-                    triDest.qa = (*l)->dest;
-                    COMPOSEARC_GROUP(cascade.record(*l, &*r));
-                  }
-                }
-            } else {
-              triDest.filter = 0;
-              if ((matches = find_second(*qa->index, (UnsignedKey)revMap[r->in]))) {
-                for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                     l != end; ++l) {
-                  Assert(map[(*l)->out] == r->in);
-                  in = (*l)->in;
-                  weight = (*l)->weight * r->weight;
-                  triDest.qa = (*l)->dest;
-                  COMPOSEARC_GROUP(cascade.record(*l, &*r));
-                }
-              }
-            }
-          }
-          if (triSource.filter != 2 && (matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
+    // arcs are made in the order the per-state hash index always made them, which numbers the result's
+    // states: driven by the smaller state's own arc order when the larger has more than -T arcs (matches in
+    // it are searched, and taken latest first, as the index listed them), otherwise by a's, with each
+    // matching b arc in order
+    arc_it d, dend, mlo, mhi;
+    unsigned na = lend - l, nb = rend - r;
+    bool search = std::max(na, nb) > WFST::indexThreshold;
+    if (!search || nb >= na) {
+      va.in_order(triSource.qa, &d, &dend);
+      for (; d != dend; ++d) {
+        FSTArc const* la = *d;
+        in = la->in;
+        triDest.qa = la->dest;
+        if (la->out == EMPTY) {  // a:*e*
+          if (triSource.filter != 2) {
             out = EMPTY;
-            triDest.qb = triSource.qb;
+            weight = la->weight;
             triDest.filter = 1;
-            for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                 l != end; ++l) {
-              Assert((*l)->out == EMPTY);
-              in = (*l)->in;
-              weight = (*l)->weight;
-              triDest.qa = (*l)->dest;
-              COMPOSEARC_GROUP(cascade.record1(*l));
-            }
+            triDest.qb = triSource.qb;
+            COMPOSEARC_GROUP(cascade.record1(la));
           }
+          if (triSource.filter != 0) continue;
+          mlo = r;
+          mhi = reps;
+        } else
+          vb.equal_range(reps, rend, map[la->out], &mlo, &mhi);
+        triDest.filter = 0;
+        for (std::ptrdiff_t j = 0, n = mhi - mlo; j < n; ++j) {
+          FSTArc const* ra = search ? mhi[-1 - j] : mlo[j];
+          out = ra->out;
+          weight = la->weight * ra->weight;
+          triDest.qb = ra->dest;
+          COMPOSEARC_GROUP(cascade.record(la, ra));
         }
-      } else {  // both states too small to bother hashing
-        for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
-             ++l) {
-          in = l->in;
-          triDest.qa = l->dest;
-          if (l->out == EMPTY) {
-            if (triSource.filter != 2) {
-              out = EMPTY;
-              weight = l->weight;
-              triDest.filter = 1;
-              triDest.qb = triSource.qb;
-              COMPOSEARC_GROUP(cascade.record1(&*l));
-            }
-            if (triSource.filter == 0) {
-              for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
-                   r != end; ++r) {
-                if (r->in == EMPTY) {
-                  out = r->out;
-                  weight = l->weight * r->weight;
-                  triDest.qb = r->dest;
-                  triDest.filter = 0;
-                  COMPOSEARC_GROUP(cascade.record(&*l, &*r));
-                }
-              }
-            }
-          } else {
-            triDest.filter = 0;
-            for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
-                 r != end; ++r) {
-              if (map[l->out] == r->in) {
-                out = r->out;
-                weight = l->weight * r->weight;
-                triDest.qb = r->dest;
-                COMPOSEARC_GROUP(cascade.record(&*l, &*r));
-              }
-            }
-          }
+      }
+      if (triSource.filter != 1) {  // *e*:c
+        in = EMPTY;
+        triDest.qa = triSource.qa;
+        triDest.filter = 2;
+        for (std::ptrdiff_t j = 0, n = reps - r; j < n; ++j) {
+          FSTArc const* ra = search ? reps[-1 - j] : r[j];
+          out = ra->out;
+          weight = ra->weight;
+          triDest.qb = ra->dest;
+          COMPOSEARC_GROUP(cascade.record2(ra));
         }
-        if (triSource.filter != 1) {
-          in = EMPTY;
-          triDest.qa = triSource.qa;
-          triDest.filter = 2;
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
-               ++r) {
-            if (r->in == EMPTY) {
-              out = r->out;
-              weight = r->weight;
-              triDest.qb = r->dest;
-              COMPOSEARC_GROUP(cascade.record2(&*r));
-            }
+      }
+    } else {  // a's state is the larger
+      vb.in_order(triSource.qb, &d, &dend);
+      for (; d != dend; ++d) {
+        FSTArc const* ra = *d;
+        out = ra->out;
+        triDest.qb = ra->dest;
+        if (ra->in == EMPTY) {  // *e*:c
+          if (triSource.filter != 1) {
+            in = EMPTY;
+            weight = ra->weight;
+            triDest.filter = 2;
+            triDest.qa = triSource.qa;
+            COMPOSEARC_GROUP(cascade.record2(ra));
           }
+          if (triSource.filter != 0) continue;
+          mlo = l;
+          mhi = leps;
+        } else
+          va.equal_range(leps, lend, ra->in, &mlo, &mhi);
+        triDest.filter = 0;
+        for (arc_it j = mhi; j != mlo;) {
+          FSTArc const* la = *--j;
+          in = la->in;
+          weight = la->weight * ra->weight;
+          triDest.qa = la->dest;
+          COMPOSEARC_GROUP(cascade.record(la, ra));
+        }
+      }
+      if (triSource.filter != 2) {  // a:*e*
+        out = EMPTY;
+        triDest.qb = triSource.qb;
+        triDest.filter = 1;
+        for (arc_it j = leps; j != l;) {
+          FSTArc const* la = *--j;
+          in = la->in;
+          weight = la->weight;
+          triDest.qa = la->dest;
+          COMPOSEARC_GROUP(cascade.record1(la));
         }
       }
     }
   }
-  delete[] map;
-  delete[] revMap;
+}
+
+#undef COMPOSEARC_GROUP
+
+WFST::WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool groups) {
+  init_index();
+  alph[0] = alph[1] = 0;
+  owner_alph[0] = owner_alph[1] = 0;
+  set_compose(cascade, a, b, namedStates, groups);
+}
 
+WFST::WFST(WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
+  init_index();
+  alph[0] = alph[1] = 0;
+  owner_alph[0] = owner_alph[1] = 0;
+  cascade_parameters c;
+  set_compose(c, a, b, namedStates, preserveGroups);
+}
+
+bool WFST::compose_prepare(WFST& a, WFST& b) {
+  deleteAlphabet();
+  owner_alph[0] = owner_alph[1] = 0;
+  alph[0] = a.alph[0];
+  alph[1] = b.alph[1];
+  if (!(a.valid() && b.valid())) {
+    invalidate();
+    return false;
+  }
+  return true;
+}
+
+void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
+  if (!compose_prepare(a, b)) return;
+  states.reserve(a.numStates() + b.numStates());
+  composer c(cascade, *this, a, b, namedStates, preserveGroups);
+  if (!c.expand_all(&composeLimits))
+    Config::warn() << "Composition stopped at " << numStates()
+                   << " states (--compose-max-states or --compose-max-bytes).\n";
+
+  const unsigned EMPTY = epsilon_index;
+  TrioKey triDest;
   triDest.qa = a.final;
   triDest.qb = b.final;
   unsigned* pFinal[3];
@@ -507,7 +498,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   unsigned i;
   for (i = 0; i < 3; ++i) {
     triDest.filter = i;
-    if ((pFinal[i] = find_second(stateMap, triDest))) {
+    if ((pFinal[i] = find_second(c.stateMap, triDest))) {
       ++nFinal;
       final = *pFinal[i];
     }
@@ -3,13 +3,20 @@
 
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/2hash.h>
+#include <graehl/shared/hash_functions.hpp>
+#include <graehl/shared/dynamic_array.hpp>
+#include <graehl/shared/list.h>
+#include <carmel/src/state.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <boost/cstdint.hpp>
 
 
 namespace graehl {
 
 struct TrioKey {
-  static unsigned gAStates;
-  static unsigned gBStates;
   unsigned qa;
   unsigned qb;
   char filter;
@@ -19,10 +26,8 @@ struct TrioKey {
   TrioKey() {}
 
   TrioKey(unsigned a, unsigned b, char c) : qa(a), qb(b), filter(c) {}
-  size_t hash() const {
-    Assert(qa < gAStates && qb < gBStates);
-    return uint32_hash((gBStates * (filter * gAStates + qa) + qb));
-  }
+  // no bound on the number of states: a lazily composed operand keeps growing
+  size_t hash() const { return mix_hash(uint32_hash(qa), uint32_hash(3 * qb + filter)); }
 };
 
 
@@ -39,15 +44,224 @@ struct HalfArcState {
   HalfArcState() {}
 
   HalfArcState(unsigned a, unsigned b, unsigned c) : l_dest(a), r_source(b), l_hiddenLetter(c) {}
-  size_t hash() const {
-    return uint32_hash(TrioKey::gBStates * (l_hiddenLetter * TrioKey::gAStates + l_dest) + r_source);
-  }
+  size_t hash() const { return mix_hash(uint32_hash(l_dest), mix_hash(uint32_hash(r_source), l_hiddenLetter)); }
 };
 
 struct TrioID {
   unsigned num;
   TrioKey tri;
 };
+
+// each state's arcs, sorted by the label they're matched on in composition: input, or output translated by
+// map into the other transducer's input alphabet (unknown letters map to ~0 and sort last).  one pointer
+// array for the whole transducer; a state's slice is filled (and sorted) the first time it's visited, so
+// nothing is allocated per state (sorting reuses one scratch buffer).  frozen states are already sorted by
+// input.
+struct compose_arcs {
+  typedef FSTArc const* arc_p;
+  typedef arc_p const* iterator;
+  typedef dynamic_array<State> StateVector;
+
+  StateVector const& states;
+  LabelType dir;
+  unsigned const* map;  // NULL: labels as is
+  unsigned gallop_above;  // ranges at most this long are scanned linearly
+  dynamic_array<unsigned> first;  // 1 + index into arcs; 0 until the state is visited
+  dynamic_array<arc_p> arcs;
+  dynamic_array<boost::uint64_t> keyed;  // sort scratch: key<<32 | position in the state
+  dynamic_array<arc_p> sorted;  // sort scratch
+  dynamic_array<arc_p> listed;  // in_order
+
+  compose_arcs(StateVector const& states, LabelType dir, unsigned const* map = 0, unsigned gallop_above = 0)
+      : states(states), dir(dir), map(map), gallop_above(gallop_above) {
+    first.reserve(states.size());
+  }
+
+  unsigned key(FSTArc const& a) const {
+    unsigned l = a.symbol(dir);
+    return map ? map[l] : l;
+  }
+
+  // [*b, *e) valid until the next call
+  void range(unsigned s, iterator* b, iterator* e) {
+    unsigned& f = first.at_grow(s);
+    unsigned i = f - 1;
+    State const& st = states[s];
+    if (!f) {
+      i = arcs.size();
+      f = i + 1;
+      if (st.frozen()) {
+        for (FSTArc const* a = st.packed, * end = st.packed_end(); a != end; ++a) arcs.push_back(a);
+      } else {
+        for (State::Arcs::const_iterator a = st.arcs.const_begin(), end = st.arcs.const_end(); a != end; ++a)
+          arcs.push_back(&*a);
+      }
+      if (!(st.frozen() && dir == kInput && !map)) sort(i);
+    }
+    *b = arcs.begin() + i;
+    *e = *b + st.size;
+  }
+
+  // [*b, *e): the arcs of s unsorted, in the order the state has them; valid until the next call
+  void in_order(unsigned s, iterator* b, iterator* e) {
+    State const& st = states[s];
+    listed.clear();
+    if (st.frozen()) {
+      for (FSTArc const* a = st.packed, * end = st.packed_end(); a != end; ++a) listed.push_back(a);
+    } else {
+      for (State::Arcs::const_iterator a = st.arcs.const_begin(), end = st.arcs.const_end(); a != end; ++a)
+        listed.push_back(&*a);
+    }
+    *b = listed.begin();
+    *e = listed.end();
+  }
+
+  // [*lo, *hi): the arcs in the sorted range [b, e) with key k
+  void equal_range(iterator b, iterator e, unsigned k, iterator* lo, iterator* hi) const {
+    *lo = lower_bound(b, e, k);
+    *hi = k == (unsigned)~0 ? e : lower_bound(*lo, e, k + 1);
+  }
+
+  // stable sort of arcs [i, end) by key, in place (std::stable_sort would allocate a buffer each time)
+  void sort(unsigned i) {
+    arc_p* b = arcs.begin() + i;
+    unsigned n = arcs.size() - i;
+    unsigned j = 1;
+    while (j < n && key(*b[j - 1]) <= key(*b[j])) ++j;
+    if (j >= n) return;  // already sorted
+    keyed.clear();
+    for (j = 0; j < n; ++j) keyed.push_back((boost::uint64_t)key(*b[j]) << 32 | j);
+    std::sort(keyed.begin(), keyed.end());
+    sorted.clear();
+    for (j = 0; j < n; ++j) sorted.push_back(b[(unsigned)keyed[j]]);
+    std::copy(sorted.begin(), sorted.end(), b);
+  }
+
+  // first position in [i, end) with key >= k; gallops (doubling steps, then binary search) through long
+  // ranges so that matching a few labels against a big state costs log rather than linear time
+  iterator lower_bound(iterator i, iterator end, unsigned k) const {
+    if ((unsigned)(end - i) <= gallop_above) {
+      while (i != end && key(**i) < k) ++i;
+      return i;
+    }
+    std::size_t step = 1;
+    iterator lo = i;
+    while (i != end && key(**i) < k) {
+      lo = i + 1;
+      if ((std::size_t)(end - i) <= step) {
+        i = end;
+        break;
+      }
+      i += step;
+      step *= 2;
+    }
+    // key(lo[-1]) < k <= key(*i) (or i == end)
+    while (lo != i) {
+      iterator mid = lo + (i - lo) / 2;
+      if (key(**mid) < k)
+        lo = mid + 1;
+      else
+        i = mid;
+    }
+    return i;
+  }
+};
+
+class WFST;
+struct cascade_parameters;
+struct TrioNamer;
+
+// limits on an eager composition, applied while it's expanded rather than (like prunePaths) once it all
+// exists.  with any set, states are expanded a breadth-first layer at a time, best (lowest cost from start)
+// first; the ones over the beam or the per-layer count are left as dead ends (for reduce to remove), and
+// expansion stops altogether at max_states or (roughly) max_bytes
+struct compose_limits {
+  double beam;  // cost: expand only states within this of the best in their layer (HUGE_VAL: any)
+  unsigned layer_states;  // expand only this many per layer (0: any)
+  unsigned max_states;  // 0: no limit
+  std::size_t max_bytes;  // 0: no limit
+  compose_limits() : beam(HUGE_VAL), layer_states(0), max_states(0), max_bytes(0) {}
+  bool any() const { return beam != HUGE_VAL || layer_states || max_states || max_bytes; }
+};
+
+// the product states (qa, qb, filter) of a composition a*b, added to result as they're found.
+// WFST::set_compose expands every reachable state; a lazy composition (lazy_compose.h) expands only the
+// states a search reaches, and may itself be an operand (a_lazy, b_lazy) of another
+struct composer {
+  // a_h, b_h (lazy only, for A*): per state of a leaf operand, a lower bound on its cost to final
+  composer(cascade_parameters& cascade, WFST& result, WFST& a, WFST& b, bool namedStates, bool preserveGroups,
+           bool lazy = false, composer* a_lazy = 0, composer* b_lazy = 0, double const* a_h = 0,
+           double const* b_h = 0);
+  ~composer();
+
+  // eager: expand everything reachable from the start state (within limits, if any).  false if max_states or
+  // max_bytes stopped it
+  bool expand_all(compose_limits const* limits = 0);
+  // lazy: add the arcs leaving s (once)
+  void expand(unsigned s) {
+    Assert(lazy);
+    if (expanded[s]) return;
+    expanded[s] = 1;
+    TrioKey t = trio[s];
+    expand(s, t);
+  }
+  bool is_expanded(unsigned s) const { return expanded[s]; }
+  unsigned n_expanded;
+
+  // lazy: final iff both parts are
+  bool is_final(unsigned s) const;
+
+  // lazy: a lower bound on the cost from s to a final state: the sum of its parts' (0 without a_h/b_h,
+  // HUGE_VAL if a part can't reach final).  consistent, since an arc's cost is the sum of its parts'
+  double heuristic(unsigned s) const { return use_h ? h[s] : 0; }
+
+  typedef HashTable<TrioKey, unsigned> state_map;
+  state_map stateMap;
+
+ private:
+  cascade_parameters& cascade;
+  WFST& result;
+  WFST& a;
+  WFST& b;
+  composer* a_lazy;
+  composer* b_lazy;
+  bool namedStates, preserveGroups, lazy;
+  double const* a_h;
+  double const* b_h;
+  bool use_h;
+  dynamic_array<double> h;  // use_h
+  unsigned* map;  // a's output letters -> b's input letters
+  TrioNamer* namer;
+  compose_arcs va, vb;
+  HashTable<HalfArcState, unsigned> arcStateMap;  // preserveGroups
+  List<TrioID> queue;  // eager (with limits: the next layer)
+  compose_limits const* limits;  // eager, if any()
+  dynamic_array<double> fwd;  // limits: best cost from the start state found so far
+  std::size_t n_arcs;  // limits
+  dynamic_array<TrioKey> trio;  // lazy
+  dynamic_array<char> expanded;  // lazy
+
+  // current arc, for add_arc
+  unsigned in, out;
+  Weight weight;
+  TrioKey triDest;
+  unsigned sourceState;
+
+  unsigned state(TrioKey const& t);  // id of product state t, added if new
+  unsigned add_state();
+  double h_parts(unsigned qa, unsigned qb) const {
+    return (a_lazy ? a_lazy->heuristic(qa) : a_h[qa]) + (b_lazy ? b_lazy->heuristic(qb) : b_h[qb]);
+  }
+  void add_arc(FSTArc::group_t g);  // in:out/weight from sourceState to state(triDest)
+  void relax(unsigned s, double cost) {
+    double& f = fwd[s];
+    if (cost < f) f = cost;
+  }
+  void relax_mediate(unsigned s, double cost);  // and what it already has arcs to
+  bool over_budget() const;
+  bool expand_layers();
+  void expand(unsigned s, TrioKey const& t);
+};
 }
 
 BEGIN_HASH(graehl::TrioKey) {
@@ -31,12 +31,18 @@
 #include <graehl/shared/hashtable_fwd.hpp>
 #include <graehl/shared/graph.h>
 #include <graehl/shared/simple_serialize.hpp>
+#include <graehl/shared/leb128.hpp>
 #include <carmel/src/fst.h>
 #include <carmel/src/train.h>
 #include <graehl/shared/dynamic_array.hpp>
 #include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/io.hpp>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
 
 namespace graehl {
 
@@ -88,9 +94,10 @@ struct arcs_table : public dynamic_array<arc_counts> {
     n_states = x.numStates();
     x.visit_arcs(*this);
   }
-  arc_counts& ac(GraphArc const& a) const {
-    assert(a.data_as<unsigned>() < this->size());
-    return (*(arcs_type*)this)[a.data_as<unsigned>()];
+  arc_counts& ac(GraphArc const& a) const { return ac(a.data_as<unsigned>()); }
+  arc_counts& ac(unsigned id) const {
+    assert(id < this->size());
+    return (*(arcs_type*)this)[id];
   }
 
   void operator()(unsigned s, FSTArc& a) {
@@ -158,8 +165,7 @@ struct wfst_io_index : boost::noncopyable {
 // all the derivations for one in/out pair through WFST x
 // note that the reverse graph and topo (cache_backward saves them) point to arcs directly via pointers, so
 // serialization omits those (forces cache_backward=false on load), so they're rebuilt when needed
-// containing derivations in a dynarray is fine since the lists used in graph states are movable, and
-// state_to_id isn't kept around after compute, but even if it is, HashTable can also be moved.
+// derivations may be moved (e.g. by the std::vector in serialize_batch), but not copied
 struct derivations {
  private:
   typedef unsigned Sym;
@@ -168,6 +174,13 @@ struct derivations {
   Seq in, out;  // cleared after compute()
 
   typedef dynamic_array<GraphState> vgraph;
+  // g's arcs, all released with it.  on the heap, since g's lists keep pointing at it when derivations move;
+  // made by the first use_arena, so that moved-to and never-computed derivations don't allocate one
+  boost::shared_ptr<node_arena> arena;
+  node_arena& get_arena() {
+    if (!arena) arena.reset(NEW node_arena);
+    return *arena;
+  }
   vgraph g;
   typedef unsigned state_id;
   state_id fin;
@@ -208,6 +221,21 @@ struct derivations {
       sum_paths += npath;
     }
 
+    /// as if e's (one example's, maybe recorded in another thread) prune_record had been made here.  (prune
+    /// leaves post alone for an empty d)
+    void add(statistics const& e, bool empty) {
+      pruned = e.pruned;
+      N += e.N;
+      pre.states = e.pre.states;
+      pre.arcs += e.pre.arcs;
+      if (!pruned)
+        post = pre;
+      else if (!empty)
+        post = e.post;
+      prod_paths *= e.prod_paths;
+      sum_paths += e.sum_paths;
+    }
+
     struct states_arcs {
       double states, arcs;
 
@@ -246,7 +274,7 @@ struct derivations {
     TO_OSTREAM_PRINT
   };
 
-  static statistics global_stats;
+  static THREADLOCAL statistics global_stats;  // each thread computing derivations has its own
 
   double weight;
   unsigned lineno;
@@ -281,7 +309,8 @@ struct derivations {
     return r;
   }
 
-  derivations() {}
+  derivations()
+      : fin(), no_goal(true), cache_backward(), weight(1), lineno(), goal(0, 0, 0) {}
 
   // for EM, not gibbs:
   template <class arcs_table>
@@ -295,7 +324,9 @@ struct derivations {
                     return t[a.data_as<unsigned>()];*/
       return t.ac(a);
     }
+    arc_counts& ac(unsigned id) const { return t.ac(id); }
     Weight operator()(GraphArc const& a) const { return t.ac(a).weight(); }
+    Weight operator()(unsigned id) const { return t.ac(id).weight(); }
   };
 
   // FIXME: allow storying r.graph() as primary, free up graph() (for gibbs)
@@ -303,79 +334,54 @@ struct derivations {
   typedef fixed_array<Weight> fb_weights;
 
 #define ORANDPATH(x)  // std::cerr<<x
-  // weights for random_path (for gibbs).
-  template <class WeightFor>
-  struct pfor {
-    fb_weights b;
-    WeightFor const& wf;
-    pfor(unsigned nst, unsigned fin, WeightFor const& wf)
-        : b(nst)
-        , wf(wf)  //
-    {
-      b[fin] = 1;
-    }
-    // store in GraphArc .weight the normalized probability
-    template <class It>
-    void global_normalize(It beg, It end, double power = 1.) const {
-      Weight sum;
-      ORANDPATH("global_normalize power=" << power);
-      for (It i = beg; i != end; ++i) {
-        GraphArc& a = *i;
-        Weight nw = (wf(a) * b[a.dest]).pow(power);  // req 1: wf(a)
-        ORANDPATH(" p=" << a.wt() << " b=" << b[a.dest]);
-        sum += nw;
-        a.wt() = nw;
-      }
-      ORANDPATH(" =>(globalnorm sum=" << sum << ")");
-      if (sum.isZero()) sum.setOne();
-      for (It i = beg; i != end; ++i) {
-        GraphArc& a = *i;
-        a.weight = (a.wt() / sum).getReal();  // warning: aliasing (a.wt() and a.weight are a fake-union)
-        ORANDPATH(" " << a.weight);
-      }
-      ORANDPATH("\n");
-    }
-    // used by random.hpp choose_p
-    double operator()(GraphArc const& a) const { return a.weight; }
-  };
 
   // Weight wf(GraphArc &a)
   // wf.choose_arc(GraphArc const& a)
-  //  WeightFor is carmel_gibbs typically (or else p_init for EM init samples).  2 req listed below:
-  template <class WeightFor>
-  void random_path(WeightFor const& wf, double power = 1.) {
+  //  WeightFor is carmel_gibbs typically (or else p_init for EM init samples).  2 req listed below.  random
+  //  gives random.random01().  the derivations are only read (besides order and reverse, unless they're kept),
+  //  so threads with their own wf and random may share them
+  template <class WeightFor, class Random>
+  void random_path(WeightFor const& wf, double power, Random const& random) {
     if (empty()) return;
     unsigned nst = g.size();
     get_order();
     get_reverse();
-    Graph rg = r.graph();
-    rg.setwt(wf);  // req 1: wf(GraphArc a).  now a.wt() has the result
-    pfor<WeightFor> pf(nst, fin, wf);
-    propagate_paths_in_order_wt(rg, reverse_order.begin(), reverse_order.end(),
-                                pf.b);  // uses wf(a) from setwt
+    fb_weights b(nst);
+    b[fin] = 1;
+    propagate_paths_in_order(r.graph(), reverse_order.begin(), reverse_order.end(), wf, b);  // req 1: wf(a)
     free_order();
     free_reverse();
+    dynamic_array<Weight> nw;
+    dynamic_array<double> p;
     unsigned s = 0;
-    std::vector<bool> normed(
-        nst, false);  // this is linear time; may actually slow down random choice vs. normalizing on fly
     while (s != fin) {  // fin should have no outgoing arcs if you want sampling to be sensible
-      arcs_type& arcs = g[s].arcs;
-      if (!normed[s]) {  // don't normalize (+compute probs for arcs) in states we don't visit, and save the
-        // result if we revisit
-        normed[s] = true;
-        pf.global_normalize(arcs.val_begin(), arcs.val_end(), power);
+      arcs_type const& arcs = g[s].arcs;
+      // global normalization: p(a) = (wf(a)*b[dest])^power / sum
+      nw.clear();
+      p.clear();
+      Weight sum;
+      ORANDPATH("global_normalize power=" << power);
+      for (arcs_type::const_iterator a = arcs.const_begin(), e = arcs.const_end(); a != e; ++a) {
+        nw.push_back((Weight(wf(*a)) * b[a->dest]).pow(power));  // req 1: wf(a)
+        ORANDPATH(" p=" << wf(*a) << " b=" << b[a->dest]);
+        sum += nw.back();
       }
-      GraphArc const& a = *choose_p(arcs.const_begin(), arcs.const_end(),
-                                    pf);  // no empty states allowed that aren't final.
-      // use the re-normalizing choose_p rather than choose_p01 to protect from rounding issues with
-      // Weight::getReal sum to 1
-      wf.choose_arc(a);  // req 2: wf.choose_arc(GraphArc a)
-      s = a.dest;
+      ORANDPATH(" =>(globalnorm sum=" << sum << ")\n");
+      if (sum.isZero()) sum.setOne();
+      double psum = 0.;
+      for (unsigned i = 0, n = nw.size(); i < n; ++i) {
+        p.push_back((nw[i] / sum).getReal());
+        psum += p.back();
+      }
+      // as choose_p (renormalizing, to protect from rounding issues with Weight::getReal sum to 1)
+      double choice = psum * random.random01();
+      arcs_type::const_iterator a = arcs.const_begin();  // no empty states allowed that aren't final.
+      for (unsigned i = 0, last = p.size() - 1; i < last && (choice -= p[i]) >= 0; ++i) ++a;
+      wf.choose_arc(*a);  // req 2: wf.choose_arc(GraphArc a)
+      s = a->dest;
     }
   }
 
-  bool have_order;
-
 
   // FIXME: gibbs.cc / incremental em version of below - too lazy to refactor, fix later
   template <class gibbs>
@@ -428,21 +434,174 @@ struct derivations {
     return prob;
   }
 
+  // as compute_fb, but over the plan, w(arc id) giving the weights.  log_sum: each state's sum is taken at
+  // once by log_sum (in mode) over its arcs: forward gathers the arcs into a state (bwd, from the end, has
+  // them grouped by dest in topological order), backward the arcs out of it (the plan, from the end)
+  template <class W>
+  Weight plan_fb(fb_weights& f, fb_weights& b, W const& w, bool log_sum = false,
+                 log_add_mode mode = log_add_exact) {
+    assert(!empty());
+    unsigned nst = g.size();
+    f.reinit(nst);
+    b.reinit(nst);
+    unsigned const* src = plan.src.begin(), *dest = plan.dest.begin(), *id = plan.id.begin();
+    unsigned const* bwd = plan.bwd.begin();
+    unsigned n = plan.n_arcs();
+    f[0] = 1;
+    b[fin] = 1;
+    if (log_sum) {
+      dynamic_array<Weight> terms(16);
+      for (unsigned j = n; j;) {  // (a lone arc is just added)
+        unsigned a = bwd[--j], d = dest[a];
+        Weight t = f[src[a]] * w(id[a]);
+        if (!j || dest[bwd[j - 1]] != d) {
+          f[d] += t;
+          continue;
+        }
+        terms.clear();
+        terms.push_back(t);
+        for (; j && dest[bwd[j - 1]] == d; --j) terms.push_back(f[src[bwd[j - 1]]] * w(id[bwd[j - 1]]));
+        f[d] += graehl::log_sum(terms.begin(), terms.end(), mode);
+      }
+      for (unsigned i = n; i;) {
+        unsigned s = src[--i];
+        Weight t = b[dest[i]] * w(id[i]);
+        if (!i || src[i - 1] != s) {
+          b[s] += t;
+          continue;
+        }
+        terms.clear();
+        terms.push_back(t);
+        for (; i && src[i - 1] == s; --i) terms.push_back(b[dest[i - 1]] * w(id[i - 1]));
+        b[s] += graehl::log_sum(terms.begin(), terms.end(), mode);
+      }
+    } else {
+      for (unsigned i = 0; i < n; ++i) f[dest[i]] += f[src[i]] * w(id[i]);
+      for (unsigned const* i = bwd, *e = plan.bwd.end(); i != e; ++i) b[src[*i]] += b[dest[*i]] * w(id[*i]);
+    }
+    Weight prob = f[fin];
+    check_fb_agree(prob, b[0]);
+    return prob;
+  }
+
   // update expected counts and return prob (sum of paths)
   template <class arcs_table>
-  Weight collect_counts(arcs_table& t) {
-    //        update_weights(t);
+  Weight collect_counts(arcs_table& t, bool log_sum = false, log_add_mode mode = log_add_exact) {
+    weight_for<arcs_table> wf(t);
+    fb_weights f, b;
+    get_plan();
+    Weight prob = plan_fb(f, b, wf, log_sum, mode);
+    for (unsigned const* i = plan.counts.begin(), *e = plan.counts.end(); i != e; ++i) {
+      arc_counts& ac = wf.ac(plan.id[*i]);
+      Weight arc_contrib = ac.weight() * f[plan.src[*i]] * b[plan.dest[*i]];
+      ac.counts += arc_contrib * weight / prob;
+    }
+    free_plan();
+    return prob;
+  }
+
+  // same, but counts[arc id] is updated instead of the arc_counts in t (which is only read), so threads can
+  // each count a share of the corpus
+  template <class arcs_table>
+  Weight collect_counts(arcs_table const& t, Weight* counts, bool log_sum = false,
+                        log_add_mode mode = log_add_exact) {
     weight_for<arcs_table> wf(t);
+    fb_weights f, b;
+    get_plan();
+    Weight prob = plan_fb(f, b, wf, log_sum, mode);
+    for (unsigned const* i = plan.counts.begin(), *e = plan.counts.end(); i != e; ++i) {
+      unsigned id = plan.id[*i];
+      Weight arc_contrib = wf(id) * f[plan.src[*i]] * b[plan.dest[*i]];
+      counts[id] += arc_contrib * weight / prob;
+    }
+    free_plan();
+    return prob;
+  }
+
+  // same, but in doubles instead of Weight, so + is an add rather than an exp and a log1p.  w[arc id] is the
+  // arc's weight as a real (arcs under 2^-1022 are effectively 0) and advance[arc id] the number of input and
+  // output symbols it reads.  states are grouped into layers by input+output position, and like the per-time
+  // step scaling of HMM forward/backward, each layer's values share a power of 2 scale, set when the layer is
+  // complete so its largest value is in [.5,1)
+  Weight collect_counts_scaled(double const* w, unsigned char const* advance, double* counts) {
+    assert(!empty());
     unsigned nst = g.size();
-    fb_weights f(nst), b(nst);  // default 0-init
-    Weight prob = compute_fb(f, b, wf);
+    get_order();
+    fixed_array<unsigned> layer(nst);
+    unsigned nlayer = 1;
+    for (dynamic_array<unsigned>::reverse_iterator i = reverse_order.rbegin(), e = reverse_order.rend(); i != e;
+         ++i) {
+      unsigned L = layer[*i];
+      if (L >= nlayer) nlayer = L + 1;
+      arcs_type const& arcs = g[*i].arcs;
+      for (arcs_type::const_iterator a = arcs.begin(), ea = arcs.end(); a != ea; ++a)
+        layer[a->dest] = L + advance[a->data_as<unsigned>()];
+    }
+    // topological order sorted (stably) by layer; layer L is [order+begin[L], order+begin[L+1])
+    fixed_array<unsigned> begin(nlayer + 1), order(nst);
+    for (unsigned s = 0; s < nst; ++s) ++begin[layer[s] + 1];
+    for (unsigned L = 0; L < nlayer; ++L) begin[L + 1] += begin[L];
+    {
+      fixed_array<unsigned> fill(begin);
+      for (dynamic_array<unsigned>::reverse_iterator i = reverse_order.rbegin(), e = reverse_order.rend();
+           i != e; ++i)
+        order[fill[layer[*i]]++] = *i;
+    }
+    free_order();
+
+    fixed_array<double> f(nst), b(nst), fscale(HUGE_VAL, nlayer), bscale(HUGE_VAL, nlayer);  // HUGE_VAL: unset
+    f[0] = 1;
+    fscale[0] = 0;
+    for (unsigned L = 0; L < nlayer; ++L) {
+      unsigned const* i = order.begin() + begin[L], *e = order.begin() + begin[L + 1];
+      if (i == e) continue;
+      rescale_layer(f, i, e, fscale[L]);
+      for (; i != e; ++i) {
+        double fs = f[*i];
+        if (fs == 0) continue;
+        arcs_type const& arcs = g[*i].arcs;
+        for (arcs_type::const_iterator a = arcs.begin(), ea = arcs.end(); a != ea; ++a) {
+          unsigned id = a->data_as<unsigned>(), M = L + advance[id];
+          if (fscale[M] == HUGE_VAL) fscale[M] = fscale[L];
+          f[a->dest] += fs * w[id] * pow2(fscale[L] - fscale[M]);
+        }
+      }
+    }
+    double pf = f[fin], pscale = fscale[layer[fin]];
+    if (pf == 0) return Weight();  // underflow (tiny arc weights)
+
+    get_reverse();
+    b[fin] = 1;
+    bscale[layer[fin]] = 0;
+    for (unsigned L = nlayer; L-- > 0;) {
+      unsigned const* i = order.begin() + begin[L + 1], *e = order.begin() + begin[L];
+      if (i == e) continue;
+      rescale_layer(b, e, i, bscale[L]);
+      while (i != e) {
+        unsigned s = *--i;
+        double bs = b[s];
+        if (bs == 0) continue;
+        arcs_type const& arcs = r.b[s].arcs;
+        for (arcs_type::const_iterator a = arcs.begin(), ea = arcs.end(); a != ea; ++a) {
+          unsigned id = a->data_as<unsigned>(), M = L - advance[id];
+          if (bscale[M] == HUGE_VAL) bscale[M] = bscale[L];
+          b[a->dest] += bs * w[id] * pow2(bscale[L] - bscale[M]);
+        }
+      }
+    }
+    free_reverse();
+    double const ln2 = 0.6931471805599453;
+    Weight prob(std::log(pf) + pscale * ln2, ln_weight());
+    check_fb_agree(prob, Weight(std::log(b[0]) + bscale[0] * ln2, ln_weight()));
+
+    double norm = weight / pf;
     for (unsigned s = 0; s < nst; ++s) {
+      if (f[s] == 0) continue;
+      double fs = f[s] * norm, sscale = fscale[layer[s]] - pscale;
       arcs_type const& arcs = g[s].arcs;
-      for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
-        GraphArc const& a = *i;
-        arc_counts& ac = wf.ac(a);
-        Weight arc_contrib = ac.weight() * f[a.src] * b[a.dest];
-        ac.counts += arc_contrib * weight / prob;
+      for (arcs_type::const_iterator a = arcs.begin(), ea = arcs.end(); a != ea; ++a) {
+        unsigned id = a->data_as<unsigned>();
+        counts[id] += fs * w[id] * b[a->dest] * pow2(sscale + bscale[layer[a->dest]]);
       }
     }
     return prob;
@@ -454,6 +613,33 @@ struct derivations {
       : in(o.in), out(o.out) {}  // similarly, this doesn't really copy the derivations; you need to compute()
   // after.  um, this would be bad if you used a vector rather than a list?
  public:
+  // moves swap, so each object's arcs always stay with the arena they came from (a member-wise move would
+  // release our arena before g's old lists are given back to it), and the moved-from object is still usable
+  derivations(derivations&& o) : derivations() { swap(o); }
+  derivations& operator=(derivations&& o) {
+    swap(o);
+    return *this;
+  }
+  void swap(derivations& o) {
+    using std::swap;
+    in.swap(o.in);
+    out.swap(o.out);
+    arena.swap(o.arena);
+    g.swap(o.g);
+    swap(fin, o.fin);
+    swap(no_goal, o.no_goal);
+    swap(cache_backward, o.cache_backward);
+    id_of_state.swap(o.id_of_state);
+    swap(weight, o.weight);
+    swap(lineno, o.lineno);
+#if DERIVPRUNE
+    remove.swap(o.remove);
+#endif
+    swap(goal, o.goal);
+    r.b.swap(o.r.b);
+    reverse_order.swap(o.reverse_order);
+    plan.swap(o.plan);
+  }
   // return true iff goal reached (some deriv exists)
   template <class Symbols>
   void init(Symbols const& in_, Symbols const& out_, double w = 1, unsigned line = 0,
@@ -465,7 +651,9 @@ struct derivations {
     cache_backward = cache_backward_;
     id_of_state.clear();
     g.clear();
-    free_reverse();
+    r.clear();
+    reverse_order.clear();
+    plan.clear();
   }
 
   template <class Symbols, class arcs_table>
@@ -504,33 +692,96 @@ struct derivations {
       g.clear();
       return false;
     } else {
-      if (cache_backward) {
-        make_reverse();
-        make_order();
-      }
+      if (cache_backward) make_plan();  // (and reverse_order); r is made (and kept) when first used
       return true;
     }
   }
 
-  // nonportable serialization to temporary rewindable tape file
+  // nonportable serialization to temporary rewindable tape file (or memory).  only the graph's structure is
+  // saved, as leb128 ints: # of states, then for each state its outdegree and arcs.  an arc is its dest
+  // relative to its src, and its arcs_table id relative to the previous arc's (both zigzag, since either may
+  // go down).  no arc weights: they're looked up by id when used (weight_for)
+  GRAEHL_SPLIT_SAVE_LOAD_MEMBER()
+
+  template <class A>
+  void save(A& a) {
+    a& fin& weight& lineno;
+    std::size_t n_arcs = 0;
+    for (vgraph::const_iterator i = g.begin(), e = g.end(); i != e; ++i) n_arcs += i->outdegree();
+    std::vector<byte> buf(leb128_max_bytes(0u) * (1 + g.size() + 2 * n_arcs));
+    byteptr p = &buf[0];
+    p = encode_leb128(p, (unsigned)g.size());
+    for (state_id s = 0, n = g.size(); s < n; ++s) {
+      arcs_type const& arcs = g[s].arcs;
+      p = encode_leb128(p, (unsigned)arcs.size());
+      unsigned last_id = 0;
+      for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
+        unsigned id = i->data_as<unsigned>();
+        p = encode_leb128(p, zigzag_encode((int)(i->dest - s)));
+        p = encode_leb128(p, zigzag_encode((int)(id - last_id)));
+        last_id = id;
+      }
+    }
+    std::size_t n_bytes = p - &buf[0];
+    a& n_bytes;
+    a.save_binary(&buf[0], n_bytes);
+  }
+
   template <class A>
-  void serialize(A& a) {
-    a& fin& g& weight& lineno;
-    if (A::is_loading) {
-      no_goal = g.empty();
-      free_extras();  // not saved/loaded, so clear
+  void load(A& a) {
+    a& fin& weight& lineno;
+    std::size_t n_bytes;
+    a& n_bytes;
+    std::vector<byte> buf(n_bytes);
+    a.load_binary(&buf[0], n_bytes);
+    const_byteptr p = &buf[0], end = p + n_bytes;
+    unsigned n;
+    p = decode_leb128(n, p, end);
+    g.clear();  // its arcs go back to arena, to be reused here
+    g.reserve(n);
+    for (state_id s = 0; s < n; ++s) {
+      g.push_back();
+      g.back().use_arena(get_arena());
+      arcs_type::back_insert_iterator out = g.back().arcs.back_inserter();
+      unsigned outdegree;
+      p = decode_leb128(outdegree, p, end);
+      GraphArc a(s, 0, 0);
+      a.data_as<unsigned>() = 0;
+      for (unsigned dest, delta; outdegree; --outdegree) {
+        p = decode_leb128(dest, p, end);
+        a.dest = s + zigzag_decode(dest);
+        p = decode_leb128(delta, p, end);
+        a.data_as<unsigned>() += zigzag_decode(delta);
+        *out++ = a;
+      }
     }
+    no_goal = g.empty();
+    free_extras();  // not saved/loaded, so clear
   }
 
   void free_extras()  // no longer needed after compute
   {
     cache_backward = false;
     free_reverse();
+    free_order();
+    free_plan();
     id_of_state.clear();
     in.clear();
     out.clear();
   }
 
+  // make and keep what would otherwise be made and freed each time: the plan (for collect_counts), and the
+  // order and reverse graph (for collect_counts_scaled, random_path), so several threads may use these
+  // derivations at once
+  void make_shareable(bool keep_plan, bool keep_order) {
+    cache_backward = true;
+    if (keep_plan && !plan.made) make_plan();
+    if (keep_order) {
+      get_order();
+      get_reverse();
+    }
+  }
+
   typedef GraphState::arcs_type arcs_type;
 
   struct reversed_graph {
@@ -647,6 +898,7 @@ struct derivations {
     //        add(id_of_state,d,src); // NOTE: very important that we've added this before we start taking
     //        self-epsilons.
     g.push_back();
+    g.back().use_arena(get_arena());
 //        DBPC2("deriving",d);
 #if DERIVPRUNE
     remove.push_back(false);
@@ -716,7 +968,84 @@ struct derivations {
   }
 
   void get_reverse() {
-    if (!cache_backward) make_reverse();
+    if (r.b.empty()) make_reverse();
+  }
+
+  // the arcs (src, dest, arcs_table id) in topological order of src (each state's in list order), so forward
+  // is one sweep.  backward (b[src] += b[dest] * w) takes them in order bwd: by dest in reverse_order, and
+  // among those, latest (in g) first.  counts is g's order (state id, then list).  those are the orders the
+  // GraphState lists are summed in by compute_fb (forward over g, backward over r), so the results agree to
+  // the last bit
+  struct fb_plan {
+    fixed_array<unsigned> src, dest, id;
+    fixed_array<unsigned> bwd, counts;  // indices into the above
+    bool made;
+    fb_plan() : made(false) {}
+    void swap(fb_plan& o) {
+      src.swap(o.src);
+      dest.swap(o.dest);
+      id.swap(o.id);
+      bwd.swap(o.bwd);
+      counts.swap(o.counts);
+      std::swap(made, o.made);
+    }
+    unsigned n_arcs() const { return src.size(); }
+    void clear() {
+      src.clear();
+      dest.clear();
+      id.clear();
+      bwd.clear();
+      counts.clear();
+      made = false;
+    }
+  };
+  fb_plan plan;
+
+  void make_plan() {
+    get_order();
+    unsigned nst = g.size(), n_order = reverse_order.size();
+    assert(n_order == nst);  // every state was reached from start by derive
+    fixed_array<unsigned> pos(nst);  // in topological order
+    for (unsigned i = 0; i < n_order; ++i) pos[reverse_order[n_order - 1 - i]] = i;
+    fixed_array<unsigned> by_src(nst + 1), by_dest(nst + 1);  // counting sort
+    unsigned A = 0;
+    for (unsigned s = 0; s < nst; ++s) {
+      arcs_type const& arcs = g[s].arcs;
+      for (arcs_type::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a) {
+        ++by_src[pos[s] + 1];
+        ++by_dest[pos[a->dest] + 1];
+        ++A;
+      }
+    }
+    for (unsigned i = 0; i < nst; ++i) {
+      by_src[i + 1] += by_src[i];
+      by_dest[i + 1] += by_dest[i];
+    }
+    plan.src.reinit(A);
+    plan.dest.reinit(A);
+    plan.id.reinit(A);
+    plan.bwd.reinit(A);
+    plan.counts.reinit(A);
+    unsigned k = 0;
+    for (unsigned s = 0; s < nst; ++s) {
+      arcs_type const& arcs = g[s].arcs;
+      for (arcs_type::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a, ++k) {
+        unsigned i = by_src[pos[s]]++;
+        plan.src[i] = s;
+        plan.dest[i] = a->dest;
+        plan.id[i] = a->data_as<unsigned>();
+        plan.counts[k] = i;
+        plan.bwd[A - 1 - by_dest[pos[a->dest]]++] = i;
+      }
+    }
+    plan.made = true;
+  }
+  void free_plan() {
+    if (!cache_backward) plan.clear();
+  }
+  void get_plan() {
+    if (!plan.made) make_plan();
+    free_order();
   }
 
   void make_order() {
@@ -728,11 +1057,35 @@ struct derivations {
                      << " back edges).  Forward/backward will miss some paths.\n";
   }
 
+  // 2^k for integral k, 0 below 2^-1022 (or for NaN), 2^1023 above
+  static double pow2(double k) {
+    if (!(k >= -1022)) return 0;
+    if (k > 1023) k = 1023;
+    boost::int64_t bits = (boost::int64_t)(k + 1023) << 52;
+    double r;
+    std::memcpy(&r, &bits, sizeof(r));
+    return r;
+  }
+
+  // scale v[*i] for i in [begin,end) so the largest is in [.5,1), adding the (log2) scale to exp2
+  template <class Values>
+  static void rescale_layer(Values& v, unsigned const* begin, unsigned const* end, double& exp2) {
+    double max = 0;
+    for (unsigned const* i = begin; i != end; ++i)
+      if (v[*i] > max) max = v[*i];
+    if (max == 0) return;
+    int k;
+    std::frexp(max, &k);
+    double scale = std::ldexp(1., -k);
+    for (unsigned const* i = begin; i != end; ++i) v[*i] *= scale;
+    exp2 += k;
+  }
+
   void free_order() {
     if (!cache_backward) reverse_order.clear();
   }
   void get_order() {
-    if (!cache_backward) make_order();
+    if (reverse_order.empty()) make_order();
   }
 };
 
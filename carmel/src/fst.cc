@@ -17,13 +17,47 @@ THREADLOCAL int WFST::default_arc_format = WFST::BRIEF;
 // scale(c)/sum {scale(c_i)}.  update: slide 38 was wrong, and is revised in
 // http://www.cs.berkeley.edu/~pliang/papers/tutorial-acl2007.pdf
 
+void WFST::freeze() {
+  if (frozen()) return;
+  unsigned n = numArcs();
+  if (!n) return;
+  indexFlush();
+  packed_arcs.init(n);
+  FSTArc* p = packed_arcs.begin();
+  for (unsigned s = 0, N = numStates(); s < N; ++s) {
+    State& st = states[s];
+    FSTArc* b = p;
+    for (State::Arcs::const_iterator a = st.arcs.const_begin(), end = st.arcs.const_end(); a != end; ++a)
+      *p++ = *a;
+    Assert(p - b == st.size);
+    std::stable_sort(b, p, State::by_in_out());
+    st.arcs.clear();
+    st.packed = b;
+  }
+  arc_arena.clear();
+}
+
+void WFST::thaw() {
+  if (!frozen()) return;
+  indexFlush();
+  for (unsigned s = 0, N = numStates(); s < N; ++s) {
+    State& st = states[s];
+    for (FSTArc* a = st.packed_end(), * b = st.packed; a != b;) st.arcs.push(*--a);
+    st.packed = NULL;
+  }
+  packed_arcs.clear();
+  arcs_file.reset();
+}
+
 void WFST::pruneArcs(Weight thresh) {
+  thaw();
   for (unsigned s = 0, n = numStates(); s < n; ++s) states[s].prune(thresh);
 }
 
 unsigned WFST::generate(unsigned* inSeq, unsigned* outSeq, unsigned minArcs, unsigned bufLen) {
   unsigned i, o, nArcs;
   unsigned s;
+  thaw();
   indexInput();
   unsigned maxArcs = bufLen - 1;
   i = o = s = nArcs = 0;
@@ -87,6 +121,7 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
   norm_group_by group = method.group;
 
   if (group == NONE) return;
+  thaw();
   if (group == CONDITIONAL) indexInput();
 
   graehl::mean_field_scale const& scale = method.scale;
@@ -243,20 +278,27 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
   if (group == CONDITIONAL) indexFlush();  // free up by-input index we created at start
 }
 
-void WFST::assignWeights(const WFST& source) {
+namespace {
+struct tied_weights {
   HashTable<UnsignedKey, Weight> groupWeight;
+  void operator()(FSTArc const& a) {
+    if (WFST::isTied(a.groupId)) groupWeight[a.groupId] = a.weight;
+  }
+};
+}
+
+void WFST::assignWeights(const WFST& source) {
   unsigned s;
   unsigned pGroup;
-  for (s = 0; s < source.numStates(); ++s) {
-    const List<FSTArc>& arcs = source.states[s].arcs;
-    for (List<FSTArc>::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
-      if (isTied(pGroup = a->groupId)) groupWeight[pGroup] = a->weight;
-  }
+  tied_weights tied;
+  source.visit_arcs_sourceless(tied);
+  HashTable<UnsignedKey, Weight>& groupWeight = tied.groupWeight;
+  thaw();
   Weight* pWeight;
   for (s = 0; s < numStates(); ++s) {
     states[s].flush();
-    List<FSTArc>& arcs = states[s].arcs;
-    for (List<FSTArc>::erase_iterator a = arcs.erase_begin(), end = arcs.erase_end(); a != end;) {
+    State::Arcs& arcs = states[s].arcs;
+    for (State::Arcs::erase_iterator a = arcs.erase_begin(), end = arcs.erase_end(); a != end;) {
       if (isTied(pGroup = a->groupId)) {
         if ((pWeight = find_second(groupWeight, (UnsignedKey)pGroup))) {
           a->weight = *pWeight;
@@ -272,25 +314,28 @@ void WFST::assignWeights(const WFST& source) {
 }
 
 void WFST::unTieGroups() {
+  thaw();
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = no_group;
   }
 }
 
 void WFST::lockArcs() {
+  thaw();
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = 0;
   }
 }
 
 unsigned WFST::numberArcsFrom(unsigned label) {
+  thaw();
   Assert(label > 0);
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = label++;
   }
@@ -300,10 +345,11 @@ unsigned WFST::numberArcsFrom(unsigned label) {
 
 void WFST::invert() {
   Assert(valid());
+  thaw();
   unsigned temp;
   in_alph().swap(out_alph());
   for (unsigned s = 0; s < states.size(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a) {
       // XXX should use SWAP here instead?
       temp = a->in;
@@ -324,7 +370,18 @@ Graph WFST::makeGraph()
   GraphState* g = NEW GraphState[numStates()];
   GraphArc gArc;
   for (unsigned i = 0, N = numStates(); i < N; ++i) {
-    for (List<FSTArc>::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
+    if (states[i].frozen()) {
+      for (FSTArc* l = states[i].packed, * end = states[i].packed_end(); l != end; ++l) {
+        gArc.src = i;
+        gArc.dest = l->dest;
+        gArc.weight = l->weight.getCost();
+        gArc.data_as<FSTArc*>() = l;
+        Assert(gArc.dest < numStates() && gArc.src < numStates());
+        g[i].arcs.push(gArc);
+      }
+      continue;
+    }
+    for (State::Arcs::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
          ++l) {
       gArc.src = i;
       gArc.dest = l->dest;
@@ -350,8 +407,21 @@ Graph WFST::makeEGraph()
   Assert(valid());
   GraphState* g = NEW GraphState[numStates()];
   GraphArc gArc;
-  for (unsigned i = 0; i < numStates(); ++i)
-    for (List<FSTArc>::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
+  for (unsigned i = 0; i < numStates(); ++i) {
+    if (states[i].frozen()) {
+      // packed arcs are sorted by (in, out), so *e*/*e* arcs lead
+      for (FSTArc* l = states[i].packed, * end = states[i].packed_end(); l != end && l->in == 0 && l->out == 0;
+           ++l) {
+        gArc.src = i;
+        gArc.dest = l->dest;
+        gArc.weight = l->weight.getCost();
+        gArc.data_as<FSTArc*>() = l;
+        Assert(gArc.dest < numStates() && gArc.src < numStates());
+        g[i].arcs.push(gArc);
+      }
+      continue;
+    }
+    for (State::Arcs::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
          ++l)
       if (l->in == 0 && l->out == 0) {
         gArc.src = i;
@@ -361,6 +431,7 @@ Graph WFST::makeEGraph()
         Assert(gArc.dest < numStates() && gArc.src < numStates());
         g[i].arcs.push(gArc);
       }
+  }
 
   Graph ret;
   ret.states = g;
@@ -388,6 +459,7 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
   unsigned i;
   bool all_paths = keep_paths_within_ratio.isInfinity();
   if (max_states == UNLIMITED && all_paths) return;
+  thaw();
   unsigned n_states = numStates();
 
   Graph for_graph = makeGraph();
@@ -435,7 +507,7 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
       else {
         remove[st] = false;
         State& s = states[st];
-        for (List<FSTArc>::erase_iterator a(s.arcs.erase_begin()), end = s.arcs.erase_end(); a != end;) {
+        for (State::Arcs::erase_iterator a(s.arcs.erase_begin()), end = s.arcs.erase_end(); a != end;) {
           FLOAT_TYPE best_path_this_arc = (-a->weight.getLogImp()) + for_dist[st] + rev_dist[a->dest];
 #ifdef DEBUGPRUNE
           Config::debug() << "FSTArc " << st << ": ";
@@ -466,6 +538,7 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
 }
 
 void WFST::reduce() {
+  thaw();
   unsigned nStates = numStates();
 
   if (!valid()) {
@@ -500,7 +573,7 @@ void WFST::reduce() {
   /* jon: the below by yaser makes no sense.  tie groups are not explicit lists
      for ( i = 0 ; i < nStates ; ++i ) {
      discard[i] = !(visitedForward[i] && visitedBackward[i]);
-     for ( List<FSTArc>::iterator a(states[i].arcs.begin()), end = states[i].arcs.end() ; a !=end ; ++a ) {
+     for ( State::Arcs::iterator a(states[i].arcs.begin()), end = states[i].arcs.end() ; a !=end ; ++a ) {
      if ((discard[i])
      || !(visitedForward[a->dest] && visitedBackward[(a->dest)])) { // if a state should be discarded remove
      its arcs from tie group, also an FSTArc must be removed if its destination state is discarded.
@@ -524,11 +597,13 @@ void WFST::reduce() {
 }
 
 void WFST::consolidateArcs(bool sum, bool clamp) {
+  thaw();
   for (unsigned i = 0; i < numStates(); ++i) states[i].reduce(sum, clamp);
 }
 
 void WFST::removeMarkedStates(bool marked[]) {
   Assert(valid());
+  thaw();
   unsigned* oldToNew = NEW unsigned[numStates()];
   unsigned n_pre = numStates();
 
@@ -27,6 +27,7 @@
 #include <graehl/shared/size_mega.hpp>
 #include <graehl/shared/debugprint.hpp>
 #include <graehl/shared/gibbs_opts.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace graehl {
 
@@ -46,6 +47,7 @@ struct PathArc {
 
 std::ostream& operator<<(std::ostream& o, const PathArc& p);
 
+struct mapped_file;  // memmap.hpp
 struct cascade_parameters;  // in cascade.h, but we avoid circular dependency by knowing only about references
 // in this header
 
@@ -238,6 +240,7 @@ class WFST {
     as_pairs_fsa(WFST& wfst, bool keep_epsilon = true, bool to_pairs = true)
         : wfst(wfst), keep_epsilon(keep_epsilon), to_pairs(to_pairs) {
       if (!to_pairs) return;
+      wfst.thaw();
 
       typedef HashTable<newsym, unsigned> tosyms;
 
@@ -409,6 +412,7 @@ class WFST {
   // new one)
   void ensure_final_sink() {
     if (!states[final].size) return;
+    thaw();
     state_id old_final = final;
     final = add_state("FINAL_SINK");
     states[old_final].addArc(FSTArc(epsilon_index, epsilon_index, final, 1));
@@ -488,6 +492,9 @@ class WFST {
   // note: std::vector<State> doesn't work with State::state_adder because copies by value are made during
   // readLegible
 
+  // arc list nodes of states given it (State::use_arena), e.g. by composition; released by clear() and
+  // freeze()
+  node_arena arc_arena;
   StateVector states;
 
   //  HashTable<UnsignedKey, int> tieGroup; // UnsignedKey is FSTArc *; value in group number (0 means fixed
@@ -500,6 +507,14 @@ class WFST {
   void writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON = false);  // for graphviz
   void writeLegible(ostream&, bool include_zero = false);
   void writeLegibleFilename(std::string const& name, bool include_zero = false);
+  // binary image: a header, the arcs as freeze() packs them, and offset tables of the alphabets and state
+  // names.  readBinary maps the file copy-on-write and leaves the WFST frozen with its states pointing at the
+  // mapped arcs, so loading parses nothing per arc, and processes loading the same file share its pages
+  // until they change a weight.  images are only portable between builds with the same FSTArc layout
+  static bool is_binary(istream&);  // true if it starts with a binary image (peeks; nothing is read)
+  void writeBinary(ostream&);  // freezes first
+  // returns false (and invalidates) on failure.  the image starts offset (a multiple of 8) bytes into the file
+  bool readBinary(std::string const& filename, std::size_t offset = 0);
   void writeGraphViz(ostream&);  // see http://www.research.att.com/sw/tools/graphviz/
   unsigned numStates() const { return states.size(); }
   bool isFinal(unsigned s) { return s == final; }
@@ -539,6 +554,7 @@ class WFST {
   }
 
   static unsigned indexThreshold;
+  static compose_limits composeLimits;  // for every (eager) composition
   enum norm_group_by {
     CONDITIONAL,  // all arcs from a state with the same input will add to one
     JOINT,  // all arcs from a state will add to one (thus sum of all paths from start to finish = 1 assuming
@@ -633,7 +649,18 @@ class WFST {
   void indexInput() { index(kInput); }
   void indexOutput() { index(kOutput); }
 
+  // frozen: all arcs live in one array packed_arcs (CSR - state s owns states[s].packed[0..size)), sorted by
+  // (source, in, out).  visit_arcs, makeGraph, and index use it directly; anything that adds/removes arcs or
+  // walks State::arcs thaws first.  FSTArc pointers (cascade_parameters, arcs_table) don't survive
+  // freeze/thaw.  after readBinary, the packed arcs are in arcs_file instead
+  fixed_array<FSTArc> packed_arcs;
+  boost::shared_ptr<mapped_file> arcs_file;
+  bool frozen() const { return !packed_arcs.empty() || arcs_file; }
+  void freeze();
+  void thaw();  // back to State::arcs lists, in frozen order
+
   void project(LabelType dir = kInput, bool identity_fsa = false) {
+    thaw();
     if (identity_fsa) identity_alphabet_from(dir);
     for (unsigned s = 0; s < numStates(); ++s) states[s].project(dir, identity_fsa);
   }
@@ -676,6 +703,8 @@ class WFST {
   // arcs anyway
   void set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates = false,
                    bool preserveGroups = false);
+  // alphabets of a*b; false (and invalid) unless both are valid.  composer fills in the states
+  bool compose_prepare(WFST& a, WFST& b);
   // resulting WFST has only reference to input/output alphabets - use ownAlphabet()
   // if the original source of the alphabets must be deleted
 
@@ -699,6 +728,7 @@ class WFST {
 
   void listAlphabet(ostream& out, LabelType dir = kInput);
   friend ostream& operator<<(ostream&, WFST&);  // Yaser 7-20-2000
+  friend struct composer;
   // I=PathArc output iterator; returns length of path or -1 on error
   unsigned randomPath(List<PathArc>* l, unsigned max_len = ~0) {
     return randomPath(l->back_inserter(), max_len);
@@ -707,6 +737,7 @@ class WFST {
   /// choices; doesn't pick a path relative to sum-of-all-paths
   template <class I>
   bool randomPath(I i, unsigned max_len = -1) {
+    thaw();
     PathArc p;
     unsigned s = 0;
     unsigned len = 0;
@@ -716,7 +747,7 @@ class WFST {
       if (len > max || states[s].arcs.isEmpty()) return ~0;
       // choose random arc:
       Weight arcsum;
-      typedef List<FSTArc> LA;
+      typedef State::Arcs LA;
       typedef LA::const_iterator LAit;
       const LA& arcs = states[s].arcs;
       LAit start = arcs.const_begin(), end = arcs.const_end();
@@ -1058,6 +1089,9 @@ class WFST {
     unsigned cache_level;
     std::string disk_cache_filename;
     size_t_bytes disk_cache_bufsize;
+    size_t_bytes disk_cache_lz4;  // 0, or the block size
+    unsigned read_ahead;  // # of derivations a thread deserializes ahead of the E-step (0: none)
+    unsigned threads;  // computing them
     bool use_disk() const { return cache_level == cache_disk; }
     bool cache() const { return cache_level != cache_nothing && cache_level != matrix_fb; }
     bool cache_backward() const { return cache_level == cache_forward_backward; }
@@ -1067,6 +1101,9 @@ class WFST {
       cache_level = cache_nothing;
       disk_cache_filename = "/tmp/carmel.derivations.XXXXXX";
       disk_cache_bufsize = 256 * 1024 * 1024;
+      disk_cache_lz4 = size_t_bytes();
+      read_ahead = 0;
+      threads = 1;
     }
   };
 
@@ -1078,10 +1115,24 @@ class WFST {
     double learning_rate_growth_factor;
     int ran_restarts;
     random_restart_acceptor ra;
+    unsigned threads;  // for the E-step over cached derivations
+    bool scaled_fb;  // forward/backward over derivations in (scaled) doubles, not Weight
+    bool log_sum_fb;  // forward/backward sums all of a state's arcs at once (log_sum), not one + per arc
+    log_add_mode log_add;  // for log_sum_fb
+    unsigned online_batch;  // stepwise EM: reestimate after each this many examples (0: batch EM)
+    double online_alpha;  // stepwise EM: the k-th step has size (k+1)^-alpha
+    bool squarem;  // extrapolate every other EM step
 
     train_opts() { set_defaults(); }
     void set_defaults() {
       max_iter = 500;
+      threads = 1;
+      scaled_fb = false;
+      log_sum_fb = false;
+      log_add = log_add_exact;
+      online_batch = 0;
+      online_alpha = .7;
+      squarem = false;
       cache.set_defaults();
       learning_rate_growth_factor = 1.;
       ran_restarts = 0;
@@ -1246,6 +1297,9 @@ class WFST {
     final = invalid_state;
     unNameStates();
     states.clear();
+    arc_arena.clear();
+    packed_arcs.clear();
+    arcs_file.reset();
     destroy();
   }
   ~WFST() { destroy(); }
@@ -1361,7 +1415,7 @@ class NormGroupIter {
   State* end;
   typedef HashTable<UnsignedKey, List<HalfArc> >::iterator Cit;
   typedef List<HalfArc>::const_iterator Cit2;
-  typedef List<FSTArc>::val_iterator Jit;
+  typedef State::Arcs::val_iterator Jit;
   Cit Ci;
   Cit2 Ci2, Cend;
   Jit Ji, Jend;
@@ -1375,6 +1429,7 @@ class NormGroupIter {
  public:
   unsigned source() { return state - begin; }
   NormGroupIter(WFST::norm_group_by meth, WFST& wfst_) : wfst(wfst_), method(meth) {
+    Assert(!wfst.frozen());  // walks State::arcs
     state = begin = &*wfst.states.begin();
     end = begin + wfst.numStates();
     beginState();
@@ -31,10 +31,40 @@ struct carmel_gibbs : public gibbs_base {
     finish_params();
     cascade.set_trivial_gibbs_chains();
     pinit_differs_p0 = init_sample_weights && !gopt.em_p0;
+    n_threads = topt.threads;
+    if (gibbs_base::gopt.block_threads > 1 && !derivs.can_share()) {
+      Config::warn() << "--crp-threads needs derivations cached in memory; sampling with 1 thread.\n";
+      gibbs_base::gopt.block_threads = 1;
+    }
+  }
+
+  // another chain for run_chains: shares main's params, cascade and derivations, and prints to out
+  carmel_gibbs(carmel_gibbs& main, std::ostream& out, std::ostream& log, random& rng)
+      : gibbs_base(main, out, log, rng)
+      , have_names(main.have_names)
+      , arcs(main.arcs)
+      , arc_sources(main.arc_sources)
+      , composed(main.composed)
+      , cascade(main.cascade)
+      , methods(main.methods)
+      , printer(main.printer)
+      , cascadei(main.cascadei)
+      , derivs(main.derivs)
+      , init_sample_weights(main.init_sample_weights)
+      , pinit_differs_p0(main.pinit_differs_p0)
+      , n_threads(1) {
+    printer.set_out(out);
   }
 
+  enum { chain_copies = 1 };
+
   void run() {
-    gibbs_base::run_starts(*this);
+    bool chains = gopt.restarts > 0 && n_threads > 1 && derivs.can_share();
+    if (chains || gopt.block_threads > 1) derivs.share_derivations(false, true);
+    if (chains)
+      gibbs_base::run_chains(*this, n_threads);
+    else
+      gibbs_base::run_starts(*this);
     // copy weights to transd. so path weights are right?
     gibbs_base::print_all(*this, true);
     probs_to_cascade();
@@ -301,11 +331,11 @@ struct carmel_gibbs : public gibbs_base {
   }
 
 #define OUTGIBBS3(x)  // OUTGIBBS(x)
-  double block_weight(unsigned block) { return derivs.derivs[block].weight; }
+  double block_weight(unsigned block) { return derivs.deriv(block).weight; }
 
   void resample_block(unsigned block) {
     block_delta& b = sample[block];  // already cleared
-    derivations& d = derivs.derivs[block];
+    derivations& d = derivs.deriv(block);
     OUTGIBBS3(" block " << block << " line " << d.lineno << "\n");
     blockp = &b.id;
     if (gopt.expectation) {
@@ -315,11 +345,11 @@ struct carmel_gibbs : public gibbs_base {
       b.prob = d.collect_counts_gibbs(*this);
     } else {
       if (init_prob)  // if iteration==0
-        d.random_path(p_init(*this), power);  // because init sample distribution may be different from p0
-                                              // e.g. from EM.  this also means we aren't using cache to
-                                              // generate first sample at all
+        d.random_path(p_init(*this), power, *this);  // because init sample distribution may be different
+                                                     // from p0 e.g. from EM.  this also means we aren't
+                                                     // using cache to generate first sample at all
       else
-        d.random_path(*this, power);
+        d.random_path(*this, power, *this);
     }
 
     OUTGIBBS3('\n')
@@ -344,7 +374,7 @@ struct carmel_gibbs : public gibbs_base {
     void choose_arc(GraphArc const& a) const { return c.choose_arc(a); }
   };
   // for resample block:
-  // *this is used as WeightFor in derivations pfor,random_path:
+  // *this is used as WeightFor (and the random source) in derivations random_path:
   Weight operator()(GraphArc const& a) const {
     Weight prob = one_weight();
     OUTGIBBS2("p(" << a << "):");
@@ -372,6 +402,7 @@ struct carmel_gibbs : public gibbs_base {
 
   bool init_prob;  // NOTE: unlike old method, composed weights don't get updated until all runs are done
   bool pinit_differs_p0;
+  unsigned n_threads;  // --threads: restarts' chains run at once
 
   void init_run(unsigned r) {
     init_prob = (r == 0 && pinit_differs_p0);
@@ -386,6 +417,7 @@ struct carmel_gibbs : public gibbs_base {
 void WFST::train_gibbs(cascade_parameters& cascade, training_corpus& corpus, NormalizeMethods& methods,
                        train_opts const& topt, gibbs_opts const& gopt1, path_print const& printer,
                        double min_prior) {
+  thaw();
   cascade.set_composed(this);  // FIXME: yes, this is done repeatedly. defensive programming!
   for (NormalizeMethods::iterator i = methods.begin(), e = methods.end(); i != e; ++i) {
     if (i->add_count <= 0) {
@@ -0,0 +1,217 @@
+#ifndef GRAEHL_CARMEL__LAZY_COMPOSE_H
+#define GRAEHL_CARMEL__LAZY_COMPOSE_H
+
+#include <carmel/src/fst.h>
+#include <carmel/src/cascade.h>
+#include <graehl/shared/dynamic_array.hpp>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace graehl {
+
+// the composition of a whole chain of transducers, built only as far as a search needs it: each product
+// state's arcs are computed (and the operand product states it's made of expanded, recursively) the first
+// time the search leaves it.  k-best with a small k usually touches a tiny fraction of what
+// WFST(cascade,a,b) would build.  no training (the cascade is trivial) and no sum-of-paths, which needs
+// every reachable state anyway.
+//
+// the k-best search is A*: each chain member's best costs to final (costs_to_final) bound a product state's
+// from below, so the search stays in the corridor of states that can still be on a good path, and never
+// enters one that can't reach final at all
+struct lazy_cascade {
+  typedef std::vector<double> final_costs;  // per state
+
+  // *chain[0] * *chain[1] * ... * *chain[n-1], associated like carmel's composition loop: ((0*1)*2)... or,
+  // if right_assoc, ...(n-3*(n-2*n-1)).  to_final[i], if given and not empty, is costs_to_final(*chain[i])
+  // (so machines shared by many lazy_cascades need it computed only once)
+  lazy_cascade(WFST* const* chain, unsigned n, bool right_assoc, bool namedStates = false,
+               bool preserveGroups = false, final_costs const* to_final = 0)
+      : ok(true), own_to_final(n) {
+    Assert(n >= 2);
+    composer* last = 0;
+    for (unsigned i = 1; i < n && ok; ++i) {
+      unsigned inext = right_assoc ? n - 1 - i : i, iprev = right_assoc ? n - 1 : 0;
+      WFST& next = *chain[inext];
+      WFST& prev = last ? *results.back() : *chain[iprev];
+      WFST* r = NEW WFST();
+      results.push_back(r);
+      WFST& a = right_assoc ? next : prev;
+      WFST& b = right_assoc ? prev : next;
+      if (!(ok = r->compose_prepare(a, b))) break;
+      double const* hnext = leaf_costs(chain, to_final, inext);
+      double const* hprev = last ? 0 : leaf_costs(chain, to_final, iprev);
+      composers.push_back(last = NEW composer(cascade, *r, a, b, namedStates, preserveGroups, true,
+                                              right_assoc ? 0 : last, right_assoc ? last : 0,
+                                              right_assoc ? hnext : hprev, right_assoc ? hprev : hnext));
+    }
+  }
+
+  ~lazy_cascade() {
+    for (unsigned i = composers.size(); i > 0;) delete composers[--i];
+    for (unsigned i = results.size(); i > 0;) delete results[--i];
+  }
+
+  bool valid() const { return ok; }
+  WFST& result() { return *results.back(); }
+
+  // states added / expanded, over every composition in the chain
+  unsigned n_states() const {
+    unsigned n = 0;
+    for (unsigned i = 0; i < results.size(); ++i) n += results[i]->numStates();
+    return n;
+  }
+  unsigned n_expanded() const {
+    unsigned n = 0;
+    for (unsigned i = 0; i < composers.size(); ++i) n += composers[i]->n_expanded;
+    return n;
+  }
+
+  // true if every arc in w has weight <= 1, i.e. nonnegative cost, which the k-best search requires
+  static bool costs_nonnegative(WFST const& w) {
+    nonnegative_cost v;
+    w.visit_arcs_sourceless(v);
+    return v.ok;
+  }
+
+  // to_final[q] = cost of the best path from q to w's final state (HUGE_VAL if there's none): Dijkstra from
+  // final over the reversed arcs.  costs must be nonnegative
+  static void costs_to_final(WFST& w, final_costs& to_final) {
+    unsigned n = w.numStates();
+    to_final.assign(n, HUGE_VAL);
+    if (!w.valid()) return;
+    reverse_arcs rev;
+    rev.start.assign(n + 1, 0);
+    w.visit_arcs(rev);
+    for (unsigned q = 0; q < n; ++q) rev.start[q + 1] += rev.start[q];
+    rev.next.assign(rev.start.begin(), rev.start.end() - 1);
+    rev.arcs.resize(rev.start[n]);
+    rev.filling = true;
+    w.visit_arcs(rev);
+    typedef std::pair<double, unsigned> item;
+    std::priority_queue<item, std::vector<item>, std::greater<item> > agenda;
+    agenda.push(item(to_final[w.final] = 0, w.final));
+    while (!agenda.empty()) {
+      item top = agenda.top();
+      agenda.pop();
+      unsigned q = top.second;
+      if (top.first > to_final[q]) continue;  // already settled, cheaper
+      for (unsigned j = rev.start[q], e = rev.start[q + 1]; j != e; ++j) {
+        double c = top.first + rev.arcs[j].first;
+        unsigned src = rev.arcs[j].second;
+        if (c < to_final[src]) agenda.push(item(to_final[src] = c, src));
+      }
+    }
+  }
+
+  // the k best (not necessarily simple) paths from start to a final state, best first, visited as by
+  // WFST::visit_kbest (no sidetrack-only mode).  each state is settled at most k times (A* with a consistent
+  // heuristic, popping each state once per path through it, cheapest first).  returns the number of paths
+  // found
+  template <class Visitor>
+  unsigned visit_kbest(unsigned k, Visitor& v) {
+    if (!ok || !k) return 0;
+    composer& top = *composers.back();
+    WFST& w = result();
+    nodes.clear();
+    pops.clear();
+    agenda_type agenda;
+    if (top.heuristic(0) == HUGE_VAL) return 0;
+    push(agenda, 0, 0, (unsigned)~0, 0, top.heuristic(0));
+    unsigned found = 0;
+    std::vector<FSTArc*> path;
+    while (!agenda.empty()) {
+      unsigned i = agenda.top().second;
+      agenda.pop();
+      node n = nodes[i];
+      unsigned& npop = pops.at_grow(n.state);
+      if (npop >= k) continue;
+      ++npop;
+      if (top.is_final(n.state)) {
+        path.clear();
+        for (unsigned j = i; nodes[j].arc; j = nodes[j].back) path.push_back(nodes[j].arc);
+        v.start_path(++found, Weight(n.cost, cost_weight()));
+        for (std::vector<FSTArc*>::reverse_iterator a = path.rbegin(), e = path.rend(); a != e; ++a)
+          v.visit_best_arc(**a);
+        v.end_path();
+        if (found == k) break;
+      }
+      top.expand(n.state);
+      State& s = w.states[n.state];
+      for (State::Arcs::val_iterator a = s.arcs.val_begin(), e = s.arcs.val_end(); a != e; ++a)
+        if (pops.at_grow(a->dest) < k) {
+          double h = top.heuristic(a->dest);
+          if (h != HUGE_VAL) push(agenda, a->dest, &*a, i, n.cost + a->weight.getCost(), h);
+        }
+    }
+    return found;
+  }
+
+ private:
+  bool ok;
+  cascade_parameters cascade;  // trivial
+  std::vector<WFST*> results;
+  std::vector<composer*> composers;
+  std::vector<final_costs> own_to_final;  // for chain members without a given to_final
+
+  double const* leaf_costs(WFST* const* chain, final_costs const* to_final, unsigned i) {
+    final_costs const* c = to_final ? &to_final[i] : 0;
+    if (!c || c->empty()) {
+      costs_to_final(*chain[i], own_to_final[i]);
+      c = &own_to_final[i];
+    }
+    return c->empty() ? 0 : &(*c)[0];
+  }
+
+  struct node {
+    unsigned state;
+    FSTArc* arc;  // into state; NULL for start
+    unsigned back;  // node arc leaves from
+    double cost;
+  };
+  std::vector<node> nodes;
+  dynamic_array<unsigned> pops;  // per result state
+  typedef std::pair<double, unsigned> agenda_item;  // cost + heuristic, node (ties: earlier node first)
+  typedef std::priority_queue<agenda_item, std::vector<agenda_item>, std::greater<agenda_item> > agenda_type;
+
+  void push(agenda_type& agenda, unsigned state, FSTArc* arc, unsigned back, double cost, double h) {
+    node n;
+    n.state = state;
+    n.arc = arc;
+    n.back = back;
+    n.cost = cost;
+    agenda.push(agenda_item(cost + h, nodes.size()));
+    nodes.push_back(n);
+  }
+
+  // the arcs into each state, as (cost, source): counted (by dest) in one pass, placed in the next
+  struct reverse_arcs {
+    std::vector<unsigned> start;  // arcs into q are [start[q], start[q+1])
+    std::vector<unsigned> next;  // filling: next free slot for q
+    std::vector<std::pair<double, unsigned> > arcs;
+    bool filling;
+    reverse_arcs() : filling(false) {}
+    void operator()(unsigned src, FSTArc const& a) {
+      if (filling)
+        arcs[next[a.dest]++] = std::pair<double, unsigned>(a.weight.getCost(), src);
+      else
+        ++start[a.dest + 1];
+    }
+  };
+
+  struct nonnegative_cost {
+    bool ok;
+    nonnegative_cost() : ok(true) {}
+    void operator()(FSTArc const& a) {
+      if (a.weight > Weight::ONE()) ok = false;
+    }
+  };
+};
+
+
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <graehl/shared/2hash.h>
 #include <graehl/shared/weight.h>
 #include <graehl/shared/list.h>
+#include <graehl/shared/node_arena.hpp>
 #include <graehl/shared/arc.h>
 #include <iostream>
 
@@ -50,7 +51,14 @@ namespace graehl {
 
 struct State {
 
-  typedef List<FSTArc> Arcs;
+  typedef List<FSTArc, arena_allocator<FSTArc> > Arcs;
+
+  /// order of arcs within a frozen state (see WFST::freeze)
+  struct by_in_out {
+    bool operator()(FSTArc const& a, FSTArc const& b) const {
+      return a.in < b.in || (a.in == b.in && a.out < b.out);
+    }
+  };
 
   // note: loses tie groups.
   // openfst.org MutableFst<LogArc>, (or StdArc) eg StdVectorFst<StdArc>
@@ -58,6 +66,11 @@ struct State {
   void to_openfst(Fst& fst, unsigned source) const {
     typedef typename Fst::Arc A;
     typedef typename A::Weight W;
+    if (packed) {
+      for (FSTArc const* a = packed, * end = packed_end(); a != end; ++a)
+        fst.AddArc(source, A(a->in, a->out, W(a->weight.getNegLn()), a->dest));
+      return;
+    }
     for (Arcs::const_iterator a = arcs.begin(), end = arcs.end(); a != end; ++a) {
       fst.AddArc(source, A(a->in, a->out, W(a->weight.getNegLn()), a->dest));
       // note: just like we do, openfst uses index 0 for epsilons
@@ -66,6 +79,10 @@ struct State {
 
   template <class V>
   void visit_arcs(V& v) const {
+    if (packed) {
+      for (FSTArc const* i = packed, * e = packed_end(); i != e; ++i) v(*i);
+      return;
+    }
     for (Arcs::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
       v(*i);
     }
@@ -73,6 +90,10 @@ struct State {
 
   template <class V>
   void visit_arcs(unsigned s, V& v) {
+    if (packed) {
+      for (FSTArc* i = packed, * e = packed_end(); i != e; ++i) v(s, *i);
+      return;
+    }
     for (Arcs::val_iterator i = arcs.val_begin(), e = arcs.val_end(); i != e; ++i) {
       v(s, *i);
     }
@@ -103,6 +124,11 @@ struct State {
 
   Arcs arcs;
   unsigned size;
+  // non-NULL while the owning WFST is frozen: arcs is then empty, and the size arcs are packed[0..size),
+  // sorted by (in, out)
+  FSTArc* packed;
+  bool frozen() const { return packed != NULL; }
+  FSTArc* packed_end() const { return packed + size; }
 #ifdef BIDIRECTIONAL
   int hitcount;  // how many times index is used, negative for index on input, positive for index on output
 #endif
@@ -110,6 +136,10 @@ struct State {
 
   template <class IOMap>
   void index_io(IOMap& m) const {
+    if (packed) {
+      for (FSTArc* a = packed, * end = packed_end(); a != end; ++a) m[IOPair(a->in, a->out)].push_back(a);
+      return;
+    }
     for (Arcs::const_iterator a = arcs.begin(), end = arcs.end(); a != end; ++a)
       m[IOPair(a->in, a->out)].push_back(const_cast<FSTArc*>(&*a));
   }
@@ -120,6 +150,7 @@ struct State {
   State()
       : arcs()
       , size(0)
+      , packed(NULL)
       ,
 #ifdef BIDIRECTIONAL
       hitcount(0)
@@ -127,7 +158,7 @@ struct State {
 #endif
       index(NULL) {
   }
-  State(const State& s) : arcs(s.arcs), size(s.size) {
+  State(const State& s) : arcs(s.arcs), size(s.size), packed(s.packed) {
 #ifdef BIDIRECTIONAL
     hitcount = s.hitcount;
 #endif
@@ -138,7 +169,17 @@ struct State {
   }
   ~State() { flush(); }
 
+  // arcs added from now on (there must be none yet) come from arena, which must outlive them
+  void use_arena(node_arena& arena) {
+    Assert(arcs.empty());
+    arcs.use_allocator(arena_allocator<FSTArc>(&arena));
+  }
+
   void raisePower(double exponent = 1.0) {
+    if (packed) {
+      for (FSTArc* l = packed, * end = packed_end(); l != end; ++l) l->weight.raisePower(exponent);
+      return;
+    }
     for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l)
       l->weight.raisePower(exponent);
   }
@@ -147,6 +188,7 @@ struct State {
   // input => left projection, output => right.  epsilon->string or string->epsilon (identity_fsa=true), or
   // string->string (identity_fsa=false)
   void project(LabelType dir = kInput, bool identity_fsa = false) {
+    Assert(!packed);
     flush();
     for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l)
       if (dir == kInput)
@@ -165,6 +207,10 @@ struct State {
       if (index) return;
 #endif
       index = NEW Index(size);
+      if (packed) {
+        for (FSTArc* l = packed, * end = packed_end(); l != end; ++l) (*index)[l->out].push_front(l);
+        return;
+      }
       for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
 // if you distrust ht[key], I guess: //#define QUEERINDEX
 #ifdef QUEERINDEX
@@ -186,6 +232,10 @@ struct State {
     if (index) return;
 #endif
     index = NEW Index(size);
+    if (packed) {
+      for (FSTArc* l = packed, * end = packed_end(); l != end; ++l) (*index)[l->in].push_front(l);
+      return;
+    }
     for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
 #ifdef QUEERINDEX
       if (!(list = find_second(*index, (UnsignedKey)l->in)))
@@ -232,6 +282,7 @@ struct State {
 
 
   FSTArc& addArc(const FSTArc& arc) {
+    Assert(!packed);
     arcs.push(arc);
     ++size;
     Assert(!index);
@@ -255,6 +306,7 @@ struct State {
   }
 
   void reduce(bool sum = true, bool clamp = false) {  // consolidate all duplicate arcs
+    Assert(!packed);
     flush();
     HashTable<UnArc, Weight*> hWeights;
     UnArc un;
@@ -280,6 +332,7 @@ struct State {
   remove_epsilons_to(unsigned dest)  // *e*/*e* transition to same state has no structural/bestpath value.  we
   // do this always when reducing (not "-d")
   {
+    Assert(!packed);
     flush();
     for (Arcs::erase_iterator a = arcs.erase_begin(), end = arcs.erase_end(); a != end;)
       if (a->in == 0 && a->out == 0 && a->dest == dest)  // erase empty loops
@@ -289,6 +342,7 @@ struct State {
   }
 
   void prune(Weight thresh) {
+    Assert(!packed);
     for (Arcs::erase_iterator l = arcs.erase_begin(), end = arcs.erase_end(); l != end;) {
       if (l->weight < thresh) {
         l = remove(l);
@@ -302,6 +356,7 @@ struct State {
     return arcs.erase(t);
   }
   void renumberDestinations(unsigned* oldToNew) {  // negative means remove transition
+    Assert(!packed);
     flush();
     for (Arcs::erase_iterator l = arcs.erase_begin(), end = arcs.erase_end(); l != end;) {
       unsigned& dest = (unsigned&)l->dest;
@@ -317,6 +372,7 @@ struct State {
     using std::swap;
     swap(size, b.size);
     swap(arcs, b.arcs);
+    swap(packed, b.packed);
     swap(index, b.index);  // safe only because List iterators are stable when lists are swapped
 #ifdef BIDIRECTIONAL
     swap(hitcount, b.hitcount);
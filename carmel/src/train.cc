@@ -8,6 +8,14 @@
 #include <graehl/shared/periodic.hpp>
 #include <graehl/shared/segments.hpp>
 #include <graehl/shared/time_space_report.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
 #define GRAEHL__DEBUG_PRINT_MAIN
 #include <graehl/shared/debugprint.hpp>
 //#define DEBUGTRAIN
@@ -27,7 +35,7 @@ void training_progress_scale(unsigned n, unsigned N, unsigned num_every) {
 }
 
 
-derivations::statistics derivations::global_stats;
+THREADLOCAL derivations::statistics derivations::global_stats;
 
 void check_fb_agree(Weight fin, Weight fin2) {
 #ifdef DEBUGTRAIN
@@ -198,6 +206,13 @@ struct use_best_weight {
 };
 
 
+// --online-em starts from the initial weights as if they were (corpus weight) counts
+struct weight_as_counts {
+  Weight scale;
+  weight_as_counts(Weight scale) : scale(scale) {}
+  void operator()(arc_counts& a) const { a.counts = a.weight() * scale; }
+};
+
 struct clear_count {
   void operator()(arc_counts& a) const { a.counts.setZero(); }
 };
@@ -316,17 +331,116 @@ struct forward_backward : public cached_derivs<arc_counts> {
     assert(!use_matrix);
     unweighted_corpus_prob = &unweighted_corpus_prob_accum;
     weighted_corpus_prob.setOne();
-    cache_t::foreach_deriv(*this);
-    Config::log() << '\n';
+    if (scaled) prepare_scaled();
+    if (parallel_estimate())
+      estimate_parallel();
+    else {
+      if (scaled) real_counts.reinit(arcs.size());  // zero
+      cache_t::foreach_deriv(*this);
+      if (scaled) add_real_counts(real_counts.begin());
+    }
+    log_read_stats(Config::log());
+    if (progress) Config::log() << '\n';
     return weighted_corpus_prob;
   }
   Weight estimate_matrix(Weight& unweighted_corpus_prob_accum);
 
+  // the E-step may be split among n_threads only if every example's derivations are in memory, and there's
+  // no --fem derivation output (written in example order)
+  unsigned n_threads;
+  bool parallel_estimate() const {
+    return n_threads > 1 && cached && !derivs.use_file && !(first && !out_derivfile.empty())
+           && derivs.store.size() > 1;
+  }
+
+  // --scaled-fb: forward/backward in doubles (derivations::collect_counts_scaled) instead of Weight.  arc
+  // weights are converted once per E-step, and the expected counts are collected as doubles (they're at most
+  // the corpus size) and converted after all the examples
+  bool scaled;
+  // --log-sum-fb: forward/backward sums each state's arcs at once (derivations::plan_fb), in mode log_add,
+  // which also merges the --threads blocks' counts
+  bool log_sum;
+  log_add_mode log_add;
+  fixed_array<double> real_weights, real_counts;
+  fixed_array<unsigned char> arc_advance;  // # of input+output symbols an arc reads
+  void prepare_scaled() {
+    unsigned n = arcs.size();
+    if (arc_advance.size() != n) {
+      arc_advance.reinit(n);
+      real_weights.reinit(n);
+      for (unsigned i = 0; i < n; ++i)
+        arc_advance[i] = (arcs[i].in() != WFST::epsilon_index) + (arcs[i].out() != WFST::epsilon_index);
+    }
+    for (unsigned i = 0; i < n; ++i) real_weights[i] = arcs[i].weight().getReal();
+  }
+  void add_real_counts(double const* counts) {
+    for (unsigned i = 0, n = arcs.size(); i < n; ++i)
+      if (counts[i] > 0) arcs[i].counts += Weight(counts[i]);
+  }
+  Weight collect_counts(derivations& d, double* counts) {
+    return d.collect_counts_scaled(real_weights.begin(), arc_advance.begin(), counts);
+  }
+
+  // --threads E-step: the examples are split into (at most) e_step_blocks contiguous blocks, however many
+  // threads there are.  a block's counts (indexed like arcs) and corpus probs are summed from zero, and the
+  // blocks are added to the totals in order
+  enum { e_step_blocks = 64 };
+  struct e_step_block {
+    unsigned begin, end;
+    fixed_array<Weight> counts;  // (real_counts if scaled)
+    fixed_array<double> real_counts;
+    Weight unweighted_prob, weighted_prob;
+    bool done;
+  };
+  struct e_step {
+    fixed_array<e_step_block> blocks;
+    unsigned next;  // the next block to sum
+    unsigned n_added;  // blocks[0...n_added) are in the totals
+    fixed_array<Weight> counts;  // the totals (real_counts if scaled)
+    fixed_array<double> real_counts;
+    std::vector<fixed_array<Weight> > spare;  // the counts of blocks already added, for reuse
+    std::vector<fixed_array<double> > spare_real;
+    std::exception_ptr error;
+    std::mutex mutex;
+  };
+  void estimate_parallel();
+  void e_step_worker(e_step& e);
+  void sum_block(e_step_block& b);
+
+  // --online-em: stepwise EM.  counts are a running estimate of the whole corpus's expected counts (at first,
+  // the initial weights); after each mini-batch of examples they move toward the batch's counts (scaled up to
+  // the corpus weight) by (k+1)^-alpha for the k-th batch since the (re)start, and the weights are
+  // reestimated from them
+  unsigned online_batch;
+  double online_alpha;
+  unsigned online_steps;
+  unsigned batch_n;  // examples in the current batch
+  double batch_weight;  // their total weight
+  double online_weight;  // the corpus's
+  fixed_array<Weight> batch_counts;  // (real_counts if scaled)
+  WFST::NormalizeMethods const* online_methods;
+  Weight online_change;  // greatest maximize change this pass
+  struct online_example {
+    forward_backward& fb;
+    explicit online_example(forward_backward& fb) : fb(fb) {}
+    void operator()(unsigned n, derivations& d) { fb.add_online_example(n, d); }
+  };
+  void add_online_example(unsigned n, derivations& d);
+  void online_step();
+
  public:
+  bool online() const { return online_batch && !use_matrix; }
+  // one pass over the corpus, reestimating after each batch (so weights are already normalized).  returns
+  // the corpus prob accumulated under the weights as they changed; last_change gets the greatest maximize
+  // change.  restart: forget counts from earlier passes
+  Weight estimate_online(Weight& unweighted_corpus_prob, WFST::NormalizeMethods const& methods, bool restart,
+                         Weight& last_change);
+
   void operator()(unsigned n, derivations& derivs)  // for foreach_deriv
   {
-    training_progress_scale(n, corpus().size());
-    Weight prob = derivs.collect_counts(arcs);
+    if (progress) training_progress_scale(n, corpus().size());
+    Weight prob = scaled ? collect_counts(derivs, real_counts.begin())
+                         : derivs.collect_counts(arcs, log_sum, log_add);
     *unweighted_corpus_prob *= prob;
     weighted_corpus_prob *= prob.pow(derivs.weight);
   }
@@ -371,6 +485,21 @@ struct forward_backward : public cached_derivs<arc_counts> {
       , arcs(x, per_arc_prior, global_prior)
       , mio(arcs) {
     WFST::deriv_cache_opts const& copt = opts.cache;
+    n_threads = opts.threads;
+    scaled = opts.scaled_fb;
+    log_sum = opts.log_sum_fb;
+    log_add = opts.log_add;
+    online_batch = opts.online_batch;
+    online_alpha = opts.online_alpha;
+    online_steps = batch_n = 0;
+    batch_weight = online_weight = 0;
+    online_methods = NULL;
+    squarem = opts.squarem;
+    squarem_restart();
+    squarem_last_step = sum_steps = 0;
+    n_extrapolated = n_rejected = 0;
+    progress = true;
+    x_mutex = NULL;
     odf = copt.out_derivfile;
     prune = copt.prune();
     cascade.set_composed(&x);
@@ -456,9 +585,115 @@ struct forward_backward : public cached_derivs<arc_counts> {
 
   void load_best() { arcs.visit(for_arcs::use_best_weight()); }
 
+  // --squarem: after every other maximize, the weights are extrapolated (SQUAREM's S3 step length, on log
+  // weights) from the last two EM steps, and the next estimate checks them.  if they're no better, train
+  // calls squarem_reject, reverting to the plain EM weights that maximize left in em_weight
+  bool squarem;
+  unsigned squarem_phase;  // 1: the weights are one EM step past squarem_from
+  fixed_array<Weight> squarem_from;
+  double squarem_max_step;  // grows while it limits the step length, shrinks after a rejection
+  bool squarem_extrapolated;  // the weights about to be estimated are
+  double squarem_last_step;
+  unsigned n_extrapolated, n_rejected;
+  double sum_steps;  // of the accepted extrapolations
+
+  void squarem_restart() {
+    squarem_phase = 0;
+    squarem_max_step = 1;
+    squarem_extrapolated = false;
+  }
+  // after maximize
+  void squarem_step(WFST::NormalizeMethods const& methods);
+  void squarem_reject() {
+    arcs.visit(for_arcs::keep_em_weight());
+    squarem_extrapolated = false;
+    squarem_phase = 0;
+    ++n_rejected;
+    sum_steps -= squarem_last_step;
+    squarem_max_step = std::max(1., squarem_max_step / 4);
+  }
+  void squarem_report(std::ostream& o, unsigned n_estimates) const {
+    unsigned n_accepted = n_extrapolated - n_rejected;
+    o << "SQUAREM: " << n_extrapolated << " of " << n_estimates << " E-steps were at extrapolated weights ("
+      << n_rejected << " rejected, for plain EM)";
+    if (n_accepted) o << "; mean accepted step length " << sum_steps / n_accepted << " (EM's is 1)";
+    o << ".\n";
+  }
+
+  // --threads random restarts (see em_restart::run_parallel): a worker has its own copy of x's arcs (which
+  // its arcs point to), and counts the main forward_backward's derivations.  it uses x only to normalize, one
+  // worker at a time (weights_in_x)
+  bool progress;  // dots while counting
+  std::mutex* x_mutex;  // a worker's
+  fixed_array<FSTArc> own_arcs;
+  fixed_array<FSTArc*> x_arcs;
+  struct weights_in_x;
+  forward_backward(forward_backward& main, std::mutex& x_mutex);
+  bool can_share() const { return cached_derivs<arc_counts>::can_share() && !use_matrix; }
+  void share() { share_derivations(true, scaled); }
+
   ~forward_backward() { cleanup(); }
 };
 
+forward_backward::forward_backward(forward_backward& main, std::mutex& x_mutex)
+    : cache_t(main), cascade(main.cascade), arcs(main.arcs), mio(arcs) {
+  n_threads = 1;
+  scaled = main.scaled;
+  log_sum = main.log_sum;
+  log_add = main.log_add;
+  online_batch = 0;
+  online_alpha = main.online_alpha;
+  online_steps = batch_n = 0;
+  batch_weight = online_weight = 0;
+  online_methods = NULL;
+  squarem = main.squarem;
+  squarem_restart();
+  squarem_last_step = sum_steps = 0;
+  n_extrapolated = n_rejected = 0;
+  odf = main.odf;
+  prune = main.prune;
+  trn = main.trn;
+  f = b = NULL;
+  remove_bad_training = main.remove_bad_training;
+  cache = main.cache;
+  use_matrix = false;
+  cache_backward = main.cache_backward;
+  n_st = main.n_st;
+  progress = false;
+  this->x_mutex = &x_mutex;
+  unsigned n = arcs.size();
+  own_arcs.reinit(n);
+  x_arcs.reinit(n);
+  for (unsigned i = 0; i < n; ++i) {
+    x_arcs[i] = arcs[i].arc;
+    own_arcs[i] = *arcs[i].arc;
+    arcs[i].arc = &own_arcs[i];
+  }
+}
+
+// for a worker, while in scope: x has its weights (and its arcs point to x's)
+struct forward_backward::weights_in_x {
+  forward_backward& fb;
+  std::unique_lock<std::mutex> lock;
+  explicit weights_in_x(forward_backward& fb) : fb(fb) {
+    if (!fb.x_mutex) return;
+    lock = std::unique_lock<std::mutex>(*fb.x_mutex);
+    for (unsigned i = 0, n = fb.arcs.size(); i < n; ++i) {
+      FSTArc* a = fb.x_arcs[i];
+      a->weight = fb.arcs[i].weight();
+      fb.arcs[i].arc = a;
+    }
+  }
+  ~weights_in_x() {
+    if (!fb.x_mutex) return;
+    for (unsigned i = 0, n = fb.arcs.size(); i < n; ++i) {
+      FSTArc& own = fb.own_arcs[i];
+      own.weight = fb.x_arcs[i]->weight;
+      fb.arcs[i].arc = &own;
+    }
+  }
+};
+
 
 Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, bool weight_is_prior_count,
                    Weight smoothFloor, Weight converge_arc_delta, Weight converge_perplexity_ratio,
@@ -469,6 +704,252 @@ Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, boo
 }
 
 
+// the lowest perplexity of train's restarts so far (its weights kept by save_best), and the restart it was in
+struct em_best {
+  Weight perplexity;
+  unsigned restart_no;
+  bool have_good_weights;
+  unsigned n_estimates;
+};
+
+// train's EM iterations from one (random) start to convergence, for its forward_backward or a --threads
+// restart worker's
+struct em_restart {
+  cascade_parameters& cascade;
+  training_corpus& corpus;
+  WFST::NormalizeMethods const& methods;
+  WFST::train_opts const& opts;
+  Weight converge_arc_delta, converge_perplexity_ratio;
+  double learning_rate_growth_factor;
+  bool online, squarem, using_cascade;
+  WFST::random_restart_acceptor ra;  // only restart 0 changes it
+
+  void run(forward_backward& fb, unsigned restart_no, em_best& best, std::ostream& log);
+
+  // --threads: restarts 1...n, each worker taking the next.  the random starts are drawn first, in order, and
+  // the restarts' logs are shown in order after all are done, so both are as if run one after another
+  struct parallel_restarts {
+    std::vector<fixed_array<Weight> > starts;
+    std::vector<std::string> logs;
+    std::ostream* log;  // (its format)
+    std::vector<std::unique_ptr<forward_backward> > workers;
+    std::vector<em_best> bests;  // each worker's
+    unsigned next;
+    std::exception_ptr error;
+    std::mutex mutex, x_mutex;
+  };
+  void run_parallel(forward_backward& fb, unsigned n, unsigned n_threads, em_best& best, std::ostream& log);
+  void restart_worker(parallel_restarts& p, unsigned t);
+};
+
+void em_restart::run(forward_backward& fb, unsigned restart_no, em_best& best, std::ostream& log) {
+  fb.squarem_restart();
+  unsigned train_iter = 0;
+  Weight lastChange = 10;
+  Weight lastPerplexity;
+  lastPerplexity.setInfinity();
+  FLOAT_TYPE learning_rate = 1;
+  bool last_was_reset = false;
+  Weight squarem_start_perplexity;
+  Weight corpus_p;
+  for (;;) {
+    const bool first_time = train_iter == 0;
+    ++train_iter;
+//            time_report taken(log,"Time for iteration: ");
+#ifdef DEBUGTRAIN
+    Config::debug() << "Starting iteration: " << train_iter << '\n';
+#endif
+#ifdef DEBUG
+#define DWSTAT(a) print_stats(arcs, a)
+    arcs_table<arc_counts> const& arcs = fb.arcs;
+#else
+#define DWSTAT(a)
+#endif
+    //            DWSTAT("Before estimate");
+    bool cascade_counts = using_cascade && !first_time;
+    if (cascade_counts)
+      fb.arcs.visit(for_arcs::save_counts());  // so you can later save_best_counts if you like the ppx
+    cascade.update();
+    if (~opts.max_iter && train_iter > opts.max_iter && best.have_good_weights) {
+      log << "Maximum number of iterations (" << opts.max_iter
+          << ") reached before convergence criteria was met - greatest arc weight change was " << lastChange
+          << "\n";
+      break;
+    }
+    Weight online_change;
+    // lastPerplexity.isInfinity() // only delete no-path training the first time, in case we screw up with
+    // our learning rate
+    ++best.n_estimates;
+    Weight p
+        = online ? fb.estimate_online(corpus_p, methods, first_time, online_change) : fb.estimate(corpus_p);
+    Weight newPerplexity = p.ppxper(corpus.totalEmpiricalWeight);
+    DWSTAT("\nAfter estimate");
+    log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
+    //            log << " per-output-symbol-perplexity="<<corpus_p.ppxper(corpus.n_output).as_base(2)<<"
+    //            per-example-perplexity="<<newPerplexity.as_base(2);
+    corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
+                              corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
+    if (newPerplexity < best.perplexity
+        && (!using_cascade || cascade_counts)) {  // because of how I'm saving only composed counts, we
+      // can't actually get back to our initial starting point
+      // (iter 1)
+      log << " (new best)";
+      best.perplexity = newPerplexity;
+      best.restart_no = restart_no;
+      best.have_good_weights = true;
+      fb.save_best();
+    }
+    Weight pp_ratio_scaled;
+    if (first_time) {
+
+      log << std::endl;
+      if (!ra.accept(newPerplexity, best.perplexity, restart_no, &log)) {
+        log << "Random start was insufficiently promising; trying another." << std::endl;
+        return;
+      }
+      pp_ratio_scaled.setZero();
+    } else {
+      pp_ratio_scaled = newPerplexity.relative_perplexity_ratio(lastPerplexity);
+      log << " (relative-perplexity-ratio=" << pp_ratio_scaled << ")";
+      if (lastChange < 1) log << ", max {d(weight)}=" << lastChange;
+#ifdef DEBUG_ADAPTIVE_EM
+      log << " last-perplexity=" << lastPerplexity << ' ';
+      if (learning_rate > 1) {
+        fb.arcs.visit(for_arcs::swap_em_scaled());
+        Weight d;
+        Weight em_pp = fb.estimate(d);
+        log << "unscaled-EM-perplexity=" << em_pp;
+        fb.arcs.visit(for_arcs::swap_em_scaled());
+        if (em_pp > lastPerplexity)
+          Config::warn() << " - last EM worsened perplexity, from " << lastPerplexity << " to " << em_pp
+                         << ", which is theoretically impossible." << std::endl;
+      }
+#endif
+      log << std::endl;
+    }
+    if (fb.squarem_extrapolated) {
+      // as in SQUAREM, it only needs to beat the weights the EM steps started from
+      if (!(newPerplexity < squarem_start_perplexity)) {
+        log << "Failed to improve (extrapolated too far); back to the last EM step" << std::endl;
+        fb.squarem_reject();
+        last_was_reset = true;
+        continue;
+      }
+      last_was_reset = true;  // don't test for convergence against the last EM step
+    }
+    if (!last_was_reset) {
+      if (pp_ratio_scaled >= converge_perplexity_ratio) {
+        if (learning_rate > 1) {
+          log << "Failed to improve (relaxation rate too high); starting again at learning rate 1"
+              << std::endl;
+          learning_rate = 1;
+          fb.arcs.visit(for_arcs::keep_em_weight());
+          last_was_reset = true;
+          continue;
+        }
+        log << "Converged - per-example perplexity ratio exceeds " << converge_perplexity_ratio << " after "
+            << train_iter << " iterations.\n";
+        if (!best.have_good_weights)
+          log << "Because of the --train-cascade implementation, we need another iteration even though "
+                 "we've converged.\n";
+        else
+          break;
+      } else {
+        if (learning_rate < MAX_LEARNING_RATE_EXP) learning_rate *= learning_rate_growth_factor;
+      }
+    } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
+      last_was_reset = false;
+    //            DWSTAT("Before maximize");
+    lastChange = online ? online_change : fb.maximize(methods, learning_rate);
+    if (squarem) {
+      fb.squarem_step(methods);
+      if (fb.squarem_phase == 1) squarem_start_perplexity = newPerplexity;
+      if (fb.squarem_extrapolated)
+        log << "Extrapolated (SQUAREM) with step length " << fb.squarem_last_step << std::endl;
+    }
+    if (lastChange <= converge_arc_delta && best.have_good_weights) {
+      log << "Converged - maximum weight change less than " << converge_arc_delta << " after " << train_iter
+          << " iterations.\n";
+      break;
+    }
+    lastPerplexity = newPerplexity;
+  }
+}
+
+void em_restart::run_parallel(forward_backward& fb, unsigned n, unsigned n_threads, em_best& best,
+                              std::ostream& log) {
+  log << "\nRunning the " << n << " random restarts in " << n_threads << " threads.\n";
+  parallel_restarts p;
+  p.starts.resize(n);
+  p.logs.resize(n);
+  p.log = &log;
+  unsigned n_arcs = fb.arcs.size();
+  for (unsigned i = 0; i < n; ++i) {
+    cascade.random_restart(methods);
+    p.starts[i].reinit(n_arcs);
+    for (unsigned a = 0; a < n_arcs; ++a) p.starts[i][a] = fb.arcs[a].weight();
+  }
+  fb.share();
+  for (unsigned t = 0; t < n_threads; ++t) {
+    p.workers.push_back(std::unique_ptr<forward_backward>(new forward_backward(fb, p.x_mutex)));
+    p.bests.push_back(best);
+    p.bests.back().n_estimates = 0;
+  }
+  p.next = 0;
+  {
+    thread_group workers;
+    for (unsigned t = 1; t < n_threads; ++t)
+      workers.create_thread(&em_restart::restart_worker, this, std::ref(p), t);
+    restart_worker(p, 0);
+    workers.join_all();
+  }
+  if (p.error) std::rethrow_exception(p.error);
+  for (unsigned i = 0; i < n; ++i) log << "\nRandom restart - " << n - 1 - i << " remaining.\n" << p.logs[i];
+  unsigned const none = (unsigned)-1;
+  unsigned best_t = none;
+  for (unsigned t = 0; t < n_threads; ++t) {
+    em_best const& b = p.bests[t];
+    best.n_estimates += b.n_estimates;
+    bool tie = !(best.perplexity < b.perplexity) && b.restart_no < best.restart_no;  // the earlier restart
+    if (b.perplexity < best.perplexity || tie) {
+      best.perplexity = b.perplexity;
+      best.restart_no = b.restart_no;
+      best_t = t;
+    }
+    forward_backward const& w = *p.workers[t];
+    fb.n_extrapolated += w.n_extrapolated;
+    fb.n_rejected += w.n_rejected;
+    fb.sum_steps += w.sum_steps;
+  }
+  if (best_t != none)
+    for (unsigned a = 0; a < n_arcs; ++a) fb.arcs[a].best_weight = p.workers[best_t]->arcs[a].best_weight;
+}
+
+void em_restart::restart_worker(parallel_restarts& p, unsigned t) {
+  forward_backward& fb = *p.workers[t];
+  for (;;) {
+    unsigned i;
+    {
+      std::lock_guard<std::mutex> lock(p.mutex);
+      if (p.next >= p.starts.size() || p.error) return;
+      i = p.next++;
+    }
+    try {
+      fixed_array<Weight> const& start = p.starts[i];
+      for (unsigned a = 0, n = fb.arcs.size(); a < n; ++a) fb.arcs[a].weight() = start[a];
+      std::ostringstream log;
+      log.copyfmt(*p.log);
+      log.tie(0);  // (copyfmt copies cerr's tie to cout, which another thread may be flushing)
+      run(fb, i + 1, p.bests[t], log);
+      p.logs[i] = log.str();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(p.mutex);
+      if (!p.error) p.error = std::current_exception();
+    }
+  }
+}
+
+
 /* I want NONE normalization to lock the given transducer.  but that's not happening excpet in the simple
    single-iteration code.
 
@@ -505,6 +986,7 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
                    Weight converge_perplexity_ratio, train_opts const& opts, bool restore_old_weights) {
   std::ostream& log = Config::log();
   graehl::time_space_report ts(log, "Training took ");
+  thaw();  // arcs_table holds FSTArc pointers for the duration
   cascade.set_composed(this);
   cascade.normalize(methods);
   unsigned ran_restarts = opts.ran_restarts;
@@ -516,8 +998,36 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   if (opts.max_iter + 1 == 0) // -1 indicates "-M"
     return fb.estimate(corpus_p).ppxper(corpus.totalEmpiricalWeight);
 
+  bool online = fb.online();
+  if (opts.online_batch && (!online || !cascade.trivial)) {
+    Config::warn() << "--online-em isn't supported for --matrix-fb or --train-cascade; using batch EM."
+                   << std::endl;
+    online = false;
+  }
+  if (online) {
+    log << "Stepwise EM: reestimating after every " << opts.online_batch
+        << " examples, with step size (k+1)^-" << opts.online_alpha << " for the k-th.\n";
+    if (learning_rate_growth_factor != 1) {
+      Config::warn() << "Overrelaxed EM not supported for --online-em.  Disabling (growth factor=1)."
+                     << std::endl;
+      learning_rate_growth_factor = 1;
+    }
+  }
+
+  bool squarem = opts.squarem;
+  if (squarem && (online || !cascade.trivial)) {
+    Config::warn() << "--squarem isn't supported for --online-em or --train-cascade; not extrapolating."
+                   << std::endl;
+    squarem = false;
+  }
+  if (squarem && learning_rate_growth_factor != 1) {
+    Config::warn() << "Overrelaxed EM not supported with --squarem.  Disabling (growth factor=1)."
+                   << std::endl;
+    learning_rate_growth_factor = 1;
+  }
+
   // when you just want frac counts or a single iteration:
-  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0)) {
+  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0 && !online)) {
     if (opts.max_iter == 0)
       log << "0 iterations specified for training; output weights will be unnormalized fractional counts "
              "(except locked arcs).\n";
@@ -538,8 +1048,6 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   }
 
   // multiple iterations and keep the best of possibly many random restarts
-  Weight bestPerplexity;
-  bestPerplexity.setInfinity();
   bool using_cascade = !cascade.trivial;
   if (using_cascade) {
     if (learning_rate_growth_factor != 1) {
@@ -548,124 +1056,25 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       learning_rate_growth_factor = 1;
     }
   }
-  bool have_good_weights = false;
-  for (unsigned restart_no = 0;; ++restart_no) {
-    unsigned train_iter = 0;
-    Weight lastChange = 10;
-    Weight lastPerplexity;
-    lastPerplexity.setInfinity();
-    FLOAT_TYPE learning_rate = 1;
-    bool last_was_reset = false;
-    for (;;) {
-      const bool first_time = train_iter == 0;
-      ++train_iter;
-//            time_report taken(log,"Time for iteration: ");
-#ifdef DEBUGTRAIN
-      Config::debug() << "Starting iteration: " << train_iter << '\n';
-#endif
-#ifdef DEBUG
-#define DWSTAT(a) print_stats(arcs, a)
-      arcs_table<arc_counts> const& arcs = fb.arcs;
-#else
-#define DWSTAT(a)
-#endif
-      //            DWSTAT("Before estimate");
-      bool cascade_counts = using_cascade && !first_time;
-      if (cascade_counts)
-        fb.arcs.visit(for_arcs::save_counts());  // so you can later save_best_counts if you like the ppx
-      cascade.update();
-      if (~opts.max_iter && train_iter > opts.max_iter && have_good_weights) {
-        log << "Maximum number of iterations (" << opts.max_iter
-            << ") reached before convergence criteria was met - greatest arc weight change was " << lastChange
-            << "\n";
-        break;
-      }
-      Weight p = fb.estimate(corpus_p);  // lastPerplexity.isInfinity() // only delete no-path training the
-      // first time, in case we screw up with our learning rate
-      Weight newPerplexity = p.ppxper(corpus.totalEmpiricalWeight);
-      DWSTAT("\nAfter estimate");
-      log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
-      //            log << " per-output-symbol-perplexity="<<corpus_p.ppxper(corpus.n_output).as_base(2)<<"
-      //            per-example-perplexity="<<newPerplexity.as_base(2);
-      corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
-                                corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
-      if (newPerplexity < bestPerplexity
-          && (!using_cascade || cascade_counts)) {  // because of how I'm saving only composed counts, we
-        // can't actually get back to our initial starting point
-        // (iter 1)
-        log << " (new best)";
-        bestPerplexity = newPerplexity;
-        have_good_weights = true;
-        fb.save_best();
-      }
-      Weight pp_ratio_scaled;
-      if (first_time) {
-
-        log << std::endl;
-        if (!ra.accept(newPerplexity, bestPerplexity, restart_no, &log)) {
-          log << "Random start was insufficiently promising; trying another." << std::endl;
-          break;  // to next random restart
-        }
-        pp_ratio_scaled.setZero();
-      } else {
-        pp_ratio_scaled = newPerplexity.relative_perplexity_ratio(lastPerplexity);
-        log << " (relative-perplexity-ratio=" << pp_ratio_scaled << ")";
-        if (lastChange < 1) log << ", max {d(weight)}=" << lastChange;
-#ifdef DEBUG_ADAPTIVE_EM
-        log << " last-perplexity=" << lastPerplexity << ' ';
-        if (learning_rate > 1) {
-          fb.arcs.visit(for_arcs::swap_em_scaled());
-          Weight d;
-          Weight em_pp = fb.estimate(d);
-          log << "unscaled-EM-perplexity=" << em_pp;
-          fb.arcs.visit(for_arcs::swap_em_scaled());
-          if (em_pp > lastPerplexity)
-            Config::warn() << " - last EM worsened perplexity, from " << lastPerplexity << " to " << em_pp
-                           << ", which is theoretically impossible." << std::endl;
-        }
-#endif
-        log << std::endl;
-      }
-      if (!last_was_reset) {
-        if (pp_ratio_scaled >= converge_perplexity_ratio) {
-          if (learning_rate > 1) {
-            log << "Failed to improve (relaxation rate too high); starting again at learning rate 1"
-                << std::endl;
-            learning_rate = 1;
-            fb.arcs.visit(for_arcs::keep_em_weight());
-            last_was_reset = true;
-            continue;
-          }
-          log << "Converged - per-example perplexity ratio exceeds " << converge_perplexity_ratio << " after "
-              << train_iter << " iterations.\n";
-          if (!have_good_weights)
-            log << "Because of the --train-cascade implementation, we need another iteration even though "
-                   "we've converged.\n";
-          else
-            break;
-        } else {
-          if (learning_rate < MAX_LEARNING_RATE_EXP) learning_rate *= learning_rate_growth_factor;
-        }
-      } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
-        last_was_reset = false;
-      //            DWSTAT("Before maximize");
-      lastChange = fb.maximize(methods, learning_rate);
-      if (lastChange <= converge_arc_delta && have_good_weights) {
-        log << "Converged - maximum weight change less than " << converge_arc_delta << " after " << train_iter
-            << " iterations.\n";
-        break;
-      }
-      lastPerplexity = newPerplexity;
-    }
-    if (ran_restarts > 0) {
-      --ran_restarts;
+  em_restart em = {cascade, corpus, methods, opts, converge_arc_delta, converge_perplexity_ratio,
+                   learning_rate_growth_factor, online, squarem, using_cascade, ra};
+  em_best best;
+  best.perplexity.setInfinity();
+  best.restart_no = 0;
+  best.have_good_weights = false;
+  best.n_estimates = 0;
+  em.run(fb, 0, best, log);
+  if (ran_restarts > 1 && opts.threads > 1 && !online && !using_cascade && fb.can_share())
+    em.run_parallel(fb, ran_restarts, opts.threads < ran_restarts ? opts.threads : ran_restarts, best, log);
+  else
+    for (unsigned restart_no = 1; restart_no <= ran_restarts; ++restart_no) {
       cascade.random_restart(methods);
-      log << "\nRandom restart - " << ran_restarts << " remaining.\n";
-    } else {
-      break;
+      log << "\nRandom restart - " << ran_restarts - restart_no << " remaining.\n";
+      em.run(fb, restart_no, best, log);
     }
-  }
+  Weight bestPerplexity = best.perplexity;
 
+  if (squarem) fb.squarem_report(log, best.n_estimates);
   log << "Setting weights to model with lowest per-example-perplexity ( = "
          "prod[modelprob(example)]^(-1/num_examples) = 2^(-log_2(p_model(corpus))/N) = "
       << bestPerplexity.as_base(2) << std::endl;
@@ -773,6 +1182,229 @@ Weight forward_backward::estimate(Weight& unweighted_corpus_prob) {
 }
 
 
+// the blocks don't depend on n_threads, and are added in order, so neither the number of threads nor their
+// timing changes the result.  (it may differ in the last bits from one thread's, which adds every example's
+// counts straight into the arcs')
+void forward_backward::estimate_parallel() {
+  unsigned N = derivs.store.size(), K = (unsigned)e_step_blocks < N ? (unsigned)e_step_blocks : N;
+  unsigned T = n_threads < K ? n_threads : K;
+  unsigned n = arcs.size();
+  e_step e;
+  e.blocks.reinit(K);
+  for (unsigned k = 0; k < K; ++k) {
+    e.blocks[k].begin = (unsigned)((unsigned long long)N * k / K);
+    e.blocks[k].end = (unsigned)((unsigned long long)N * (k + 1) / K);
+    e.blocks[k].done = false;
+  }
+  e.next = e.n_added = 0;
+  if (scaled)
+    e.real_counts.reinit(n);
+  else
+    e.counts.reinit(n);
+  {
+    thread_group workers;
+    for (unsigned t = 1; t < T; ++t) workers.create_thread(&forward_backward::e_step_worker, this, std::ref(e));
+    e_step_worker(e);
+    workers.join_all();
+  }
+  if (e.error) std::rethrow_exception(e.error);
+  if (scaled)
+    add_real_counts(e.real_counts.begin());
+  else
+    for (unsigned i = 0; i < n; ++i) arcs[i].counts += e.counts[i];
+  first = false;
+}
+
+void forward_backward::e_step_worker(e_step& e) {
+  unsigned n = arcs.size();
+  for (;;) {
+    e_step_block* b;
+    {
+      std::lock_guard<std::mutex> lock(e.mutex);
+      if (e.next >= e.blocks.size() || e.error) return;
+      b = &e.blocks[e.next++];
+      if (scaled && !e.spare_real.empty()) {
+        b->real_counts.swap(e.spare_real.back());
+        e.spare_real.pop_back();
+      } else if (!scaled && !e.spare.empty()) {
+        b->counts.swap(e.spare.back());
+        e.spare.pop_back();
+      }
+    }
+    try {
+      if (scaled) {
+        if (b->real_counts.size() == n)
+          std::fill(b->real_counts.begin(), b->real_counts.end(), 0.);
+        else
+          b->real_counts.reinit(n);
+      } else {
+        if (b->counts.size() == n)
+          std::fill(b->counts.begin(), b->counts.end(), Weight());
+        else
+          b->counts.reinit(n);
+      }
+      sum_block(*b);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(e.mutex);
+      if (!e.error) e.error = std::current_exception();
+      return;
+    }
+    std::lock_guard<std::mutex> lock(e.mutex);
+    b->done = true;
+    for (; e.n_added < e.blocks.size() && e.blocks[e.n_added].done; ++e.n_added) {
+      e_step_block& a = e.blocks[e.n_added];
+      *unweighted_corpus_prob *= a.unweighted_prob;
+      weighted_corpus_prob *= a.weighted_prob;
+      if (scaled) {
+        for (unsigned i = 0; i < n; ++i) e.real_counts[i] += a.real_counts[i];
+        e.spare_real.push_back(fixed_array<double>());
+        e.spare_real.back().swap(a.real_counts);
+      } else {
+        log_add_scaled(e.counts.begin(), a.counts.begin(), n, Weight(one_weight()),
+                       log_sum ? log_add : log_add_exact);
+        e.spare.push_back(fixed_array<Weight>());
+        e.spare.back().swap(a.counts);
+      }
+      if (progress)
+        for (unsigned i = a.begin; i < a.end; ++i) training_progress_scale(i + 1, derivs.store.size());
+    }
+  }
+}
+
+void forward_backward::sum_block(e_step_block& b) {
+  b.unweighted_prob.setOne();
+  b.weighted_prob.setOne();
+  Weight* counts = b.counts.begin();
+  double* reals = b.real_counts.begin();
+  for (unsigned i = b.begin; i < b.end; ++i) {
+    derivations& d = derivs.store[i];
+    Weight prob = scaled ? collect_counts(d, reals) : d.collect_counts(arcs, counts, log_sum, log_add);
+    b.unweighted_prob *= prob;
+    b.weighted_prob *= prob.pow(d.weight);
+  }
+}
+
+
+// the arcs that were positive and free at the last 3 EM steps
+static inline bool squarem_extrapolates(arc_counts const& a, Weight from) {
+  return !WFST::isLocked(a.groupId()) && from.isPositive() && a.scratch.isPositive()
+         && a.weight().isPositive();
+}
+
+// weights w0 (squarem_from), w1 (scratch), w2 (weight) are 2 EM steps apart.  in logs, r = w1-w0,
+// v = w2-w1-r, and the S3 step length alpha = -|r|/|v|, limited to [-max_step,-1].  the new weight is
+// w0 - 2*alpha*r + alpha^2*v (alpha = -1 gives w2)
+void forward_backward::squarem_step(WFST::NormalizeMethods const& methods) {
+  squarem_extrapolated = false;
+  unsigned n = arcs.size();
+  if (squarem_phase == 0) {
+    squarem_from.reinit(n);
+    for (unsigned i = 0; i < n; ++i) squarem_from[i] = arcs[i].scratch;
+    squarem_phase = 1;
+    return;
+  }
+  squarem_phase = 0;
+  double rr = 0, vv = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    arc_counts const& a = arcs[i];
+    if (!squarem_extrapolates(a, squarem_from[i])) continue;
+    double r = a.scratch.getLn() - squarem_from[i].getLn(), v = a.weight().getLn() - a.scratch.getLn() - r;
+    rr += r * r;
+    vv += v * v;
+  }
+  if (!(vv > 0)) return;
+  double alpha = -std::sqrt(rr / vv);
+  if (alpha <= -squarem_max_step) {
+    alpha = -squarem_max_step;
+    squarem_max_step *= 4;
+  }
+  if (alpha >= -1) return;  // EM's step (already taken)
+  weights_in_x in_x(*this);
+  for (unsigned i = 0; i < n; ++i) {
+    arc_counts& a = arcs[i];
+    if (!squarem_extrapolates(a, squarem_from[i])) continue;
+    double w0 = squarem_from[i].getLn(), w1 = a.scratch.getLn(), r = w1 - w0, v = a.weight().getLn() - w1 - r;
+    a.weight().setLn(w0 - 2 * alpha * r + alpha * alpha * v);
+  }
+  x.normalize(methods[0]);
+  squarem_extrapolated = true;
+  squarem_last_step = -alpha;
+  sum_steps += squarem_last_step;
+  ++n_extrapolated;
+}
+
+
+Weight forward_backward::estimate_online(Weight& unweighted_corpus_prob_accum,
+                                         WFST::NormalizeMethods const& methods, bool restart,
+                                         Weight& last_change) {
+  assert(online());
+  if (restart) {
+    online_weight = 0;
+    List<IOSymSeq> const& ex = corpus().examples;
+    for (List<IOSymSeq>::const_iterator i = ex.const_begin(), e = ex.const_end(); i != e; ++i)
+      online_weight += i->weight;
+    arcs.visit(for_arcs::weight_as_counts(online_weight));
+    online_steps = 0;
+  }
+  unsigned n = arcs.size();
+  if (scaled) {
+    prepare_scaled();
+    real_counts.reinit(n);
+  } else
+    batch_counts.reinit(n);
+  unweighted_corpus_prob = &unweighted_corpus_prob_accum;
+  unweighted_corpus_prob_accum = 1;
+  weighted_corpus_prob.setOne();
+  online_methods = &methods;
+  online_change.setZero();
+  batch_n = 0;
+  batch_weight = 0;
+  online_example e(*this);
+  cache_t::foreach_deriv(e);
+  online_step();  // the last (partial) batch
+  throw_if_no_derivation();
+  log_read_stats(Config::log());
+  Config::log() << '\n';
+  last_change = online_change;
+  return weighted_corpus_prob;
+}
+
+void forward_backward::add_online_example(unsigned n, derivations& d) {
+  training_progress_scale(n, corpus().size());
+  Weight prob
+      = scaled ? collect_counts(d, real_counts.begin())
+               : d.collect_counts(arcs, batch_counts.begin(), log_sum, log_add);
+  *unweighted_corpus_prob *= prob;
+  weighted_corpus_prob *= prob.pow(d.weight);
+  batch_weight += d.weight;
+  if (++batch_n == online_batch) online_step();
+}
+
+// counts = (1-eta)*counts + eta*(corpus weight/batch weight)*batch counts, then reestimate weights
+void forward_backward::online_step() {
+  if (!batch_n) return;
+  double eta = std::pow(online_steps++ + 2., -online_alpha);
+  Weight keep(1 - eta), step(eta * online_weight / batch_weight);
+  for (unsigned i = 0, n = arcs.size(); i < n; ++i) {
+    arc_counts& a = arcs[i];
+    Weight c;
+    if (scaled) {
+      c = Weight(real_counts[i]);
+      real_counts[i] = 0;
+    } else {
+      c = batch_counts[i];
+      batch_counts[i].setZero();
+    }
+    a.counts = a.counts * keep + c * step;
+  }
+  batch_n = 0;
+  batch_weight = 0;
+  Weight change = maximize(*online_methods, 1);
+  if (change > online_change) online_change = change;
+  if (scaled) prepare_scaled();
+}
+
+
 Weight forward_backward::estimate_matrix(Weight& unweighted_corpus_prob) {
   assert(use_matrix && b);
   unsigned i, o, s, nIn, nOut;
@@ -898,6 +1530,7 @@ Weight forward_backward::maximize(WFST::NormalizeMethods const& methods, FLOAT_T
 #define DUMPDW(h)
 #endif
   DUMPDW("Weights before prior smoothing");
+  weights_in_x in_x(*this);
   cascade.save_none(methods);
   //    arcs.pre_norm_counts(corpus.totalEmpiricalWeight);
   arcs.visit(for_arcs::prep_new_weights(1.0));
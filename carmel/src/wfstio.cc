@@ -11,6 +11,9 @@
 #include <graehl/shared/input_error.hpp>
 #include <graehl/shared/assoc_container.hpp>
 #include <graehl/shared/graphviz.hpp>
+#include <graehl/shared/memmap.hpp>
+#include <graehl/shared/atoi_fast.hpp>
+#include <boost/cstdint.hpp>
 
 namespace graehl {
 
@@ -89,7 +92,9 @@ static inline unsigned pow2(unsigned exp) {
 
 
 #define DOS_CR_CHAR '\r'
-static char* getString(std::istream& in, char* buf, unsigned STRBUFSIZE = DEFAULTSTRBUFSIZE) {
+// In is an istream or a legible_buf
+template <class In>
+static char* getString(In& in, char* buf, unsigned STRBUFSIZE = DEFAULTSTRBUFSIZE) {
 #define CHECKBUFOVERFLOW                 \
   do {                                   \
     if (buf >= bufend) goto bufoverflow; \
@@ -315,6 +320,13 @@ unsigned WFST::getStateIndex(const char* buf) {
   char* scanend;
   unsigned st;
   if (!named_states) {
+    char const* digits = buf;
+    while (digit_char(*digits)) ++digits;
+    if (*digits == '\0' && digits != buf && digits - buf < 10) {  // no sign, no overflow: what strtol would give
+      st = atou_fast<unsigned>(buf);
+      resize_up_for_index(states, st);
+      return st;
+    }
     st = strtol(buf, &scanend, 10);  // base 10, potential buffer overflow?? not really, read only
     if (*buf && *scanend != '\0') {
       Config::warn() << "Since intial state was a number, expected an integer state index, but got: " << buf
@@ -335,10 +347,184 @@ unsigned WFST::getStateIndex(const char* buf) {
   }
 }
 
+static inline bool is_space(char c) {  // as isspace in the C locale
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// readLegible's input: the stream is read in big blocks, and tokens are scanned in the buffer directly rather
+// than a char at a time through the istream.  until the end of input, at least lookahead chars are kept
+// ahead of the read position when a number is scanned, and putback chars behind it for unget.  it's also a
+// streambuf, so the weights only Weight::read handles (10^N, Nln, ...) and show_error_context still get an
+// istream over the same input
+class legible_buf : public std::streambuf {
+ public:
+  explicit legible_buf(std::istream& src)
+      : src(src), buf(putback + block + lookahead), base(0), at_eof(false), read_eof(false) {
+    p = end = buf.begin();
+    refill();
+  }
+
+  bool get(char& c) {
+    if (p == end && !refill()) return false;
+    c = *p++;
+    return true;
+  }
+  void unget() {
+    --p;
+    read_eof = false;  // as istream::unget
+  }
+
+  // as istream >> c: skips whitespace
+  bool operator>>(char& c) {
+    for (;;) {
+      while (p != end && is_space(*p)) ++p;
+      if (p != end) {
+        c = *p++;
+        return true;
+      }
+      if (!refill()) return false;
+    }
+  }
+
+  // as istream >> w, i.e. Weight::read
+  bool operator>>(Weight& w) {
+    ensure(lookahead);
+    if (fast_weight(w)) return true;
+    sync_get();
+    std::istream in(this);
+    try {
+      in >> w;
+    } catch (...) {  // (some malformed weights throw) keep what it read, for show_error_context
+      sync_from_get();
+      throw;
+    }
+    sync_from_get();
+    return !in.fail();
+  }
+
+  // as istream >> u, but only where the next char is a digit (a tie group)
+  bool operator>>(unsigned& u) {
+    ensure(lookahead);
+    u = atou_fast_advance_nooverflow<unsigned>(p, end);  // throws on overflow
+    return true;
+  }
+
+  // as skip_comment(istream &): skips whitespace and lines starting with comment_char
+  void skip_comment(char comment_char) {
+    char c;
+    while (*this >> c) {
+      if (c != comment_char) {
+        unget();
+        return;
+      }
+      for (;;) {
+        char* nl = (char*)std::memchr(p, '\n', end - p);
+        if (nl) {
+          p = nl + 1;
+          break;
+        }
+        p = end;
+        if (!refill()) return;
+      }
+    }
+  }
+
+  void show_error_context(std::ostream& out) {
+    sync_get();
+    std::istream in(this);
+    if (read_eof) in.setstate(std::ios_base::eofbit);  // so it says (at EOF) where the istream's read would
+    graehl::show_error_context(in, out);
+  }
+
+ protected:
+  int_type underflow() {
+    sync_from_get();
+    refill();
+    sync_get();
+    return p == end ? traits_type::eof() : traits_type::to_int_type(*p);
+  }
+  // within the buffer only: enough for tellg and show_error_context's seekg back a few chars
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) {
+    char* to = (dir == std::ios_base::cur ? gptr() : dir == std::ios_base::beg ? buf.begin() - base : egptr()) + off;
+    if (to < eback() || to > egptr()) return pos_type(off_type(-1));
+    setg(eback(), to, egptr());
+    return pos_type(base + (to - buf.begin()));
+  }
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+
+ private:
+  enum { block = 1 << 20, lookahead = 2 * DEFAULTSTRBUFSIZE, putback = 64 };
+  std::istream& src;
+  fixed_array<char> buf;
+  std::streamoff base;  // input position of buf[0]
+  bool at_eof;
+  bool read_eof;  // a read wanted more than the input had, as an istream's eofbit
+  char* p;  // next unread char; [p, end) is buffered
+  char* end;
+
+  void sync_get() { setg(buf.begin(), p, end); }
+  void sync_from_get() {
+    p = gptr();
+    end = egptr();
+  }
+
+  void ensure(std::ptrdiff_t n) {
+    if (end - p < n) refill();
+  }
+  // slides the last putback chars and [p, end) to the front and reads as much as fits.  false at end of input
+  bool refill() {
+    if (!at_eof) {
+      char* keep = p - std::min<std::ptrdiff_t>(p - buf.begin(), putback);
+      std::ptrdiff_t shift = keep - buf.begin();
+      std::memmove(buf.begin(), keep, end - keep);
+      base += shift;
+      p -= shift;
+      end -= shift;
+      src.read(end, buf.end() - end);
+      end += src.gcount();
+      if (!src) at_eof = true;
+    }
+    if (p != end) return true;
+    read_eof = true;
+    return false;
+  }
+
+  static bool number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+  }
+  // the usual weights: a real (but not 10, which might begin 10^N) or e^N, ending at a space, ')' or '!'.
+  // Weight::read would read the same number with num_get, whose syntax agrees with strtod's on number_char
+  bool fast_weight(Weight& w) {
+    char* q = p;
+    while (q != end && is_space(*q)) ++q;
+    bool ln = end - q > 2 && q[0] == 'e' && q[1] == '^';
+    if (ln) q += 2;
+    char* number = q;
+    while (q != end && number_char(*q)) ++q;
+    if (q == number || q == end || !(is_space(*q) || *q == ')' || *q == '!')) return false;
+    char* e;
+    double d = strtod_fast(number, &e);  // stops at *q
+    if (e != q || d == HUGE_VAL || d == -HUGE_VAL || (!ln && d == 10)) return false;
+    if (ln)
+      w.setLn(d);
+    else
+      w.setReal(d);
+    p = q;
+    return true;
+  }
+};
+
+static inline void skip_comment(legible_buf& in, char comment_char) {
+  in.skip_comment(comment_char);
+}
+
 static const char COMMENT_CHAR = '%';
 
 // FIXME: need to destroy old data or switch this to a constructor
-bool WFST::readLegible(istream& istr, bool alwaysNamed) {
+bool WFST::readLegible(istream& input, bool alwaysNamed) {
+  legible_buf istr(input);
   alphabet_type& in = alphabet(kInput), & out = alphabet(kOutput);
   State::arc_adder arc_add(states);
   StringKey finalName;
@@ -499,7 +685,7 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     goto INVALID;
   }
 INVALID:
-  show_error_context(istr, cerr);
+  istr.show_error_context(cerr);
   if (named_states) finalName.kill();
   invalidate();
   return 0;
@@ -530,6 +716,7 @@ static ostream& writeQuoted(ostream& os, const char* s) {
 */
 void WFST::writeGraphViz(ostream& os) {
   if (!valid()) return;
+  thaw();
   const char* newl = ";\n\t";
   const char* const invis_start = "invis_start [shape=plaintext,label=\"\"]";
   const char* const invis_start_name = "invis_start";
@@ -557,7 +744,7 @@ void WFST::writeGraphViz(ostream& os) {
   writeQuoted(os, stateName(0));
 
   for (unsigned s = 0; s < numStates(); s++) {
-    for (List<FSTArc>::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end();
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end();
          a != end; ++a) {
       os << newl;
       writeQuoted(os, stateName(s));
@@ -598,10 +785,11 @@ void WFST::writeLegible(ostream& os, bool include_zero) {
   const char* inLet, *outLet, *destState;
 
   if (!valid()) return;
+  thaw();
   os << stateName(final);
   for (i = 0; i < numStates(); i++) {
     if (!onearc) os << "\n(" << stateName(i);
-    for (List<FSTArc>::const_iterator a = states[i].arcs.const_begin(), end = states[i].arcs.const_end();
+    for (State::Arcs::const_iterator a = states[i].arcs.const_begin(), end = states[i].arcs.const_end();
          a != end; ++a) {
 
       if (include_zero || a->weight.isPositive()) {
@@ -624,6 +812,221 @@ void WFST::writeLegible(ostream& os, bool include_zero) {
   os << "\n";
 }
 
+// leading NUL: no text transducer starts with one
+static char const binary_magic[8] = {'\0', 'c', 'a', 'r', 'm', 'e', 'l', '1'};
+static boost::uint32_t const binary_byte_order = 0x01020304;
+
+// offsets are bytes from the start of the image, and multiples of 8
+struct binary_header {
+  char magic[8];
+  boost::uint32_t byte_order, arc_bytes;  // sizeof(FSTArc) of the writer
+  boost::uint32_t n_states, final, named_states, reserved;
+  boost::uint64_t n_arcs;
+  boost::uint64_t arc_begin;  // uint64[n_states+1]: state s has arcs [arc_begin[s], arc_begin[s+1])
+  boost::uint64_t arcs;  // FSTArc[n_arcs]
+  boost::uint64_t symbols[2];  // string tables of the input and output alphabets
+  boost::uint64_t state_names;  // string table, if named_states
+  boost::uint64_t size;
+};
+
+// a string table is uint64 n, uint64 begin[n+1], then the '\0'-terminated strings: string i is at
+// chars+begin[i] where chars follows begin
+static inline boost::uint64_t binary_align(boost::uint64_t at) {
+  return (at + 7) & ~(boost::uint64_t)7;
+}
+
+static boost::uint64_t binary_strings_size(WFST::alphabet_type const& a) {
+  boost::uint64_t n = a.size(), chars = 0;
+  for (unsigned i = 0; i < n; ++i) chars += std::strlen(a[i].c_str()) + 1;
+  return binary_align(8 * (n + 2) + chars);
+}
+
+struct binary_writer {
+  ostream& o;
+  boost::uint64_t pos;
+  explicit binary_writer(ostream& o) : o(o), pos(0) {}
+  void write(void const* p, std::size_t n) {
+    o.write((char const*)p, n);
+    pos += n;
+  }
+  template <class T>
+  void put(T const& t) {
+    write(&t, sizeof(t));
+  }
+  // field by field, so the padding written is zeros rather than whatever the arc's memory held
+  void arc(FSTArc const& a) {
+    FSTArc z;
+    std::memset((void*)&z, 0, sizeof(z));
+    z.in = a.in;
+    z.out = a.out;
+    z.dest = a.dest;
+    z.weight = a.weight;
+    z.groupId = a.groupId;
+    put(z);
+  }
+  void align() {
+    static char const zeros[8] = {0};
+    write(zeros, binary_align(pos) - pos);
+  }
+  void strings(WFST::alphabet_type const& a) {
+    boost::uint64_t n = a.size(), begin = 0;
+    put(n);
+    for (unsigned i = 0; i < n; ++i) {
+      put(begin);
+      begin += std::strlen(a[i].c_str()) + 1;
+    }
+    put(begin);
+    for (unsigned i = 0; i < n; ++i) write(a[i].c_str(), std::strlen(a[i].c_str()) + 1);
+    align();
+  }
+};
+
+// NULL if the string table at is well formed
+static char const* check_binary_strings(char const* image, boost::uint64_t size, boost::uint64_t at) {
+  if (at % 8 || at > size || size - at < 16) return "string table offset out of range";
+  boost::uint64_t n = *(boost::uint64_t const*)(image + at);
+  if (n > (size - at) / 8 - 2) return "string table too long";
+  boost::uint64_t const* begin = (boost::uint64_t const*)(image + at + 8);
+  char const* chars = (char const*)(begin + n + 1);
+  if (begin[n] > size - (boost::uint64_t)(chars - image)) return "string table too long";
+  for (boost::uint64_t i = 0; i < n; ++i)
+    if (begin[i] >= begin[i + 1] || begin[i + 1] > begin[n] || chars[begin[i + 1] - 1])
+      return "bad string in string table";
+  return 0;
+}
+
+static char const* check_binary(char const* image, boost::uint64_t size) {
+  binary_header const& h = *(binary_header const*)image;
+  if (size < sizeof(h) || std::memcmp(h.magic, binary_magic, sizeof(binary_magic)))
+    return "not a binary transducer";
+  if (h.byte_order != binary_byte_order || h.arc_bytes != sizeof(FSTArc))
+    return "written by an incompatible build of carmel";
+  if (h.size != size) return "truncated";
+  if (!h.n_states || h.final >= h.n_states) return "bad state count";
+  if (h.arc_begin % 8 || h.arc_begin > size || (size - h.arc_begin) / 8 < (boost::uint64_t)h.n_states + 1)
+    return "arc offsets out of range";
+  if (h.arcs % 8 || h.arcs > size || (size - h.arcs) / sizeof(FSTArc) < h.n_arcs) return "arcs out of range";
+  boost::uint64_t const* arc_begin = (boost::uint64_t const*)(image + h.arc_begin);
+  if (arc_begin[0] || arc_begin[h.n_states] != h.n_arcs) return "bad arc offsets";
+  for (unsigned s = 0; s < h.n_states; ++s)
+    if (arc_begin[s + 1] < arc_begin[s] || arc_begin[s + 1] - arc_begin[s] > (unsigned)-1)
+      return "bad arc offsets";
+  char const* err;
+  boost::uint64_t n_symbols[2];
+  for (unsigned dir = 0; dir < 2; ++dir) {
+    if ((err = check_binary_strings(image, size, h.symbols[dir]))) return err;
+    n_symbols[dir] = *(boost::uint64_t const*)(image + h.symbols[dir]);
+  }
+  if (h.named_states) {
+    if ((err = check_binary_strings(image, size, h.state_names))) return err;
+    if (*(boost::uint64_t const*)(image + h.state_names) != h.n_states) return "wrong number of state names";
+  }
+  // each state's arcs are used as frozen: sorted by (in, out)
+  FSTArc const* arcs = (FSTArc const*)(image + h.arcs);
+  for (unsigned s = 0; s < h.n_states; ++s)
+    for (boost::uint64_t i = arc_begin[s], e = arc_begin[s + 1]; i < e; ++i) {
+      FSTArc const& a = arcs[i];
+      if (a.dest >= h.n_states || a.in >= n_symbols[0] || a.out >= n_symbols[1]) return "bad arc";
+      if (i > arc_begin[s] && State::by_in_out()(a, arcs[i - 1])) return "bad arc";
+    }
+  return 0;
+}
+
+static void read_binary_strings(char const* image, boost::uint64_t at, WFST::alphabet_type& a) {
+  boost::uint64_t n = *(boost::uint64_t const*)(image + at);
+  boost::uint64_t const* begin = (boost::uint64_t const*)(image + at + 8);
+  char const* chars = (char const*)(begin + n + 1);
+  a.reserve((unsigned)n);
+  for (unsigned i = 0; i < n; ++i) a.add(StringKey(chars + begin[i]), i);
+}
+
+bool WFST::is_binary(istream& in) {
+  return in.peek() == binary_magic[0];
+}
+
+void WFST::writeBinary(ostream& os) {
+  if (!valid()) return;
+  freeze();
+  unsigned n = numStates();
+  binary_header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, binary_magic, sizeof(binary_magic));
+  h.byte_order = binary_byte_order;
+  h.arc_bytes = sizeof(FSTArc);
+  h.n_states = n;
+  h.final = final;
+  h.named_states = named_states;
+  h.n_arcs = numArcs();
+  boost::uint64_t at = binary_align(sizeof(h));
+  h.arc_begin = at;
+  at += 8 * ((boost::uint64_t)n + 1);
+  h.arcs = at;
+  at = binary_align(at + h.n_arcs * sizeof(FSTArc));
+  for (unsigned dir = 0; dir < 2; ++dir) {
+    h.symbols[dir] = at;
+    at += binary_strings_size(alphabet((LabelType)dir));
+  }
+  if (named_states) {
+    h.state_names = at;
+    at += binary_strings_size(stateNames);
+  }
+  h.size = at;
+
+  binary_writer w(os);
+  w.put(h);
+  w.align();
+  boost::uint64_t begin = 0;
+  for (unsigned s = 0; s < n; ++s) {
+    w.put(begin);
+    begin += states[s].size;
+  }
+  w.put(begin);
+  for (unsigned s = 0; s < n; ++s)
+    for (unsigned i = 0; i < states[s].size; ++i) w.arc(states[s].packed[i]);
+  w.align();
+  for (unsigned dir = 0; dir < 2; ++dir) w.strings(alphabet((LabelType)dir));
+  if (named_states) w.strings(stateNames);
+  Assert(w.pos == h.size);
+}
+
+bool WFST::readBinary(std::string const& filename, std::size_t offset) {
+  clear();
+  boost::shared_ptr<mapped_file> file(NEW mapped_file);
+  try {
+    file->open(filename, std::ios::in, mapped_file::max_length, 0, false, NULL, false, true);
+  } catch (std::exception& e) {
+    Config::warn() << "Couldn't map binary transducer " << filename << ": " << e.what() << "\n";
+    return false;
+  }
+  char* image = file->data() + offset;
+  char const* err = offset % 8 || offset > file->size() ? "bad image offset" : 0;
+  if (err || (err = check_binary(image, file->size() - offset))) {
+    Config::warn() << "Bad binary transducer " << filename << ": " << err << "\n";
+    return false;
+  }
+  binary_header const& h = *(binary_header const*)image;
+  for (unsigned dir = 0; dir < 2; ++dir) {
+    alph[dir] = NEW alphabet_type();
+    owner_alph[dir] = 1;
+    read_binary_strings(image, h.symbols[dir], *alph[dir]);
+  }
+  named_states = h.named_states;
+  if (named_states) read_binary_strings(image, h.state_names, stateNames);
+  init_index();
+  states.reserve(h.n_states);
+  boost::uint64_t const* begin = (boost::uint64_t const*)(image + h.arc_begin);
+  FSTArc* arcs = (FSTArc*)(image + h.arcs);
+  for (unsigned s = 0; s < h.n_states; ++s) {
+    states.push_back();
+    State& st = states.back();
+    st.size = (unsigned)(begin[s + 1] - begin[s]);
+    if (h.n_arcs) st.packed = arcs + begin[s];
+  }
+  final = h.final;
+  if (h.n_arcs) arcs_file = file;
+  return true;
+}
+
 void WFST::listAlphabet(ostream& ostr, LabelType dir) {
   ostr << alphabet(dir);
 }
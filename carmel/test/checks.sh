@@ -0,0 +1,158 @@
+#!/bin/bash
+# checks that two ways of getting the same result agree.  prints ok/FAIL per check and the number of
+# failures; sourced by runtests.sh (which sets B), or run alone: checks.sh [carmel]
+cd `dirname $0`
+B=${B:-${1:-../bin/macosx/carmel}}
+T=../carmel-tutorial
+tmp=`mktemp -d ${TMPDIR:-/tmp}/carmel-checks.XXXXXX`
+nfail=0
+
+check() {
+  if [ "$2" = 1 ]; then
+    echo "ok $1"
+  else
+    echo "FAIL $1"
+    nfail=$((nfail+1))
+  fi
+}
+
+# same name cmd1 cmd2: the two commands' stdout must be identical (and nonempty)
+same() {
+  eval "$2" > $tmp/a 2>/dev/null
+  eval "$3" > $tmp/b 2>/dev/null
+  [ -s $tmp/a ] && cmp -s $tmp/a $tmp/b
+  check "$1" $((!$?))
+}
+
+# says name line cmd: the command's stderr must include the line
+says() {
+  eval "$3" 2>&1 >/dev/null | grep -qxF "$2"
+  check "$1" $((!$?))
+}
+
+# near name x y tol: the numbers x and y (or lists of as many numbers) must differ by at most tol (a
+# fraction of |x|)
+near() {
+  awk -v x="$2" -v y="$3" -v t="$4" 'BEGIN {
+    n = split(x, xs); if (!n || split(y, ys) != n) exit 1
+    for (i = 1; i <= n; ++i) {
+      d = xs[i] - ys[i]; if (d < 0) d = -d; a = xs[i]; if (a < 0) a = -a
+      if (d > t * a) exit 1
+    } }'
+  check "$1" $((!$?))
+}
+
+# the log2 corpus probs training logged at each iteration
+em_probs() {
+  grep "^i=" | sed 's/.*probability=2^\([^ ]*\) .*/\1/' | tr '\n' ' '
+}
+
+echo "--lazy-compose finds the same k best paths as composing first"
+jp="jpron.transducer vowel-separator.transducer jpron-asciikana.transducer asciikana-katakana.transducer"
+same lazy-compose "$B -riIEQk 10 $jp test.katakana" "$B -riIEQk 10 --lazy-compose $jp test.katakana"
+kb="head -20 $T/tagging.data.noe | $B -qbsriWIEk"
+tg="$T/tagging.fsa.trained.noe $T/tagging.fst.trained"
+same lazy-compose-batch "$kb 3 $tg" "$kb 3 --lazy-compose $tg"
+
+echo "--threads writes the same -b output, in the same order, as 1 thread"
+same threads-batch "$kb 3 $tg" "$kb 3 --threads=3 $tg"
+same threads-batch-cipher "head -20 $T/cipher.data.noe | $B -qbsriWIEk 1 $T/cipher.wfsa.noe $T/cipher.fst.trained" \
+  "head -20 $T/cipher.data.noe | $B -qbsriWIEk 1 --threads=4 $T/cipher.wfsa.noe $T/cipher.fst.trained"
+same threads-batch-options "$kb 3 -C --consolidate-max --constant-weight=0.5 $tg" \
+  "$kb 3 -C --consolidate-max --constant-weight=0.5 --threads=3 $tg"
+
+cp span.spell.corpus span.spell.wfst $T/tagging.data $T/tagging.fsa $T/tagging.fst $tmp
+em() { $B -: -HJ -M 4 "$@" 2>&1 >/dev/null | em_probs; }
+sp="-t $tmp/span.spell.corpus $tmp/span.spell.wfst"
+tc="--train-cascade $tmp/tagging.data $tmp/tagging.fsa $tmp/tagging.fst"
+
+echo "--threads training logs the same corpus probs as 1 thread, and the same weights for any N > 1"
+near threads-train "`em $sp`" "`em --threads=3 $sp`" 1e-9
+near threads-train-cascade "`em $tc`" "`em --threads=3 $tc`" 1e-9
+same threads-train-n "$B -: -HJ -M 4 --threads=2 $sp" "$B -: -HJ -M 4 --threads=4 $sp"
+
+echo "--scaled-fb training logs the same corpus probs as forward/backward in Weight"
+near scaled-fb "`em $sp`" "`em --scaled-fb $sp`" 1e-9
+near scaled-fb-cascade "`em $tc`" "`em --scaled-fb $tc`" 1e-9
+echo "--log-sum-fb (exact or fast) training logs the same corpus probs as adding one arc at a time"
+near log-sum-fb "`em $sp`" "`em --log-sum-fb $sp`" 1e-9
+near log-sum-fb-fast "`em $sp`" "`em --log-sum-fb=fast $sp`" 1e-9
+near log-sum-fb-cascade "`em $tc`" "`em --log-sum-fb=fast $tc`" 1e-9
+near log-sum-fb-threads "`em $sp`" "`em --log-sum-fb=fast --threads=3 $sp`" 1e-9
+
+echo "binary transducers round-trip, and compose and search like the text they were written from"
+for f in $jp angela.knight.kbest.wfst; do $B --write-binary $f > $tmp/$f 2>/dev/null; done
+$B $tmp/jpron.transducer > $tmp/jpron.txt 2>/dev/null
+same binary-roundtrip "cat $tmp/jpron.transducer" "$B --write-binary $tmp/jpron.txt"
+same binary-kbest "$B -IEQk 1000 angela.knight.kbest.wfst" "$B -IEQk 1000 $tmp/angela.knight.kbest.wfst"
+same binary-compose "$B -riIEQk 10 $jp test.katakana" "(cd $tmp && $B -riIEQk 10 $jp `pwd`/test.katakana)"
+
+echo "malformed text transducers are reported as the istream reader did"
+printf '0\n(0 (1 "a" 0.5)' > $tmp/truncated.wfst
+printf '0\n(0 (0 *e* b e.5))\n' > $tmp/bad-weight.wfst
+at="(^ marks the read position):"
+says read-empty "INPUT ERROR:  reading byte #1 (at EOF) $at" "$B empty"
+says read-truncated "INPUT ERROR:  reading byte #17 (at EOF) $at" "$B $tmp/truncated.wfst"
+says read-bad-weight "INPUT ERROR:  reading byte #17 $at" "$B $tmp/bad-weight.wfst"
+
+echo "training from an lz4-compressed disk cache of derivations gives the same weights as from memory"
+tr="-HJ -M 4 -t $tmp/span.spell.corpus $tmp/span.spell.wfst"
+dc="--disk-cache-derivations=$tmp/dc.XXXXXX"
+same disk-cache "$B -: $tr" "$B $dc $tr"
+same disk-cache-lz4 "$B -: $tr" "$B $dc --disk-cache-lz4=4096 $tr"
+
+echo "training from compactly serialized derivations gives the same weights as from -:"
+same compact-derivations "$B -: $tr" "$B --compact-derivations $tr"
+same compact-derivations-lz4 "$B -: $tr" "$B --compact-derivations --disk-cache-lz4=4096 $tr"
+ct="cat $tmp/tagging.fsa.trained $tmp/tagging.fst.trained && rm $tmp/tagging.f??.trained"
+same compact-derivations-cascade "$B -: -HJ -M 4 $tc; $ct" "$B --compact-derivations -HJ -M 4 $tc; $ct"
+
+echo "the derivation cache built with --threads trains the same as one built serially"
+same threads-cache "$B $dc $tr" "$B $dc --threads=3 $tr"
+same threads-cache-compact "$B --compact-derivations $tr" "$B --compact-derivations --threads=3 $tr"
+
+echo "--online-em trains the same with --threads (which only builds the cache)"
+same threads-online-em "$B -: --online-em=10 $tr" "$B -: --online-em=10 --threads=3 $tr"
+
+echo "--squarem with --threads logs the same corpus probs as 1 thread"
+sq() { $B -: --squarem -HJ -M 10 "$@" $sp 2>&1 >/dev/null | em_probs; }
+near threads-squarem "`sq`" "`sq --threads=3`" 1e-9
+
+echo "--compose-beam below 1 is a ratio the other way, so a small one prunes nothing"
+same compose-beam-reciprocal "$kb 1 $tg" "$kb 1 --compose-beam=1e-3 $tg"
+same compose-beam-wide "$kb 3 $tg" "$kb 3 --compose-beam=1e-100 $tg"
+
+echo "--precompose-cache is made, then loaded, and not reused for other options or --exponents"
+pc="--precompose --precompose-cache=$tmp/pc"
+same precompose-cache-made "$kb 2 $tg" "$kb 2 $pc $tg"
+same precompose-cache-loaded "$kb 2 $tg" "$kb 2 $pc $tg"
+same precompose-cache-other-options "$kb 2 -a $tg" "$kb 2 -a $pc $tg"
+kw="head -20 $T/tagging.data.noe | $B -qbsriIEk"  # with the paths' weights
+same precompose-cache-exponents "$kw 2 $pc $tg; $kw 2 --exponents=2,2,2 $pc $tg" \
+  "$kw 2 $tg; $kw 2 --exponents=2,2,2 $tg"
+
+echo "random restarts run in --threads keep the same best weights as one after another"
+rr="-: -HJ -M 4 -! 5 -R 7 -t $tmp/span.spell.corpus $tmp/span.spell.wfst"
+same restarts-threads "$B $rr" "$B --threads=3 $rr"
+
+echo "--crp-restarts chains in --threads give the same result for any N > 1, and about as good as 1 thread's"
+cr="--crp -M 20 --burnin=10 --crp-restarts=2 -: $tmp/span.spell.corpus $tmp/span.spell.wfst"
+same crp-restarts-threads "$B -R 1 --threads=2 $cr" "$B -R 1 --threads=4 $cr"
+crp_best() {  # mean over 3 seeds of the best restart's burned-in log prob
+  for R in 1 2 3; do
+    $B -R $R "$@" $cr 2>&1 >/dev/null | grep burned-in | sed 's/.*prob=2^\([^ ]*\).*/\1/' | sort -g | tail -1
+  done | awk '{ s += $1 } END { if (NR) print s / NR }'
+}
+near crp-restarts-threads-best "`crp_best`" "`crp_best --threads=3`" 0.03
+
+echo "--crp-threads samples about as well as 1 thread (mean burned-in log prob over 3 seeds within 2%)"
+crp() {
+  for R in 1 2 3; do
+    $B --crp -M 100 --burnin=50 -R $R -: "$@" $tmp/span.spell.corpus $tmp/span.spell.wfst 2>&1 >/dev/null |
+      grep -m1 burned-in
+  done | sed 's/.*prob=2^\([^ ]*\).*/\1/' | awk '{ s += $1 } END { if (NR) print s / NR }'
+}
+near crp-threads "`crp`" "`crp --crp-threads=4`" 0.02
+
+rm -rf $tmp
+echo "$nfail failed"
@@ -4,7 +4,7 @@ B=${1:-../bin/macosx/carmel}
 which $B
 mkdir -p logs
 log=logs/tests.`basename $B`.`date +%C%y%m%d_%H:%M`
-(echo $B;ls -l $B;uname -a;hostname; time . traintest.sh;time $B -IEQ -k 1000 angela.knight.kbest.wfst;time . j-test-jap ) 2>&1  | tee $log
+(echo $B;ls -l $B;uname -a;hostname; time . traintest.sh;time $B -IEQ -k 1000 angela.knight.kbest.wfst;time . j-test-jap;time . checks.sh ) 2>&1  | tee $log
 ln -sf $log latest.log
 echo
 echo `pwd`/latest.log
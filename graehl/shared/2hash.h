@@ -363,11 +363,18 @@ class HashTable : private A::template rebind<HashEntry<K, V> >::other {
   BOOST_STATIC_CONSTANT(unsigned, DEFAULTHASHSIZE = 8);
   BOOST_STATIC_CONSTANT(unsigned, MINHASHSIZE = 4);
   void swap(HashTable<K, V, H, P, A>& h) {
-    const std::size_t s = sizeof(HashTable<K, V>) / sizeof(char) + 1;
-    char temp[s];
-    memcpy(temp, this, s);
-    memcpy(this, &h, s);
-    memcpy(&h, temp, s);
+    using std::swap;
+    swap(static_cast<base_alloc&>(*this), static_cast<base_alloc&>(h));
+    swap(siz, h.siz);
+    swap(cnt, h.cnt);
+#ifndef STATIC_HASHER
+    swap(hash, h.hash);
+#endif
+#ifndef STATIC_HASH_EQUAL
+    swap(m_eq, h.m_eq);
+#endif
+    swap(growAt, h.growAt);
+    swap(table, h.table);
   }
 
   HashTable(unsigned sz, const hasher& hf)
@@ -169,14 +169,16 @@ void treeHeapAdd(T*& heapRoot, T* node) {
 }
 
 
-template <typename T>
-T* newTreeHeapAdd(T* heapRoot, T* node) {
+// persistent: heapRoot is unchanged; the nodes on the path node is added along are copied, by
+// alloc.copy(T const&) (so they can be freed together with everything else alloc made)
+template <typename T, typename Alloc>
+T* newTreeHeapAdd(T* heapRoot, T* node, Alloc& alloc) {
   if (!heapRoot) {
     node->left = node->right = NULL;
     node->nDescend = 0;
     return node;
   }
-  T* newRoot = new T(*heapRoot);
+  T* newRoot = alloc.copy(*heapRoot);
   ++newRoot->nDescend;
   bool goLeft = !newRoot->left || (newRoot->right && newRoot->right->nDescend > newRoot->left->nDescend);
   if (*newRoot < *node) {
@@ -184,19 +186,32 @@ T* newTreeHeapAdd(T* heapRoot, T* node) {
     node->right = newRoot->right;
     node->nDescend = newRoot->nDescend;
     if (goLeft)
-      node->left = newTreeHeapAdd(node->left, newRoot);
+      node->left = newTreeHeapAdd(node->left, newRoot, alloc);
     else
-      node->right = newTreeHeapAdd(node->right, newRoot);
+      node->right = newTreeHeapAdd(node->right, newRoot, alloc);
     return node;
   } else {
     if (goLeft)
-      newRoot->left = newTreeHeapAdd(newRoot->left, node);
+      newRoot->left = newTreeHeapAdd(newRoot->left, node, alloc);
     else
-      newRoot->right = newTreeHeapAdd(newRoot->right, node);
+      newRoot->right = newTreeHeapAdd(newRoot->right, node, alloc);
     return newRoot;
   }
 }
 
+struct new_copy {
+  template <typename T>
+  T* copy(T const& t) const {
+    return new T(t);
+  }
+};
+
+template <typename T>
+T* newTreeHeapAdd(T* heapRoot, T* node) {
+  new_copy alloc;
+  return newTreeHeapAdd(heapRoot, node, alloc);
+}
+
 // (vector) container versions (require that begin and end be C::value_type *)
 template <typename C>
 inline C& heapTop(const C& heap) {
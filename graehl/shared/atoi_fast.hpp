@@ -30,6 +30,7 @@
 #endif
 
 #include <boost/integer_traits.hpp>
+#include <boost/cstdint.hpp>
 #include <graehl/shared/verbose_exception.hpp>
 #include <algorithm>
 #include <cctype>
@@ -584,6 +585,58 @@ inline double parse_double(char const* cstr, bool require_complete = true) {
   return parse_real<double>(cstr, require_complete);
 }
 
+/**
+   \return std::strtod(s, end), exactly, but without the library call for the usual case: a plain decimal
+   [+-]digits[.digits][(e|E)[+-]digits] of at most 19 significant digits m with m < 2^53 and a decimal exponent
+   of at most 22 either way.  m and 10^exponent are then both exact doubles, so one multiply or divide rounds
+   correctly, as strtod does.  anything else (inf, nan, hex, leading space, long mantissas) goes to strtod
+*/
+inline double strtod_fast(char const* s, char** end) {
+  static double const pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  char const* p = s;
+  bool negative = false;
+  if (*p == '-' || *p == '+') negative = *p++ == '-';
+  boost::uint64_t m = 0;
+  unsigned significant = 0;
+  int exponent = 0;
+  char const* digits = p;
+  for (; digit_char(*p); ++p)
+    if (m || *p != '0') {
+      if (++significant > 19) goto slow;
+      m = m * 10 + (*p - '0');
+    }
+  if (*p == '.') {
+    ++digits;  // so a lone '.' has no digits
+    for (++p; digit_char(*p); ++p, --exponent)
+      if (m || *p != '0') {
+        if (++significant > 19) goto slow;
+        m = m * 10 + (*p - '0');
+      }
+  }
+  if (p == digits) goto slow;
+  if (*p == 'e' || *p == 'E') {
+    char const* q = p + 1;
+    bool negative_exponent = false;
+    if (*q == '-' || *q == '+') negative_exponent = *q++ == '-';
+    if (!digit_char(*q)) goto slow;
+    int e = 0;
+    for (; digit_char(*q); ++q)
+      if (e < 10000) e = e * 10 + (*q - '0');
+    exponent += negative_exponent ? -e : e;
+    p = q;
+  } else if (*p == 'x' || *p == 'X')
+    goto slow;
+  if ((m >> 53) || exponent < -22 || exponent > 22) goto slow;
+  {
+    double d = exponent < 0 ? (double)m / pow10[-exponent] : (double)m * pow10[exponent];
+    if (end) *end = const_cast<char*>(p);
+    return negative ? -d : d;
+  }
+slow:
+  return std::strtod(s, end);
+}
+
 #ifdef GRAEHL_TEST
 BOOST_AUTO_TEST_CASE(test_scan_real) {
   BOOST_CHECK_EQUAL(parse_float("1.25"), 1.25f);
@@ -599,6 +652,18 @@ BOOST_AUTO_TEST_CASE(test_scan_real) {
   BOOST_CHECK_EQUAL(parse_float("123456"), 123456.f);
   BOOST_CHECK_EQUAL(parse_float("0.001953125"), 0.001953125f);
 }
+
+BOOST_AUTO_TEST_CASE(test_strtod_fast) {
+  char const* tests[] = {"0",      "-0",    "1.5",  "-2.25e-3", ".5",       "5.",     "1e22",  "3e-23",
+                         "123456789012345678", "1234567890123456789012", "0.1", "1e", "1e+", ".",
+                         "-",      "inf",   "nan",  "0x1p3",    " 1",       "9007199254740993"};
+  for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+    char* e1, *e2;
+    double a = strtod_fast(tests[i], &e1), b = std::strtod(tests[i], &e2);
+    BOOST_CHECK(e1 == e2);
+    BOOST_CHECK(std::memcmp(&a, &b, sizeof(a)) == 0 || (a != a && b != b));
+  }
+}
 #endif
 
 
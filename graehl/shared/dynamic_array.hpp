@@ -25,6 +25,9 @@
 
 
 #include <graehl/shared/fixed_array.hpp>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
 
 namespace graehl {
 
@@ -52,17 +55,14 @@ class dynamic_array : public array<T, Alloc> {
  public:
 #if __cplusplus >= 201103L
   /// move
-  dynamic_array(dynamic_array&& o) noexcept {
-    std::memcpy(this, &o, sizeof(dynamic_array));
-    o.clear_nodestroy();
-  }
+  dynamic_array(dynamic_array&& o) noexcept : endv() { swap(o); }
 
   /// move
   dynamic_array& operator=(dynamic_array&& o) noexcept {
     assert(&o != this);  // std::vector doesn't check for self-move so why should we?
     destroy_contents();this->dealloc();
-    std::memcpy(this, &o, sizeof(dynamic_array));
-    o.release_impl();
+    endv = this->vec;
+    swap(o);
     return *this;
   }
 #endif
@@ -541,7 +541,11 @@ class dynamic_array : public array<T, Alloc> {
     //    if (newSpace==0) newSpace=1; // have decided that 0-length dynarray is impossible
     if (newSpace) {
       T* newVec = this->allocate(newSpace);  // can throw but we've made no changes yet
+#if __cplusplus >= 201103L
+      move_to(newVec, newSpace, std::is_trivially_copyable<T>());
+#else
       memcpy(newVec, this->vec, bytes(newSpace));
+#endif
       dealloc_safe();
       // set_begin(newVec);
       // set_capacity(newSpace);set_size(sz);
@@ -553,6 +557,17 @@ class dynamic_array : public array<T, Alloc> {
     }
   }
 
+#if __cplusplus >= 201103L
+  // moves our first n elements to uninitialized to, leaving our storage to be freed without destroying them
+  void move_to(T* to, size_type n, std::true_type) { memcpy(to, this->vec, bytes(n)); }
+  void move_to(T* to, size_type n, std::false_type) {
+    for (T* i = this->vec, * e = i + n; i != e; ++i, ++to) {
+      new (to) T(std::move(*i));
+      i->~T();
+    }
+  }
+#endif
+
   // doesn't dealloc *into
   void compact(array<T, Alloc>& into) {
     size_type sz = size();
@@ -233,8 +233,7 @@ class array : protected Alloc {
     if (cap) {
       dynarray_assert(vec);
       this->deallocate(vec, cap);
-      Paranoid(vec = NULL;);
-      endspace = vec;
+      endspace = vec = NULL;
     }
   }
   void destroy() {
@@ -399,18 +398,14 @@ class fixed_array : public auto_array<T, Alloc> {
  public:
 #if __cplusplus >= 201103L
   /// move
-  fixed_array(fixed_array&& o) noexcept {
-    std::memcpy(this, &o, sizeof(fixed_array));
-    o.release_impl();
-  }
+  fixed_array(fixed_array&& o) noexcept { this->swap(o); }
 
   /// move
   fixed_array& operator=(fixed_array&& o) noexcept {
     assert(&o != this);  // std::vector doesn't check for self-move so why should we?
     this->destroy();
     this->dealloc();
-    std::memcpy(this, &o, sizeof(fixed_array));
-    o.release_impl();
+    this->swap(o);
     return *this;
   }
 #endif
@@ -28,6 +28,8 @@
    the current (during resampling) prob of a param is gibbs_base::proposal_prob(id) or gibbs_base::proposal_prob(gps_t)
 
    init_run(r): for r=[0,gopt.restarts]
+   enum { chain_copies = 1 } if G(G &imp,ostream &out,ostream &log,random &rng) makes another chain on imp's model
+     (for gopt.block_threads)
    init_iteration(i)
    resample_block(blocki): for blocki=[0,n_pairs): choose new random sample[blocki] using p^power (this->power, don't forget to use it :)
    print_sample(sample):
@@ -87,7 +89,13 @@
 #include <graehl/shared/print_width.hpp>
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/debugprint.hpp>
+#include <graehl/shared/random.hpp>
+#include <graehl/shared/thread_group.hpp>
 #include <boost/math/distributions/normal.hpp>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <sstream>
 
 //#define DEBUG_GIBBS
 
@@ -228,6 +236,7 @@ struct gibbs_param
 
 struct gibbs_base
 {
+  enum { chain_copies = 0 }; // see G::chain_copies above
 
   void init(unsigned n_sym_ = 1, unsigned n_blocks_ = 1)
   {
@@ -251,6 +260,7 @@ struct gibbs_base
       , out(out)
       , log(log)
       , nnorm(0)
+      , chain_random()
   {
     gopt.validate();
     temp = gopt.temp;
@@ -268,11 +278,32 @@ struct gibbs_base
       , log(log)
       , nnorm(0)
       , sample(0)
+      , chain_random()
   {
     gopt.validate();
     temp = gopt.temp;
   }
 
+  // another chain (see run_chains): o's params and priors, its own samples, counts and rng
+  gibbs_base(gibbs_base const& o, std::ostream &out, std::ostream &log, random &rng)
+      : gopt(o.gopt)
+      , n_sym(o.n_sym)
+      , n_blocks(o.n_blocks)
+      , out(out)
+      , log(log)
+      , gps(o.gps)
+      , nnorm(o.nnorm)
+      , sample(o.n_blocks)
+      , prior_scale(o.prior_scale)
+      , temp(o.temp)
+      , chain_random(&rng)
+  {
+    init_rscale();
+    use_cache_prob = o.use_cache_prob;
+    init_cache();
+    prior_scale.init_cumulative();
+  }
+
   gibbs_stats stats;
   gibbs_opts gopt;
   unsigned n_sym, n_blocks;
@@ -293,11 +324,12 @@ struct gibbs_base
     wts_t wt;
 
     // only used for --expectation (online-em)
-    void randomize()
+    template <class Random>
+    void randomize(Random const& random)
     {
       force_weights();
       for (wts_t::iterator i = wt.begin(), e = wt.end(); i!=e; ++i)
-        *i *= random01();
+        *i *= random.random01();
     }
 
     void clear()
@@ -798,6 +830,26 @@ struct gibbs_base
   }
 
  private:
+  // --crp-threads: one per thread.  chain resamples blocks [begin,end) against its own copy of the counts
+  template <class G>
+  struct block_thread
+  {
+    random rng;
+    std::ostringstream out, log; // (unused: resampling doesn't print)
+    std::unique_ptr<G> chain;
+    unsigned begin, end;
+    unsigned next, stop; // this round's blocks
+    std::exception_ptr error;
+  };
+
+  template <class G>
+  struct block_threads
+  {
+    std::unique_ptr<block_thread<G>[]> threads;
+    unsigned n;
+    double stale_avg, stale_max; // last iteration's
+  };
+
   //actual impl:
   template <class G>
   gibbs_stats run(unsigned runi, G &imp)
@@ -813,12 +865,13 @@ struct gibbs_base
       print_counts(imp, true,"(prior counts)");
     }
     clear_blocks();
-    iteration(imp, gopt.random_start || (runi&&gopt.expectation)); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
+    std::unique_ptr<block_threads<G> > bt(make_block_threads(imp, runi, std::integral_constant<bool, G::chain_copies>()));
+    iteration(imp, gopt.random_start || (runi&&gopt.expectation), bt.get()); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
     //FIXME: isn't really random!  get the same sample after every iteration
     for (iter = 1; iter<=Ni; ++iter) {
       time = (double)iter-(double)gopt.burnin; //very funny: unsigned arithmetic -> double (unsigned maximum) if you're sloppy
       if (time<0) time = 0;
-      iteration(imp, false);
+      iteration(imp, false, bt.get());
     }
     log<<"\nGibbs stats: "<<stats<<"\n";
     if (gopt.prior_inference_show)
@@ -833,7 +886,7 @@ struct gibbs_base
   }
 
   template <class G>
-  void iteration(G &imp, bool randomize)
+  void iteration(G &imp, bool randomize, block_threads<G> *bt = 0)
   {
     temperature = temp(iter);
     power = (temperature>0)?1./temperature:1;
@@ -841,42 +894,193 @@ struct gibbs_base
     if (use_cache_prob) reset_cache();
     Weight p = 1;
     imp.init_iteration(iter);
-    for (unsigned b = 0; b<n_blocks; ++b) {
-      if (gopt.tick_every)
-        num_progress(log, b+1, gopt.tick_every, 70,".",""); //FIXME: use proportional progress so total #blocks = 2 lines of status or so
-      else
-        num_progress_scale(log, b+1, n_blocks, 70, 2,".","\n ");
-      block_delta &block = sample[b];
-      double wt = imp.block_weight(b);
-      if (!gopt.include_self)
-        addc(block, -wt);
-      block_delta include_self_save;
-      if (gopt.include_self)
-        include_self_save.swap(block);
-      else
-        block.clear();
-      imp.resample_block(b);
-      block_delta &bd = sample[b];
-      if (gopt.expectation) {
-        if (randomize) {
-          bd.randomize();
-          bd.prob = 0; // TODO: get prob after randomizing
-        }
-      } else {
-        bd.prob = prob(block.id); // for gopt.cheap_prob, do this before adding probs back to get prob underestimate; do it after to get overestimate (cache model is immune because it tracks own history)
+    if (bt)
+      p = resample_blocks(imp, *bt, randomize);
+    else
+      for (unsigned b = 0; b<n_blocks; ++b) {
+        show_progress(b+1);
+        resample(imp, b, randomize, true);
+        p *= sample[b].prob;
       }
-      p *= bd.prob;
-      if (gopt.include_self)
-        addc(include_self_save, -wt);
-      addc(block, wt); //todo: can efficiently compute cache prob as we do this
-    }
     if (iter>0 && inferring())
       propose_new_priors();
+    if (bt)
+      log<<" stale-counts avg="<<bt->stale_avg<<" max="<<bt->stale_max;
     record_iteration(p);
     maybe_print_periodic(imp);
   }
+
+  void show_progress(unsigned n_done)
+  {
+    if (gopt.tick_every)
+      num_progress(log, n_done, gopt.tick_every, 70,".",""); //FIXME: use proportional progress so total #blocks = 2 lines of status or so
+    else
+      num_progress_scale(log, n_done, n_blocks, 70, 2,".","\n ");
+  }
+
+  // sample[b] = a new sample for block b, given (the counts of) all the others.  with_prob: set its prob
+  // (unless gopt.expectation)
+  template <class G>
+  void resample(G &imp, unsigned b, bool randomize, bool with_prob)
+  {
+    block_delta &block = sample[b];
+    double wt = imp.block_weight(b);
+    if (!gopt.include_self)
+      addc(block, -wt);
+    block_delta include_self_save;
+    if (gopt.include_self)
+      include_self_save.swap(block);
+    else
+      block.clear();
+    imp.resample_block(b);
+    block_delta &bd = sample[b];
+    if (gopt.expectation) {
+      if (randomize) {
+        bd.randomize(*this);
+        bd.prob = 0; // TODO: get prob after randomizing
+      }
+    } else if (with_prob) {
+      bd.prob = prob(block.id); // for gopt.cheap_prob, do this before adding probs back to get prob underestimate; do it after to get overestimate (cache model is immune because it tracks own history)
+    }
+    if (gopt.include_self)
+      addc(include_self_save, -wt);
+    addc(block, wt); //todo: can efficiently compute cache prob as we do this
+  }
+
+  // G::chain_copies: G(imp, out, log, random) makes another chain sharing imp's model (as for run_chains)
+  template <class G>
+  block_threads<G> *make_block_threads(G &imp, unsigned runi, std::true_type)
+  {
+    unsigned T = std::min(gopt.block_threads, n_blocks);
+    if (T<2) return 0;
+    block_threads<G> *bt = new block_threads<G>;
+    bt->n = T;
+    bt->threads.reset(new block_thread<G>[T]);
+    for (unsigned t = 0; t<T; ++t) {
+      block_thread<G> &w = bt->threads[t];
+      w.rng.set_random_seed((random_seed_type)(random01()*4294967296.));
+      w.chain.reset(new G(imp, w.out, w.log, w.rng));
+      w.chain->init_run(runi);
+      w.begin = (unsigned)((double)n_blocks*t/T);
+      w.end = (unsigned)((double)n_blocks*(t+1)/T);
+    }
+    return bt;
+  }
+  template <class G>
+  block_threads<G> *make_block_threads(G &, unsigned, std::false_type)
+  {
+    return 0;
+  }
+
+  // --crp-sync=0: merge this many times per iteration.  merging once per iteration lets the threads' counts
+  // get stale enough that the chain settles at a visibly worse corpus prob than 1 thread would
+  static unsigned const auto_syncs = 16;
+
+  // approximate distributed sampling (as AD-LDA, Newman et al.): each thread resamples its blocks in order
+  // against its own copy of the counts - those at the last merge plus its own changes.  every gopt.sync_every
+  // blocks (per thread; 0: 1/auto_syncs of its blocks) all the threads' new samples are merged into the
+  // counts (in block order), and each thread's copy is updated.  the log shows how stale the threads'
+  // counts got: the average and max (over threads and merges) total count changes made by other threads
+  // since the last merge.  with cache-prob, block probs are computed afterwards, in order, as usual;
+  // otherwise (cheap-prob) each is the proposal prob from its thread's counts
+  template <class G>
+  Weight resample_blocks(G &imp, block_threads<G> &bt, bool randomize)
+  {
+    unsigned T = bt.n;
+    for (unsigned t = 0; t<T; ++t) {
+      block_thread<G> &w = bt.threads[t];
+      gibbs_base &c = *w.chain;
+      if (iter==0 || gopt.prior_inference_stddev>0)
+        sync_counts(c); // (prior inference changes the counts between iterations)
+      c.iter = iter;
+      c.time = time;
+      c.temperature = temperature;
+      c.power = power;
+      w.chain->init_iteration(iter);
+      w.next = w.begin;
+    }
+    double stale_sum = 0;
+    bt.stale_max = 0;
+    unsigned n_stale = 0, n_done = 0;
+    for (bool more = true; more;) {
+      for (unsigned t = 0; t<T; ++t) {
+        block_thread<G> &w = bt.threads[t];
+        unsigned every = gopt.sync_every ? gopt.sync_every : (w.end-w.begin+auto_syncs-1)/auto_syncs;
+        w.stop = every<w.end-w.next ? w.next+every : w.end;
+      }
+      thread_group threads;
+      for (unsigned t = 1; t<T; ++t)
+        threads.create_thread(&gibbs_base::resample_range<G>, std::ref(bt.threads[t]), randomize);
+      resample_range(bt.threads[0], randomize);
+      threads.join_all();
+      for (unsigned t = 0; t<T; ++t)
+        if (bt.threads[t].error) std::rethrow_exception(bt.threads[t].error);
+      more = false;
+      for (unsigned t = 0; t<T; ++t) {
+        block_thread<G> &w = bt.threads[t];
+        gibbs_base &c = *w.chain;
+        for (unsigned b = w.next; b<w.stop; ++b) {
+          double wt = imp.block_weight(b);
+          addc(sample[b], -wt);
+          sample[b] = c.sample[b];
+          addc(sample[b], wt);
+        }
+        for (unsigned b = w.next; b<w.stop; ++b)
+          show_progress(++n_done);
+        w.next = w.stop;
+        if (w.next<w.end) more = true;
+      }
+      for (unsigned t = 0; t<T; ++t) {
+        double stale = sync_counts(*bt.threads[t].chain);
+        stale_sum += stale;
+        maybe_increase_max(bt.stale_max, stale);
+        ++n_stale;
+      }
+    }
+    Weight p = 1;
+    for (unsigned b = 0; b<n_blocks; ++b) {
+      block_delta &bd = sample[b];
+      if (!gopt.expectation && gopt.cache_prob)
+        bd.prob = cache_prob(bd.id);
+      p *= bd.prob;
+    }
+    bt.stale_avg = stale_sum/n_stale;
+    return p;
+  }
+
+  template <class G>
+  static void resample_range(block_thread<G> &w, bool randomize)
+  {
+    try {
+      G &c = *w.chain;
+      for (unsigned b = w.next; b<w.stop; ++b)
+        static_cast<gibbs_base &>(c).resample(c, b, randomize, !c.gopt.cache_prob);
+    } catch (...) {
+      w.error = std::current_exception();
+    }
+  }
+
+  // c's counts = ours.  returns the total difference
+  double sync_counts(gibbs_base &c) const
+  {
+    double d = 0;
+    for (unsigned i = 0, N = gps.size(); i<N; ++i) {
+      gibbs_param &p = c.gps[i];
+      d += std::fabs(gps[i].count()-p.count());
+      p = gps[i];
+    }
+    c.normsum.reinit_nodestroy(nnorm);
+    std::copy(normsum.begin(), normsum.end(), c.normsum.begin());
+    return d;
+  }
+
   unsigned beststart;
  public:
+  random *chain_random; // if not NULL, used instead of the global random01
+  double random01() const
+  {
+    return chain_random ? chain_random->random01() : graehl::random01();
+  }
   template <class G>
   gibbs_stats run_starts(G &imp)
   {
@@ -891,8 +1095,7 @@ struct gibbs_base
     if (restart_priors)
       save_priors(priors);
     for (unsigned r = 0; r<=re; ++r) {
-      graehl::time_space_report(log,"Gibbs sampling run: ");
-      if (re>0) log<<"(random restart "<<r<<" of "<<re<<"): ";
+      log_restart(r);
       if (r>0&&restart_priors)
         restore_priors(priors);
       log<<"\n";
@@ -913,6 +1116,162 @@ struct gibbs_base
     return best;
   }
 
+  // --crp-restarts with --threads: restarts 1..re are sampled n_threads-1 at a time, each by its own chain
+  // G(imp, out, log, random) (sharing imp's model, read only) with its own rng, seeded in restart order from
+  // the global one; restart 0 is sampled by imp, in this thread.  each restart's log and output are shown in
+  // order once all are done, and the best restart is chosen as by run_starts (whole chains: averaging counts
+  // across chains would mix up their differently labeled latent states)
+  template <class G>
+  gibbs_stats run_chains(G &imp, unsigned n_threads)
+  {
+    unsigned re = gopt.restarts;
+    if (re==0 || n_threads<2 || (gopt.prior_inference_stddev>0 && !gopt.prior_inference_restart_fresh))
+      return run_starts(imp); // (each restart's priors would start from the last one's)
+    init_cache();
+    chain_runs<G> p;
+    p.re = re;
+    p.restart_priors = gopt.prior_inference_restart_fresh;
+    prior_scale.init_cumulative();
+    if (p.restart_priors)
+      save_priors(p.priors);
+    p.seeds.resize(re+1);
+    for (unsigned r = 1; r<=re; ++r)
+      p.seeds[r] = (random_seed_type)(random01()*4294967296.);
+    p.stats.resize(re+1);
+    p.logs.resize(re+1);
+    p.outs.resize(re+1);
+    p.next = 1;
+    unsigned T = std::min(n_threads-1, re);
+    std::unique_ptr<chain_worker<G>[]> workers(new chain_worker<G>[T]);
+    for (unsigned t = 0; t<T; ++t) {
+      chain_worker<G> &w = workers[t];
+      w.log.copyfmt(log);
+      w.out.copyfmt(out);
+      w.log.tie(0); // copyfmt copies the tie too (cerr's is cout), which this thread may be writing
+      w.out.tie(0);
+      w.best_r = 0;
+      w.best_sample.reinit(n_blocks);
+      w.chain.reset(new G(imp, w.out, w.log, w.rng));
+    }
+    thread_group threads;
+    for (unsigned t = 0; t<T; ++t)
+      threads.create_thread(&gibbs_base::run_chain<G>, std::ref(p), std::ref(workers[t]));
+    saved_counts_t best_counts;
+    blocks_t best_sample(n_blocks);
+    gibbs_stats best;
+    try {
+      log_restart(0);
+      log<<"\n";
+      best = run(0, imp);
+      beststart = 0;
+      log << "\nNew best: "<<best<<"\n";
+      finalize_cumulative_counts();
+      save_counts(best_counts);
+      best_sample.swap(sample);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(p.mutex);
+      if (!p.error) p.error = std::current_exception();
+    }
+    threads.join_all();
+    if (p.error) std::rethrow_exception(p.error);
+    for (unsigned r = 1; r<=re; ++r) {
+      log<<p.logs[r];
+      out<<p.outs[r];
+      gibbs_stats const& s = p.stats[r];
+      if (s.better(best, gopt)) {
+        beststart = r;
+        log << "\nNew best: "<<s<<"\n";
+        best = s;
+      }
+    }
+    if (beststart>0)
+      for (unsigned t = 0; t<T; ++t) {
+        chain_worker<G> &w = workers[t];
+        if (w.best_r==beststart) {
+          best_counts.swap(w.best_counts);
+          best_sample.swap(w.best_sample);
+        }
+      }
+    best_sample.swap(sample);
+    restore_probs(best_counts);
+    free_cache();
+    return best;
+  }
+
+ private:
+  void log_restart(unsigned r)
+  {
+    graehl::time_space_report(log,"Gibbs sampling run: ");
+    if (gopt.restarts>0) log<<"(random restart "<<r<<" of "<<gopt.restarts<<"): ";
+  }
+
+  template <class G>
+  struct chain_runs
+  {
+    unsigned re;
+    bool restart_priors;
+    saved_counts_t priors;
+    std::vector<random_seed_type> seeds;
+    std::vector<gibbs_stats> stats;
+    std::vector<std::string> logs, outs; // what restart r printed
+    unsigned next; // restart for a worker to take
+    std::exception_ptr error;
+    std::mutex mutex;
+  };
+
+  template <class G>
+  struct chain_worker
+  {
+    random rng;
+    std::ostringstream out, log;
+    std::unique_ptr<G> chain;
+    unsigned best_r; // of the restarts this worker took (best_r>0 once it's done one)
+    gibbs_stats best;
+    saved_counts_t best_counts;
+    blocks_t best_sample;
+  };
+
+  // takes the next restart until none remain.  keeps the best as run_starts would, which is also the one
+  // run_chains picks if that's one of this worker's
+  template <class G>
+  static void run_chain(chain_runs<G> &p, chain_worker<G> &w)
+  {
+    G &c = *w.chain;
+    for (;;) {
+      unsigned r;
+      {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if (p.next>p.re || p.error) return;
+        r = p.next++;
+      }
+      try {
+        w.rng.set_random_seed(p.seeds[r]);
+        c.log_restart(r);
+        if (p.restart_priors)
+          c.restore_priors(p.priors);
+        w.log<<"\n";
+        gibbs_stats const& s = c.gibbs_base::run(r, c);
+        p.stats[r] = s;
+        if (!w.best_r || s.better(w.best, c.gopt)) {
+          w.best_r = r;
+          w.best = s;
+          c.finalize_cumulative_counts();
+          c.save_counts(w.best_counts);
+          w.best_sample.swap(c.sample);
+        }
+        p.logs[r] = w.log.str();
+        w.log.str("");
+        p.outs[r] = w.out.str();
+        w.out.str("");
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if (!p.error) p.error = std::current_exception();
+        return;
+      }
+    }
+  }
+
+ public:
   //logging:
   Weight prob(block_t const& b)
   {
@@ -126,6 +126,10 @@ struct gibbs_opts
            "use full forward/backward fractional counts instead of a single count=1 random sample")
           ("random-start", defaulted_value(&random_start)->zero_tokens(),
            "for expectation, scale the initial per-example counts by random [0,1).  without this, every run would have the same outcome.  this is implicitly enabled for restarts, of course.")
+          ("crp-threads", defaulted_value(&block_threads),
+           "(approximate) split the blocks (training examples) among N threads, each resampling its blocks against its own copy of the counts, which are merged every --crp-sync blocks")
+          ("crp-sync", defaulted_value(&sync_every),
+           "with --crp-threads, merge the threads' counts after each resamples this many blocks (0 means 16 times per iteration).  merging less often is faster but the threads' counts get staler, and the chain may settle at a worse probability than a single thread's")
           ;
   }
   //forest-em and carmel supported:
@@ -165,6 +169,8 @@ struct gibbs_opts
   //carmel only:
   bool expectation; // instead of sampling, ask the gibbs impl. to compute full forward/backward fractional counts
   bool random_start;
+  unsigned block_threads; // >1: blocks are resampled by this many threads at once (approximately: see gibbs_base::resample_blocks)
+  unsigned sync_every; // blocks per thread between merging their counts (0: 16 merges per iteration)
 
   unsigned init_em;
   bool em_p0;
@@ -214,6 +220,8 @@ struct gibbs_opts
   {
     expectation = false;
     random_start = false;
+    block_threads = 1;
+    sync_every = 0;
 
     include_self = false;
     prior_inference_start = prior_inference_end = 0;
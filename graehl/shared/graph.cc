@@ -25,8 +25,8 @@ std::ostream& operator<<(std::ostream& out, const GraphArc& a) {
   return out << ')';
 }
 
-void (*dfsFunc)(unsigned, unsigned) = NULL;
-void (*dfsExitFunc)(unsigned, unsigned) = NULL;
+THREADLOCAL void (*dfsFunc)(unsigned, unsigned) = NULL;
+THREADLOCAL void (*dfsExitFunc)(unsigned, unsigned) = NULL;
 
 void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
                       void (*func)(unsigned state, unsigned pred)) {
@@ -40,8 +40,8 @@ void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
 // g's arcs are reversed and added to graph dest
 void add_reversed_arcs(GraphState* rev, GraphState const* src, unsigned n, bool data_point_to_forward) {
   for (unsigned i = 0; i < n; ++i) {
-    List<GraphArc> const& arcs = src[i].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.begin(), end = arcs.end(); l != end; ++l) {
+    GraphState::arcs_type const& arcs = src[i].arcs;
+    for (GraphState::arcs_type::const_iterator l = arcs.begin(), end = arcs.end(); l != end; ++l) {
       /*            GraphArc r;
                     r.data = &(*l);
                     Assert(i == l->src);
@@ -50,7 +50,7 @@ void add_reversed_arcs(GraphState* rev, GraphState const* src, unsigned n, bool
                     r.weight = l->weight;
                     rev[r.src].arcs.push(r);
       */
-      List<GraphArc>& d = rev[l->dest].arcs;
+      GraphState::arcs_type& d = rev[l->dest].arcs;
       d.push_front(l->dest, l->src, l->weight, data_point_to_forward ? (void*)&*l : (void*)l->data);
     }
   }
@@ -71,8 +71,8 @@ Graph reverseGraph(Graph g, bool data_point_to_forward)
   return ret;
 }
 
-Graph dfsGraph;
-bool* dfsVis;
+THREADLOCAL Graph dfsGraph;
+THREADLOCAL bool* dfsVis;
 
 
 void dfsRec(unsigned state, unsigned pred) {
@@ -83,15 +83,15 @@ void dfsRec(unsigned state, unsigned pred) {
   dfsVis[state] = true;
   if (dfsFunc) dfsFunc(state, pred);
 
-  const List<GraphArc>& arcs = dfsGraph.states[state].arcs;
-  for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l)
+  const GraphState::arcs_type& arcs = dfsGraph.states[state].arcs;
+  for (GraphState::arcs_type::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l)
     dfsRec(l->dest, state);
   if (dfsExitFunc) dfsExitFunc(state, pred);
 }
 
 
-FLOAT_TYPE* DistToState::weights = NULL;
-DistToState** DistToState::stateLocations = NULL;
+THREADLOCAL FLOAT_TYPE* DistToState::weights = NULL;
+THREADLOCAL DistToState** DistToState::stateLocations = NULL;
 FLOAT_TYPE DistToState::unreachable = HUGE_VAL;
 
 inline bool operator<(DistToState lhs, DistToState rhs) {
@@ -194,8 +194,8 @@ void shortestDistancesFrom(Graph g, unsigned src, FLOAT_TYPE* dist, GraphArc** t
     unsigned activeState = distQueue[0].state;
     //    dist[activeState] = (FLOAT_TYPE)distQueue[0];
     heapPop(distQueue, distQueue + nUnknown--);
-    List<GraphArc>& arcs = st[activeState].arcs;
-    for (List<GraphArc>::val_iterator a = arcs.val_begin(), end = arcs.val_end(); a != end; ++a) {
+    GraphState::arcs_type& arcs = st[activeState].arcs;
+    for (GraphState::arcs_type::val_iterator a = arcs.val_begin(), end = arcs.val_end(); a != end; ++a) {
       // future: compare only best arc to any given state
       unsigned targetState = a->dest;
       if ((candidate = (a->weight + weights[activeState])) < weights[targetState]) {
@@ -236,8 +236,8 @@ Graph removeStates(Graph g, bool marked[])  // not tested
   for (i = 0; i < g.nStates; ++i)
     if (!marked[i]) {
       GraphState& new_state = reduced[oldToNew[i]];
-      List<GraphArc> const& arcs = g.states[i].arcs;
-      for (List<GraphArc>::const_iterator oldArc = arcs.begin(), end = arcs.end(); oldArc != end; ++oldArc)
+      GraphState::arcs_type const& arcs = g.states[i].arcs;
+      for (GraphState::arcs_type::const_iterator oldArc = arcs.begin(), end = arcs.end(); oldArc != end; ++oldArc)
         if (!marked[oldArc->dest])
           new_state.add(oldToNew[oldArc->dest], oldToNew[oldArc->src], oldArc->weight, oldArc->data);
     }
@@ -254,8 +254,8 @@ void printGraph(const Graph g, std::ostream& out) {
   out << "(Graph #V=" << g.nStates << std::endl;
   for (unsigned i = 0; i < g.nStates; ++i) {
     out << i;
-    const List<GraphArc>& arcs = g.states[i].arcs;
-    for (List<GraphArc>::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
+    const GraphState::arcs_type& arcs = g.states[i].arcs;
+    for (GraphState::arcs_type::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
       out << ' ' << (*a);
     out << std::endl;
   }
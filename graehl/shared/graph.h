@@ -26,7 +26,9 @@
 #include <graehl/shared/weight.h>
 #include <graehl/shared/2heap.h>
 #include <graehl/shared/list.h>
+#include <graehl/shared/node_arena.hpp>
 #include <graehl/shared/push_backer.hpp>
+#include <graehl/shared/threadlocal.hpp>
 
 //#include <boost/serialization/access.hpp>
 
@@ -76,14 +78,25 @@ struct GraphArc {
 std::ostream& operator<<(std::ostream& out, const GraphArc& a);
 
 struct GraphState {
-  typedef List<GraphArc> arcs_type;
+  typedef List<GraphArc, arena_allocator<GraphArc> > arcs_type;
   arcs_type arcs;
 
+#if __cplusplus >= 201103L
+  GraphState() = default;
+  GraphState(GraphState const&) = default;
+  GraphState& operator=(GraphState const&) = default;
+  /// move: takes o's arcs along with the arena they came from, leaving o empty
+  GraphState(GraphState&& o) noexcept { arcs.swap(o.arcs); }
+#endif
+
   template <class Archive>
   void serialize(Archive& ar, const unsigned version = 0) {
     ar & arcs;
   }
 
+  // arcs added from now on (there must be none yet) come from arena, which must outlive them
+  void use_arena(node_arena& arena) { arcs.use_allocator(arena_allocator<GraphArc>(&arena)); }
+
   void add(GraphArc const& a) { arcs.push(a); }
   std::size_t outdegree() const { return arcs.size(); }
 
@@ -100,7 +113,7 @@ struct GraphState {
   void add(unsigned src, unsigned dest, FLOAT_TYPE weight) { arcs.push_front(src, dest, weight); }
   template <class W>
   void setwt(W const& w) {
-    for (List<GraphArc>::val_iterator i = arcs.val_begin(), end = arcs.val_end(); i != end; ++i) {
+    for (arcs_type::val_iterator i = arcs.val_begin(), end = arcs.val_end(); i != end; ++i) {
       GraphArc& a = *i;
       a.wt() = w(a);
     }
@@ -108,11 +121,11 @@ struct GraphState {
 
   typedef dynamic_array<WEIGHT_FLOAT_TYPE> saved_weights_t;
   void save_weights(saved_weights_t& s) const {
-    for (List<GraphArc>::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i)
+    for (arcs_type::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i)
       s.push_back(i->weight);
   }
   unsigned restore_weights(saved_weights_t const& s, unsigned start = 0) {
-    for (List<GraphArc>::val_iterator i = arcs.val_begin(), end = arcs.val_end(); i != end; ++i) {
+    for (arcs_type::val_iterator i = arcs.val_begin(), end = arcs.val_end(); i != end; ++i) {
       GraphArc& a = *i;
       a.weight = s[start++];
     }
@@ -150,14 +163,26 @@ void add_reversed_arcs(GraphState* destination, GraphState const* src, unsigned
 
 Graph reverseGraph(Graph g, bool data_point_to_forward = true);
 
-extern Graph dfsGraph;
-extern bool* dfsVis;
+// per thread, so independent transducers can be reduced in parallel
+extern THREADLOCAL Graph dfsGraph;
+extern THREADLOCAL bool* dfsVis;
 
 void dfsRec(unsigned state, unsigned pred);
 
 void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
                       void (*func)(unsigned state, unsigned pred));
 
+// as depthFirstSearch, but calling f(state, pred), and without the globals
+template <class F>
+void depthFirstVisit(Graph const& g, unsigned state, unsigned pred, bool* visited, F& f) {
+  if (visited[state]) return;
+  visited[state] = true;
+  f(state, pred);
+  GraphState::arcs_type const& arcs = g.states[state].arcs;
+  for (GraphState::arcs_type::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l)
+    depthFirstVisit(g, l->dest, state, visited, f);
+}
+
 template <class Weight>
 void countNoCyclePaths(Graph g, Weight* nPaths, unsigned src);
 
@@ -186,8 +211,8 @@ struct backrefs {
     if (ids[s].use(nextid)) order_from(s);
   }
   void order_from(unsigned s) {
-    const List<GraphArc>& arcs = g.states[s].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
+    const GraphState::arcs_type& arcs = g.states[s].arcs;
+    for (GraphState::arcs_type::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
       use(l->dest);
     }
   }
@@ -223,8 +248,8 @@ class TopoSort {
       return;
     }
     begun[s] = true;
-    const List<GraphArc>& arcs = g.states[s].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
+    const GraphState::arcs_type& arcs = g.states[s].arcs;
+    for (GraphState::arcs_type::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
       order_from(l->dest);
     }
     done[s] = true;
@@ -272,8 +297,8 @@ struct reverse_topo_order {
       return;
     }
     begun[s] = true;
-    const List<GraphArc>& arcs = g.states[s].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
+    const GraphState::arcs_type& arcs = g.states[s].arcs;
+    for (GraphState::arcs_type::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
       order_from(o, l->dest);
     }
     done[s] = true;
@@ -288,11 +313,11 @@ struct reverse_topo_order {
 };
 
 
-// serves as adjustable heap (tracks where each state is, and its weight)
+// serves as adjustable heap (tracks where each state is, and its weight).  per thread, like dfsGraph
 struct DistToState {
   unsigned state;
-  static DistToState** stateLocations;
-  static FLOAT_TYPE* weights;
+  static THREADLOCAL DistToState** stateLocations;
+  static THREADLOCAL FLOAT_TYPE* weights;
   static FLOAT_TYPE unreachable;
   operator FLOAT_TYPE() const { return weights[state]; }
   void operator=(DistToState rhs) {
@@ -371,8 +396,8 @@ void countNoCyclePaths(Graph g, Weight* nPaths, unsigned src, unsigned* p_n_back
   nPaths[src] = 1;
   for (List<unsigned>::const_iterator t = topo.const_begin(), end = topo.const_end(); t != end; ++t) {
     unsigned src = *t;
-    const List<GraphArc>& arcs = g.states[src].arcs;
-    for (List<GraphArc>::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
+    const GraphState::arcs_type& arcs = g.states[src].arcs;
+    for (GraphState::arcs_type::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
       nPaths[a->dest] += nPaths[src];
   }
 }
@@ -393,8 +418,8 @@ void propagate_paths_in_order(Graph g, Order t, Order const& t_order_end, Weight
                               Weight_array& w) {
   for (; t != t_order_end; ++t) {
     unsigned src = *t;
-    const List<GraphArc>& arcs = g.states[src].arcs;
-    for (List<GraphArc>::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i) {
+    const GraphState::arcs_type& arcs = g.states[src].arcs;
+    for (GraphState::arcs_type::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i) {
       GraphArc const& a = *i;
       w[a.dest] += w[src] * getwt(a);
     }
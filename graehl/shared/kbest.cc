@@ -16,30 +16,18 @@
 #include "kbest.h"
 #include <cmath>
 
-Graph sidetracks;
-GraphHeap** pathGraph;
-GraphState* shortPathTree;
 using namespace std;
 
-
-List<GraphHeap*> GraphHeap::usedBlocks;
-GraphHeap* GraphHeap::freeList = NULL;
-const unsigned GraphHeap::newBlocksize = 64;
-
-vector<pGraphArc*> Repository;
-
-void freeAllSidetracks() {
-  for (unsigned i = 0; i < Repository.size(); i++)
-    if (Repository[i]) delete[](pGraphArc*)Repository[i];
-  Repository.clear();
+void kbest_context::set_sidetracks(Graph g) {
+  sidetracks = g;
+  unsigned n = 0;  // all but the best arc of each state go in its arcHeap
+  for (unsigned i = 0; i < g.nStates; ++i)
+    if (g.states[i].arcs.notEmpty()) n += g.states[i].arcs.size() - 1;
+  arcHeaps.init(n);
+  arcHeapsEnd = arcHeaps.begin();
 }
 
-void buildSidetracksHeap(unsigned state, unsigned pred) {
-  // IMPORTANT NOTE: This function create NEW memory
-  // of type (pGraphArc *). This memory is not deleted inside the function
-  // because it is used else where. For this reason addresses for
-  // the memory created is kept in a global variable "Repsitory" so that
-  // the caller function (e.g., bestPaths) deletes the memory when it is done.
+void kbest_context::buildSidetracksHeap(unsigned state, unsigned pred) {
   GraphHeap* prev;
 
   if (pred == DFS_NO_PREDECESSOR)
@@ -51,8 +39,8 @@ void buildSidetracksHeap(unsigned state, unsigned pred) {
   Config::debug() << "buildSidetracksHeap state=" << state << " predecessor=" << pred << "\n";
 #endif
 
-  List<GraphArc>& arcs = sidetracks.states[state].arcs;
-  List<GraphArc>::val_iterator s = arcs.val_begin(), end = arcs.val_end();
+  GraphState::arcs_type& arcs = sidetracks.states[state].arcs;
+  GraphState::arcs_type::val_iterator s = arcs.val_begin(), end = arcs.val_end();
   if (s != end) {
     unsigned heapSize = 0;
     GraphArc* min;
@@ -61,22 +49,23 @@ void buildSidetracksHeap(unsigned state, unsigned pred) {
       if (s->weight < min->weight) min = &(*s);
       ++heapSize;
     }
-    pathGraph[state] = new GraphHeap;
+    pathGraph[state] = (GraphHeap*)heaps.allocate(sizeof(GraphHeap));
     pathGraph[state]->arc = min;
     pathGraph[state]->arcHeapSize = heapSize;
     if (heapSize) {
-      pGraphArc* heapStart = pathGraph[state]->arcHeap = NEW pGraphArc[heapSize];
-      Repository.push_back(heapStart);  // keep track of it so that we can delete it later
+      pGraphArc* heapStart = pathGraph[state]->arcHeap = arcHeapsEnd;
+      arcHeapsEnd += heapSize;
+      Assert(arcHeapsEnd <= arcHeaps.end());
       pGraphArc* heapI = heapStart;
-      //      List<GraphArc>::iterator end = sidetracks.states[state].arcs.end()  ;
-      //    for ( List<GraphArc>::iterator gArc=sidetracks.states[state].arcs.begin() ; gArc !=end ; ++gArc )
-      for (List<GraphArc>::val_iterator gArc = arcs.val_begin(), end = arcs.val_end(); gArc != end; ++gArc)
+      //      GraphState::arcs_type::iterator end = sidetracks.states[state].arcs.end()  ;
+      //    for ( GraphState::arcs_type::iterator gArc=sidetracks.states[state].arcs.begin() ; gArc !=end ; ++gArc )
+      for (GraphState::arcs_type::val_iterator gArc = arcs.val_begin(), end = arcs.val_end(); gArc != end; ++gArc)
         if (&(*gArc) != min) (heapI++)->p = &(*gArc);
       Assert(heapI == heapStart + heapSize);
       heapBuild(heapStart, heapStart + heapSize);
     } else
       pathGraph[state]->arcHeap = NULL;
-    pathGraph[state] = newTreeHeapAdd(prev, pathGraph[state]);
+    pathGraph[state] = newTreeHeapAdd(prev, pathGraph[state], *this);
   } else
     pathGraph[state] = prev;
 }  // end of buildSidetracksHeap()
@@ -96,12 +85,12 @@ Graph sidetrackGraph(Graph lG, Graph rG, FLOAT_TYPE* dist)
   GraphState* sub = NEW GraphState[nStates];
   for (unsigned i = 0; i < nStates; ++i)
     if (dist[i] != HUGE_VAL) {
-      const List<GraphArc>& la = lG.states[i].arcs;
-      for (List<GraphArc>::const_iterator l = la.const_begin(), end = la.const_end(); l != end; ++l) {
+      const GraphState::arcs_type& la = lG.states[i].arcs;
+      for (GraphState::arcs_type::const_iterator l = la.const_begin(), end = la.const_end(); l != end; ++l) {
         Assert(i == l->src);
 
-        const List<GraphArc>& ra = rG.states[i].arcs;
-        for (List<GraphArc>::const_iterator r = ra.const_begin(), end = ra.const_end(); r != end; ++r)
+        const GraphState::arcs_type& ra = rG.states[i].arcs;
+        for (GraphState::arcs_type::const_iterator r = ra.const_begin(), end = ra.const_end(); r != end; ++r)
           if (r->data == l->data) goto short_done;
         if (dist[l->dest] != HUGE_VAL) {
           GraphArc w = *l;
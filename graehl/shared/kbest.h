@@ -14,12 +14,14 @@
 #ifndef GRAEHL_SHARED_KBEST_H
 #define GRAEHL_SHARED_KBEST_H
 
-// FIXME: uses globals rather than explicit context struct; not threadsafe
+// all the scratch for one search is in its kbest_context, so searches on different graphs can run concurrently
 
 #include <graehl/shared/graph.h>
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/list.h>
 #include <graehl/shared/2hash.h>
+#include <graehl/shared/fixed_array.hpp>
+#include <graehl/shared/node_arena.hpp>
 
 namespace graehl {
 
@@ -36,7 +38,7 @@ inline bool operator<(const pGraphArc l, const pGraphArc r) {
 /**
    an explicitly tree-structured binary heap (to allow shared subheaps). the
    usual packed-array complete heap representation is faster but can't share
-   subheaps.
+   subheaps.  allocated by (and freed with) a kbest_context
 */
 struct GraphHeap {
   GraphHeap* left, *right;  // for balanced heap
@@ -45,37 +47,6 @@ struct GraphHeap {
   GraphArc* arc;  // data at each vertex
   pGraphArc* arcHeap;  // binary heap of sidetracks originating from a state
   unsigned arcHeapSize;
-
-  static GraphHeap* freeList;
-  static const unsigned newBlocksize;
-  static List<GraphHeap*> usedBlocks;
-  // custom new is mandatory, because of how freeAll works (and we do rely on freeAll)!
-  void* operator new(size_t) {
-    GraphHeap* ret, *max;
-    if (freeList) {
-      ret = freeList;
-      freeList = freeList->left;
-      return ret;
-    }
-    freeList = (GraphHeap*)::operator new(newBlocksize * sizeof(GraphHeap));
-    usedBlocks.push(freeList);
-    freeList->left = NULL;
-    max = freeList + newBlocksize - 1;
-    for (ret = freeList++; freeList < max; ret = freeList++) freeList->left = ret;
-    return freeList--;
-  }
-  void operator delete(void* p) {
-    GraphHeap* e = (GraphHeap*)p;
-    e->left = freeList;
-    freeList = e;
-  }
-  static void freeAll() {
-    while (usedBlocks.notEmpty()) {
-      ::operator delete((void*)usedBlocks.top());
-      usedBlocks.pop();
-    }
-    freeList = NULL;
-  }
 };
 
 inline bool operator<(const GraphHeap& l, const GraphHeap& r) {
@@ -102,9 +73,41 @@ inline bool operator<(const EdgePath& l, const EdgePath& r) {
 
 
 Graph sidetrackGraph(Graph lG, Graph rG, FLOAT_TYPE* dist);
-void buildSidetracksHeap(unsigned state,
-                         unsigned pred);  // call depthfirstsearch with this; see usage in kbest.cc
-void freeAllSidetracks();  // must be called after you buildSidetracksHeap
+
+// what bestPaths builds for k > 1, all freed with the context
+struct kbest_context {
+  Graph sidetracks;
+  GraphHeap** pathGraph;  // per state: heap of the sidetracks leaving it or its shortest path to dest
+
+  explicit kbest_context(unsigned nStates) : pathGraph(NEW GraphHeap* [nStates]) {
+    for (unsigned i = 0; i < nStates; ++i)
+      pathGraph[i] = 0;  // necessary because we may not have reduced (removed states that aren't
+    // start->state->finish reachable
+    sidetracks.states = 0;
+  }
+  ~kbest_context() {
+    delete[] pathGraph;
+    freeGraph(sidetracks);
+  }
+
+  // sets sidetracks, with room for its arcs' heaps
+  void set_sidetracks(Graph g);
+
+  // called depth first on the reversed shortest path tree from dest, so pathGraph[pred] is built
+  void buildSidetracksHeap(unsigned state, unsigned pred);
+  void operator()(unsigned state, unsigned pred) { buildSidetracksHeap(state, pred); }
+
+  // for newTreeHeapAdd
+  GraphHeap* copy(GraphHeap const& h) { return new (heaps.allocate(sizeof(GraphHeap))) GraphHeap(h); }
+
+ private:
+  node_arena heaps;
+  fixed_array<pGraphArc> arcHeaps;  // each GraphHeap::arcHeap is a slice
+  pGraphArc* arcHeapsEnd;  // of the used slices
+  kbest_context(kbest_context const&);
+  void operator=(kbest_context const&);
+};
+
 void printTree(GraphHeap* t, unsigned n);
 void shortPrintTree(GraphHeap* t);
 
@@ -150,10 +153,6 @@ static inline void untelescope_cost(GraphArc& w, FLOAT_TYPE* dist) {
 
 #ifdef GRAEHL__SINGLE_MAIN
 #include "kbest.cc"
-#else
-extern Graph sidetracks;
-extern GraphHeap** pathGraph;
-extern GraphState* shortPathTree;
 #endif
 
 
@@ -167,7 +166,8 @@ struct best_path_has_cycle : public std::runtime_error {
 };
 
 template <class Visitor>
-void insertShortPath(unsigned src, unsigned dest, Visitor& v, taken_arc_type* cycle_detect = NULL) {
+void insertShortPath(GraphState* shortPathTree, unsigned src, unsigned dest, Visitor& v,
+                     taken_arc_type* cycle_detect = NULL) {
   if (!v.SIDETRACKS_ONLY) {
     if (cycle_detect) cycle_detect->clear();
     GraphArc* taken;
@@ -206,29 +206,23 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
 #ifdef DEBUGKBEST
   Config::debug() << "Shortest path graph (" << src << "->" << dest << "): " << k << '\n' << shortPathGraph;
 #endif
-  shortPathTree = shortPathGraph.states;
+  GraphState* shortPathTree = shortPathGraph.states;
   if (shortPathTree[src].arcs.notEmpty() || dest == src) {
 
     FLOAT_TYPE base_path_cost = dist[src];
     v.start_path(path_no, base_path_cost);
-    insertShortPath(src, dest, v, p_cycle_hash);
+    insertShortPath(shortPathTree, src, dest, v, p_cycle_hash);
     v.end_path();
 
     if (k > 1) {
-      GraphHeap::freeAll();
-      pathGraph = NEW GraphHeap * [nStates];
-      for (unsigned i = 0; i < nStates; ++i)
-        pathGraph[i] = 0;  // necessary because we may not have reduced (removed states that aren't
-      // start->state->finish reachable
-      sidetracks = sidetrackGraph(graph, shortPathGraph, dist);
+      kbest_context context(nStates);
+      GraphHeap** pathGraph = context.pathGraph;
+      context.set_sidetracks(sidetrackGraph(graph, shortPathGraph, dist));
       bool* visited = NEW bool[nStates];
       for (unsigned i = 0; i < nStates; ++i) visited[i] = false;
-      //      freeAllSidetracks();
       Graph revPathTree = reverseGraph(shortPathGraph);
-      depthFirstSearch(revPathTree, dest, visited, buildSidetracksHeap);  // depthFirstSearch recursively
-      // calls the function passed as the
-      // last argument (in this case
-      // "buildSidetracksHeap")
+      depthFirstVisit(revPathTree, dest, DFS_NO_PREDECESSOR, visited, context);  // calls
+      // context.buildSidetracksHeap
       delete[] visited;
 
       if (pathGraph[src]) {
@@ -287,14 +281,14 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
                cut != end; ++cut) {
             GraphArc* cutarc = *cut;
             // stitch end of last sidetrack to beginning of this one:
-            insertShortPath(srcState, cutarc->src, v, p_cycle_hash);
+            insertShortPath(shortPathTree, srcState, cutarc->src, v, p_cycle_hash);
             srcState = cutarc->dest;
             if (!v.SIDETRACKS_ONLY) untelescope_cost(*cutarc, dist);
             v.visit_sidetrack_arc(*cutarc);
             if (!v.SIDETRACKS_ONLY) telescope_cost(*cutarc, dist);
           }
 
-          insertShortPath(srcState, dest, v, p_cycle_hash);  // connect end of last sidetrack to dest state
+          insertShortPath(shortPathTree, srcState, dest, v, p_cycle_hash);  // connect end of last sidetrack to dest state
 
           v.end_path();
 
@@ -353,12 +347,7 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
       } else {
         //                Config::log() << "no more best paths exist.\n";
       }  // end of if (pathGraph[0])
-      GraphHeap::freeAll();  // FIXME: global
-      freeAllSidetracks();  // FIXME: global
-
-      delete[] pathGraph;
       freeGraph(revPathTree);
-      freeGraph(sidetracks);
     }  // end of if (k > 1)
   }
 
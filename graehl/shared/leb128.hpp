@@ -13,7 +13,7 @@
 // limitations under the License.
 /** \file
 
-    Little-Endian base-128 encoding of unsignedeger types
+    Little-Endian base-128 encoding of unsigned integer types
 
     in LEB128 you have a sequence of bytes starting least significant, except
     the bytes only hold 7 bits of info. the high byte (128) is 0 if no more
@@ -43,11 +43,10 @@ typedef byte* byteptr;
 template <class Uint>
 const_byteptr decode_leb128(Uint& result, const_byteptr p) {
   Uint x = 0;
-  for (;;) {
+  for (unsigned shift = 0;; shift += 7) {
     byte const c = *p;
     byte const sig = c & 0x7f;
-    x <<= 7;
-    x |= sig;
+    x |= (Uint)sig << shift;
     ++p;
     if (c == sig) {
       result = x;
@@ -58,19 +57,17 @@ const_byteptr decode_leb128(Uint& result, const_byteptr p) {
 
 template <class Uint>
 const_byteptr decode_leb128(Uint& result, const_byteptr p, const_byteptr end) {
-  // TODO: test
   Uint x = 0;
-  for (;;) {
+  for (unsigned shift = 0;; shift += 7) {
+    if (p == end) throw leb128error();
     byte const c = *p;
     byte const sig = c & 0x7f;
-    x <<= 7;
-    x |= sig;
+    x |= (Uint)sig << shift;
     ++p;
     if (c == sig) {
       result = x;
       return p;
     }
-    if (p == end) throw leb128error();
   }
 }
 
@@ -82,7 +79,6 @@ unsigned leb128_max_bytes(Uint) {
 
 template <class Uint>
 byteptr encode_leb128(byteptr p, Uint x) {
-  // TODO: test
   for (;;) {
     byte c = x;
     x >>= 7;
@@ -96,11 +92,19 @@ byteptr encode_leb128(byteptr p, Uint x) {
 }
 
 template <class Uint>
-byteptr encode_leb128(byteptr p, byteptr e, Uint x) {
+byteptr encode_leb128(byteptr p, const_byteptr e, Uint x) {
   if (leb128_max_bytes(x) + p > e) throw leb128error();
   return encode_leb128(p, x);
 }
 
+/// signed as unsigned so that small magnitudes stay small (0, -1, 1, -2 -> 0, 1, 2, 3) for encode_leb128
+inline unsigned zigzag_encode(int x) {
+  return ((unsigned)x << 1) ^ (unsigned)(x >> 31);
+}
+inline int zigzag_decode(unsigned u) {
+  return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
 template <class Uint>
 struct leb128_codec {
   typedef Uint value_type;
@@ -109,8 +113,8 @@ struct leb128_codec {
   static const_byteptr decode(Uint& x, const_byteptr p, const_byteptr end) {
     return decode_leb128(x, p, end);
   }
-  static byteptr encode(byteptr p, Uint x) { return encode_leb128(x, p); }
-  static byteptr encode(byteptr p, const_byteptr end, Uint x) { return encode_leb128(x, p, end); }
+  static byteptr encode(byteptr p, Uint x) { return encode_leb128(p, x); }
+  static byteptr encode(byteptr p, const_byteptr end, Uint x) { return encode_leb128(p, end, x); }
 };
 
 template <class Uint>
@@ -337,6 +341,24 @@ typedef codec_dynamic<leb128_size_t> leb128_size_t_dynamic;
 typedef codec_dynamic<identity_unsigned> identity_unsigned_dynamic;
 typedef codec_dynamic<identity_size_t> identity_size_t_dynamic;
 
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(test_leb128) {
+  byte buf[64];
+  unsigned xs[] = {0, 1, 127, 128, 300, 16384, 0xffffffffu};
+  byteptr p = buf;
+  for (unsigned i = 0; i < 7; ++i) p = leb128_unsigned::encode(p, buf + 64, xs[i]);
+  BOOST_CHECK_EQUAL(p - buf, 1 + 1 + 1 + 2 + 2 + 3 + 5);
+  const_byteptr q = buf;
+  for (unsigned i = 0; i < 7; ++i) {
+    unsigned x;
+    q = decode_leb128(x, q, p);
+    BOOST_CHECK_EQUAL(x, xs[i]);
+  }
+  for (int i = -3; i <= 3; ++i) BOOST_CHECK_EQUAL(zigzag_decode(zigzag_encode(i)), i);
+  BOOST_CHECK_EQUAL(zigzag_encode(-1), 1u);
+}
+#endif
+
 
 }
 
@@ -126,6 +126,16 @@ class List : public STL_LIST<T, A> {
   void pop() {
     this->pop_front();
   }
+  /// for an empty list: nodes come from a from now on
+  void use_allocator(A const& a) {
+#ifdef USE_SLIST
+    assert(this->empty());
+    this->allocator() = typename S::allocator_type(a);
+#else
+    S tmp(a);
+    S::swap(tmp);
+#endif
+  }
 #ifndef USE_SLIST
 
   template <class T0>
@@ -0,0 +1,116 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    lru_cache: a map of at most capacity entries; inserting into a full one forgets the least recently used.
+    unlike hash_cache and dynamic_hash_cache (direct mapped, so two recurring keys that collide evict each
+    other), any key seen recently enough stays.  not thread safe.
+*/
+
+#ifndef GRAEHL_SHARED__LRU_CACHE_HPP
+#define GRAEHL_SHARED__LRU_CACHE_HPP
+
+#include <graehl/shared/unordered.hpp>
+#include <graehl/shared/percent.hpp>
+#include <boost/functional/hash.hpp>
+#include <cstddef>
+#include <list>
+#include <utility>
+
+namespace graehl {
+
+template <class Key, class Val, class Hash = boost::hash<Key> >
+struct lru_cache {
+  typedef std::pair<Key, Val> entry;
+  typedef std::list<entry> entries;  // most recently used first
+  typedef unordered_map<Key, typename entries::iterator, Hash> index_type;
+
+  explicit lru_cache(std::size_t capacity = 10000) : n_hit(0), n_miss(0), cap(capacity ? capacity : 1) {}
+
+  /// NULL (a miss) if key isn't cached; else (a hit) its value, now the most recently used
+  Val const* find(Key const& key) {
+    typename index_type::iterator i = index.find(key);
+    if (i == index.end()) {
+      ++n_miss;
+      return 0;
+    }
+    ++n_hit;
+    lru.splice(lru.begin(), lru, i->second);
+    return &i->second->second;
+  }
+
+  /// replaces any value already cached for key
+  void insert(Key const& key, Val const& val) {
+    typename index_type::iterator i = index.find(key);
+    if (i != index.end()) {
+      i->second->second = val;
+      lru.splice(lru.begin(), lru, i->second);
+      return;
+    }
+    if (index.size() >= cap) {
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+    lru.push_front(entry(key, val));
+    index[key] = lru.begin();
+  }
+
+  std::size_t size() const { return index.size(); }
+  std::size_t capacity() const { return cap; }
+  void set_capacity(std::size_t capacity) {
+    cap = capacity ? capacity : 1;
+    while (index.size() > cap) {
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+
+  std::size_t n_hit, n_miss;
+  double n_queries() const { return (double)n_hit + (double)n_miss; }
+  // [0...1] portion of finds that hit
+  double hit_rate() const { return n_queries() ? n_hit / n_queries() : 0; }
+
+  template <class O>
+  void stats(O& o) const {
+    o << " (cache capacity=" << capacity() << " hit rate=" << percent<4>(hit_rate()) << " hits=" << n_hit
+      << " misses=" << n_miss << ")";
+  }
+
+ private:
+  std::size_t cap;
+  entries lru;
+  index_type index;
+  lru_cache(lru_cache const&);  // index points into lru
+  void operator=(lru_cache const&);
+};
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(test_lru_cache) {
+  lru_cache<int, int> c(2);
+  c.insert(1, 10);
+  c.insert(2, 20);
+  BOOST_CHECK(c.find(1) && *c.find(1) == 10);  // 1 is now the most recent
+  c.insert(3, 30);  // evicts 2
+  BOOST_CHECK(!c.find(2));
+  BOOST_CHECK(c.find(3) && *c.find(3) == 30);
+  BOOST_CHECK(c.find(1));
+  BOOST_CHECK_EQUAL(c.size(), 2u);
+  BOOST_CHECK_EQUAL(c.n_miss, 1u);
+}
+#endif
+
+
+}
+
+#endif
@@ -38,7 +38,9 @@
 // Lowering this value reduces memory usage
 // Reduced memory usage typically improves speed, due to cache effect (ex : L1 32KB for Intel, L1 64KB for AMD)
 // Memory usage formula : N->2^(N+2) Bytes (examples : 12 -> 16KB ; 17 -> 512KB)
+#ifndef LZ4_COMPRESSIONLEVEL
 #define LZ4_COMPRESSIONLEVEL 12
+#endif
 
 // LZ4_NOTCOMPRESSIBLE_CONFIRMATION :
 // Decreasing this value will make the algorithm skip faster data segments considered "incompressible"
@@ -73,7 +75,12 @@
 #endif
 
 // Little Endian or Big Endian ?
-#if (defined(__BIG_ENDIAN__) || defined(__BIG_ENDIAN) || defined(_BIG_ENDIAN) || defined(_ARCH_PPC) || defined(__PPC__) || defined(__PPC) || defined(PPC) || defined(__powerpc__) || defined(__powerpc) || defined(powerpc) || ((defined(__BYTE_ORDER__)&&(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))) )
+// (glibc's <endian.h> defines __BIG_ENDIAN on every cpu, so trust __BYTE_ORDER__ when the compiler has it)
+#if defined(__BYTE_ORDER__)
+#if (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define LZ4_BIG_ENDIAN 1
+#endif
+#elif (defined(__BIG_ENDIAN__) || defined(__BIG_ENDIAN) || defined(_BIG_ENDIAN) || defined(_ARCH_PPC) || defined(__PPC__) || defined(__PPC) || defined(PPC) || defined(__powerpc__) || defined(__powerpc) || defined(powerpc))
 #define LZ4_BIG_ENDIAN 1
 #else
 // Little Endian assumed. PDP Endian and other very rare endian format are unsupported.
@@ -679,7 +686,7 @@ int LZ4_uncompress(const char* source,
 
 		// get offset
 		LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
-		if (ref < (BYTE* const)dest) goto _output_error;
+		if (ref < (BYTE*)dest) goto _output_error;
 
 		// get matchlength
 		if ((length=(token&LZ4_ML_MASK)) == LZ4_ML_MASK) { for (;*ip==255;length+=255) {ip++;} length += *ip++; }
@@ -688,7 +695,7 @@ int LZ4_uncompress(const char* source,
 		if unlikely(op-ref<LZ4_STEPSIZE)
 		{
 #if LZ4_ARCH64
-			size_t dec2table[]={0, 0, 0, -1, 0, 1, 2, 3};
+			size_t dec2table[]={0, 0, 0, (size_t)-1, 0, 1, 2, 3};
 			size_t dec2 = dec2table[op-ref];
 #else
 			const int dec2 = 0;
@@ -768,7 +775,7 @@ int LZ4_uncompress_unknownOutputSize(
 
 		// get offset
 		LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
-		if (ref < (BYTE* const)dest) goto _output_error;
+		if (ref < (BYTE*)dest) goto _output_error;
 
 		// get matchlength
 		if ((length=(token&LZ4_ML_MASK)) == LZ4_ML_MASK) { while (ip<iend) { int s = *ip++; length +=s; if (s==255) continue; break; } }
@@ -777,7 +784,7 @@ int LZ4_uncompress_unknownOutputSize(
 		if unlikely(op-ref<LZ4_STEPSIZE)
 		{
 #if LZ4_ARCH64
-			size_t dec2table[]={0, 0, 0, -1, 0, 1, 2, 3};
+			size_t dec2table[]={0, 0, 0, (size_t)-1, 0, 1, 2, 3};
 			size_t dec2 = dec2table[op-ref];
 #else
 			const int dec2 = 0;
@@ -15,6 +15,8 @@
 #define GRAEHL__SHARED__LZ4_H
 #pragma once
 
+// the definitions (lz4.c) go in exactly one translation unit: the GRAEHL__SINGLE_MAIN one, or with LZ4__INLINE=1.
+// build with -DLZ4_COMPRESSIONLEVEL=N (default 12) to trade memory for compression ratio
 #ifndef LZ4__INLINE
 #if defined(GRAEHL__SINGLE_MAIN)
 #define LZ4__INLINE 1
@@ -23,8 +25,18 @@
 #endif
 #endif
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 namespace lz4 {
+#if LZ4__INLINE
 #include "lz4.c"
+#undef expect
+#undef likely
+#undef unlikely
+#undef restrict
+#endif
 #include "lz4.h"
 
 
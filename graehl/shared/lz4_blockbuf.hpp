@@ -0,0 +1,166 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    lz4_blockbuf: a streambuf that lz4-compresses what's written to it, a block (of block_size bytes, except
+    the last) at a time, onto another (seekable) streambuf, and decompresses the blocks again when reading.
+    each block is its size and stored size (native uint32), then the stored bytes, which are the uncompressed
+    ones if lz4 didn't make them smaller.  for a file that's written, then rewound and read (maybe many times),
+    then maybe written again from the start - not read and written at once.  (serialize_batch's disk cache)
+
+    stats: bytes before and after compression, and seconds spent in lz4 and in the underlying streambuf's I/O.
+*/
+
+#ifndef GRAEHL_SHARED__LZ4_BLOCKBUF_HPP
+#define GRAEHL_SHARED__LZ4_BLOCKBUF_HPP
+
+#include <graehl/shared/lz4.hpp>
+#include <graehl/shared/monotonic_time.hpp>
+#include <cstddef>
+#include <cstring>
+#include <streambuf>
+#include <vector>
+#include <ostream>
+
+namespace graehl {
+
+struct lz4_block_stats {
+  std::size_t blocks;
+  double bytes, stored_bytes;
+  double io_sec, lz4_sec;
+  lz4_block_stats() { clear(); }
+  void clear() {
+    blocks = 0;
+    bytes = stored_bytes = io_sec = lz4_sec = 0;
+  }
+  void add(std::size_t n, std::size_t stored, double io, double lz4) {
+    ++blocks;
+    bytes += n;
+    stored_bytes += stored;
+    io_sec += io;
+    lz4_sec += lz4;
+  }
+  void print(std::ostream& o) const {
+    o << blocks << " lz4 blocks, " << bytes * 1e-6 << " MB compressed to " << stored_bytes * 1e-6 << " MB; "
+      << io_sec << " sec I/O, " << lz4_sec << " sec lz4";
+  }
+  friend std::ostream& operator<<(std::ostream& o, lz4_block_stats const& s) {
+    s.print(o);
+    return o;
+  }
+};
+
+class lz4_blockbuf : public std::streambuf {
+  std::streambuf* under;
+  std::size_t block;
+  std::vector<char> raw;  // the put area while writing, get area while reading
+  std::vector<char> stored;
+  typedef unsigned header[2];  // size, stored size
+  lz4_blockbuf(lz4_blockbuf const&);
+  void operator=(lz4_blockbuf const&);
+
+  char* raw_begin() { return &raw[0]; }
+  bool write_block() {
+    std::size_t n = pptr() - pbase();
+    if (!n) return true;
+    double t0 = monotonic_time();
+    int z = lz4::LZ4_compress(pbase(), &stored[0], (int)n);
+    double t1 = monotonic_time();
+    char const* out = &stored[0];
+    if (z <= 0 || (std::size_t)z >= n) {
+      z = (int)n;
+      out = pbase();
+    }
+    header h = {(unsigned)n, (unsigned)z};
+    bool ok = under->sputn((char const*)h, sizeof(h)) == (std::streamsize)sizeof(h)
+              && under->sputn(out, z) == (std::streamsize)z;
+    write_stats.add(n, sizeof(h) + z, monotonic_time() - t1, t1 - t0);
+    setp(raw_begin(), raw_begin() + block);
+    return ok;
+  }
+
+ protected:
+  int overflow(int c) {
+    if (!pbase()) setp(raw_begin(), raw_begin() + block);  // done reading
+    if (!write_block()) return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() { return write_block() && under->pubsync() == 0 ? 0 : -1; }
+
+  int_type underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (pbase()) {  // done writing
+      if (!write_block()) return traits_type::eof();
+      setp(0, 0);
+    }
+    double t0 = monotonic_time();
+    header h;
+    if (under->sgetn((char*)h, sizeof(h)) != (std::streamsize)sizeof(h)) return traits_type::eof();
+    std::size_t n = h[0], z = h[1];
+    if (n > block || z > stored.size() || under->sgetn(&stored[0], z) != (std::streamsize)z)
+      return traits_type::eof();
+    double t1 = monotonic_time();
+    if (z == n)
+      std::memcpy(raw_begin(), &stored[0], n);
+    else if (lz4::LZ4_uncompress(&stored[0], raw_begin(), (int)n) != (int)z)
+      return traits_type::eof();
+    read_stats.add(n, sizeof(h) + z, t1 - t0, monotonic_time() - t1);
+    setg(raw_begin(), raw_begin(), raw_begin() + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+ public:
+  lz4_block_stats read_stats, write_stats;
+
+  /// block_size 0: not used
+  explicit lz4_blockbuf(std::size_t block_size = 1024 * 1024) : under() {
+    block = block_size;
+    if (!block) return;
+    if (block < 4096) block = 4096;
+    if (block > (1u << 30)) block = 1u << 30;
+    raw.resize(block);
+    stored.resize(lz4::LZ4_compressBound((int)block));
+    setp(raw_begin(), raw_begin() + block);
+  }
+
+  std::size_t block_size() const { return block; }
+
+  /// compressed blocks are written to (and read from) under
+  void attach(std::streambuf* under_) { under = under_; }
+
+  /// (after writing any partial block) read from the start
+  bool rewind() {
+    bool ok = !pbase() || write_block();
+    setp(0, 0);
+    setg(raw_begin(), raw_begin(), raw_begin());
+    return under->pubseekpos(0) == std::streampos(0) && ok;
+  }
+
+  /// write from the start (over anything there)
+  bool restart_write() {
+    setg(0, 0, 0);
+    setp(raw_begin(), raw_begin() + block);
+    return under->pubseekpos(0) == std::streampos(0);
+  }
+};
+
+
+}
+
+#endif
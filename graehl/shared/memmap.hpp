@@ -149,10 +149,13 @@ struct mapped_file : boost::noncopyable {
     open(path, mode, length, offset, create, old_base, false);
   }
 
+  // copy_on_write: read+write (mode is ignored), but private: the file and other processes never see the
+  // writes, and the pages stay shared until they're written
   void open( const std::string& path,
              std::ios::openmode mode = std::ios::in | std::ios::out,
              size_type length = max_length, boost::intmax_t offset =0,
-             bool create = true, void *base_address = NULL, bool flexible_base = false)
+             bool create = true, void *base_address = NULL, bool flexible_base = false,
+             bool copy_on_write = false)
   {
     using std::ios;
     DBP_ADD_VERBOSE(1);
@@ -163,7 +166,9 @@ struct mapped_file : boost::noncopyable {
       // can't really do this because when we memmap with NULL (OS chooses), it gives us things that aren't aligned (alignment() is buggy)
     }
     bool readonly = (mode & ios::out) == 0;
-    if (readonly)
+    if (copy_on_write)
+      readonly = false;
+    if (readonly || copy_on_write)
       create = false;
     using namespace std;
 
@@ -180,7 +185,7 @@ struct mapped_file : boost::noncopyable {
 
     handle_ =
         ::CreateFileA( path.c_str(),
-                       readonly ? GENERIC_READ : GENERIC_ALL,
+                       readonly || copy_on_write ? GENERIC_READ : GENERIC_ALL,
                        FILE_SHARE_DELETE, NULL, (create ? CREATE_ALWAYS : OPEN_EXISTING ), FILE_ATTRIBUTE_TEMPORARY, NULL );
     if (handle_ == INVALID_HANDLE_VALUE)
       throw ios::failure(string("couldn't open ").append(path).append(": ").append(last_error_string()));
@@ -208,7 +213,7 @@ struct mapped_file : boost::noncopyable {
 
     mapped_handle_ =
         ::CreateFileMappingA( handle_, NULL,
-                              readonly? PAGE_READONLY : PAGE_READWRITE,
+                              readonly? PAGE_READONLY : copy_on_write ? PAGE_WRITECOPY : PAGE_READWRITE,
                               0, 0, path.c_str() );
     if (mapped_handle_ == NULL) {
       ::CloseHandle(handle_);
@@ -219,7 +224,7 @@ struct mapped_file : boost::noncopyable {
  again:
     void* data =
         ::MapViewOfFileEx( mapped_handle_,
-                           readonly ? FILE_MAP_READ : FILE_MAP_WRITE,
+                           readonly ? FILE_MAP_READ : copy_on_write ? FILE_MAP_COPY : FILE_MAP_WRITE,
                            (DWORD) (offset >> (sizeof(DWORD) * 8)),
                            (DWORD) (offset & 0xffffffff),
                            length != max_length ? length : 0, base_address );
@@ -257,7 +262,7 @@ struct mapped_file : boost::noncopyable {
 
     //--------------Open underlying file--------------------------------------//
 
-    int flags = (readonly? O_RDONLY : O_RDWR);
+    int flags = (readonly || copy_on_write ? O_RDONLY : O_RDWR);
     if (create)
       flags |= (O_CREAT | O_TRUNC);
     //            DBP2(path,flags);
@@ -296,7 +301,7 @@ struct mapped_file : boost::noncopyable {
 #ifdef MAP_FILE
                          MAP_FILE|
 #endif
-                         MAP_SHARED|(base_address ? MAP_FIXED : 0),
+                         (copy_on_write ? MAP_PRIVATE : MAP_SHARED)|(base_address ? MAP_FIXED : 0),
                          handle_, offset );
     if (data == MAP_FAILED) {
       if (base_address && flexible_base) {
@@ -0,0 +1,146 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    node_arena: fixed-size (list) nodes for one owner, carved out of blocks that double in size up to a limit,
+    with freed nodes recycled.  the blocks go back to the heap all at once, when the arena is cleared or
+    destroyed.
+
+    arena_allocator<T>: a std allocator drawing single nodes from a node_arena.  a default constructed one
+    (no arena) is plain new/delete, and so is a copy-constructed container's, so only containers explicitly
+    given an arena (List::use_allocator) ever hold arena nodes.  not thread safe: an arena belongs to one
+    owner, which is built by one thread.
+*/
+
+#ifndef GRAEHL_SHARED__NODE_ARENA_HPP
+#define GRAEHL_SHARED__NODE_ARENA_HPP
+
+#include <graehl/shared/myassert.h>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace graehl {
+
+class node_arena {
+  union unit {  // alignment for any node
+    void* p;
+    double d;
+    long long i;
+  };
+  enum { first_block_nodes = 16, max_block_nodes = 4096 };  // small owners stay small
+  std::vector<unit*> blocks;
+  unit* top;  // [top, end) is unused in blocks.back()
+  unit* end;
+  std::size_t node_units;  // set by the first allocate
+  std::size_t next_block_nodes;
+  void* free_nodes;  // each points to the next
+  node_arena(node_arena const&);
+  void operator=(node_arena const&);
+
+  void new_block() {
+    std::size_t n = next_block_nodes * node_units;
+    top = (unit*)::operator new(n * sizeof(unit));
+    blocks.push_back(top);
+    end = top + n;
+    if (next_block_nodes < max_block_nodes) next_block_nodes *= 2;
+  }
+
+ public:
+  node_arena() : top(0), end(0), node_units(0), next_block_nodes(first_block_nodes), free_nodes(0) {}
+  ~node_arena() { clear(); }
+
+  /// every allocation from one arena must have the same size
+  void* allocate(std::size_t bytes) {
+    if (free_nodes) {
+      void* r = free_nodes;
+      free_nodes = *(void**)r;
+      return r;
+    }
+    std::size_t units = (bytes + sizeof(unit) - 1) / sizeof(unit);
+    if (!node_units) node_units = units;
+    Assert(units == node_units);
+    if (top == end) new_block();
+    void* r = top;
+    top += node_units;
+    return r;
+  }
+  void deallocate(void* p) {
+    *(void**)p = free_nodes;
+    free_nodes = p;
+  }
+
+  /// only once nothing allocated from here is still in use
+  void clear() {
+    for (std::size_t i = 0, n = blocks.size(); i < n; ++i) ::operator delete((void*)blocks[i]);
+    blocks.clear();
+    top = end = 0;
+    node_units = 0;
+    next_block_nodes = first_block_nodes;
+    free_nodes = 0;
+  }
+};
+
+template <class T>
+struct arena_allocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef T const* const_pointer;
+  typedef T& reference;
+  typedef T const& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  template <class U>
+  struct rebind {
+    typedef arena_allocator<U> other;
+  };
+  // lists swapped together keep their nodes' arenas
+  typedef std::true_type propagate_on_container_swap;
+
+  node_arena* arena;  // NULL: new/delete
+
+  arena_allocator(node_arena* arena = 0) : arena(arena) {}
+  template <class U>
+  arena_allocator(arena_allocator<U> const& o) : arena(o.arena) {}
+
+  arena_allocator select_on_container_copy_construction() const { return arena_allocator(); }
+
+  T* allocate(size_type n, void const* = 0) {
+    if (arena && n == 1) return (T*)arena->allocate(sizeof(T));
+    return (T*)::operator new(n * sizeof(T));
+  }
+  void deallocate(T* p, size_type n) {
+    if (arena && n == 1)
+      arena->deallocate(p);
+    else
+      ::operator delete((void*)p);
+  }
+
+  size_type max_size() const { return size_type(-1) / sizeof(T); }
+};
+
+template <class T, class U>
+inline bool operator==(arena_allocator<T> const& a, arena_allocator<U> const& b) {
+  return a.arena == b.arena;
+}
+template <class T, class U>
+inline bool operator!=(arena_allocator<T> const& a, arena_allocator<U> const& b) {
+  return a.arena != b.arena;
+}
+
+
+}
+
+#endif
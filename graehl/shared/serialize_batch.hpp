@@ -16,10 +16,20 @@
 #define GRAEHL_SHARED__SERIALIZE_BATCH_HPP
 
 #include <graehl/shared/large_streambuf.hpp>
+#include <graehl/shared/lz4_blockbuf.hpp>
 #include <graehl/shared/simple_serialize.hpp>
 #include <graehl/shared/dynamic_array.hpp>
 //#include <graehl/shared/stream_util.hpp>
 #include <boost/config.hpp>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace graehl {
 
@@ -31,6 +41,14 @@ namespace graehl {
 
   * without caching; then the items are built and held in memory, and later enumerated, by the same interface
 
+  * with an empty cache filename: as with a file, but the serialized records are kept in memory instead
+  (smaller than the items, if their serialize is compact)
+
+  with a file (or in memory), set_read_ahead(n) has a thread deserialize up to n records ahead of the one
+  being used, so reading (and decompressing) overlaps with whatever's done with each record
+
+  with a file (or in memory), lz4_block (bytes) compresses the file a block at a time (see lz4_blockbuf)
+
   cursor semantics, so not intended to be multi-thread safe, though we could achieve that in the future with separate read-file-iterators
 
 */
@@ -66,6 +84,9 @@ struct serialize_batch {
   bool use_file;
   std::string filename;
   std::fstream f;
+  std::stringbuf mem; // instead of f if filename is empty
+  lz4_blockbuf lz4buf;
+  std::iostream io; // f (or mem), or lz4buf over that
   istream_archive ia;
   ostream_archive oa;
   bool delete_file; // if true, filename is deleted on destruction
@@ -74,7 +95,7 @@ struct serialize_batch {
   value_type current_from_f;
 
   // if !use_file
-  typedef dynamic_array<value_type> A; //FIXME: use slist?  because POD-move might be bad for some people (even though serialize works fine)
+  typedef std::vector<value_type> A; // so value_type must be movable (it isn't relocated by memcpy)
   typedef typename A::iterator AI;
   A store;
   AI store_cursor;
@@ -84,19 +105,113 @@ struct serialize_batch {
 
   size_t total_items;
 
+  // read-ahead (if n_ahead): the reader thread fills ring[n_read % n_ahead] while fewer than n_ahead slots
+  // (including current(), the last one advanced to) haven't been released by the next advance().  once the
+  // ring is full it waits for half to be released, so small records don't cost a thread switch each
+  unsigned n_ahead;
+  std::unique_ptr<value_type[]> ring;
+  std::size_t n_read, n_used, n_released;
+  bool reader_done, reader_stop, reader_waiting, user_waiting;
+  std::exception_ptr reader_error;
+  std::thread reader;
+  std::mutex ring_mutex;
+  std::condition_variable ring_filled, ring_emptied;
+
+  bool read_record(value_type &v)
+  {
+    unsigned header;
+    ia >> header;
+    if (header==END_RECORDS)
+      return false;
+    else if (header==RECORD_FOLLOWS) {
+      ia >> v;
+      return true;
+    } else
+      throw serialize_batch_error();
+  }
+
+  void read_ahead()
+  {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(ring_mutex);
+        if (n_read - n_released >= n_ahead) {
+          reader_waiting = true;
+          while (n_read - n_released > n_ahead / 2 && !reader_stop) ring_emptied.wait(lock);
+          reader_waiting = false;
+        }
+        if (reader_stop) return;
+      }
+      bool more = false;
+      try {
+        more = read_record(ring[n_read % n_ahead]);
+      } catch (...) {
+        reader_error = std::current_exception();
+      }
+      bool wake;
+      {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        if (more)
+          ++n_read;
+        else
+          reader_done = true;
+        wake = user_waiting;
+      }
+      if (wake) ring_filled.notify_one();
+      if (!more) return;
+    }
+  }
+
+  void start_reader()
+  {
+    n_read = n_used = n_released = 0;
+    reader_done = reader_stop = reader_waiting = user_waiting = false;
+    reader_error = std::exception_ptr();
+    reader = std::thread(&self_type::read_ahead, this);
+  }
+
+  void stop_reader()
+  {
+    if (!reader.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(ring_mutex);
+      reader_stop = true;
+    }
+    ring_emptied.notify_one();
+    reader.join();
+  }
+
+  bool advance_ring()
+  {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    if (n_used > n_released) {
+      ++n_released;
+      if (reader_waiting && n_read - n_released <= n_ahead / 2) ring_emptied.notify_one();
+    }
+    if (n_read == n_used && !reader_done) {
+      user_waiting = true;
+      do ring_filled.wait(lock); while (n_read == n_used && !reader_done);
+      user_waiting = false;
+    }
+    if (n_read == n_used) {
+      if (reader_error) std::rethrow_exception(reader_error);
+      return false;
+    }
+    ++n_used;
+    return true;
+  }
+
   bool advance()
   {
     if (use_file) {
-      unsigned header;
-      ia >> header;
-      if (header==END_RECORDS)
-        return false;
-      else if (header==RECORD_FOLLOWS) {
+      if (n_ahead) {
+        if (!advance_ring()) return false;
         ++current_i;
-        ia >> current_from_f;
         return true;
-      } else
-        throw serialize_batch_error();
+      }
+      if (!read_record(current_from_f)) return false;
+      ++current_i;
+      return true;
     } else {
       if (rewind_store) {
         rewind_store = false;
@@ -119,9 +234,15 @@ struct serialize_batch {
   void rewind()
   {
     current_i = (unsigned)-1;
-    if (use_file)
-      f.seekg(0, std::ios::beg);
-    else
+    if (use_file) {
+      stop_reader();
+      if (compressed())
+        lz4buf.rewind();
+      else
+        io.seekg(0, std::ios::beg);
+      io.clear();
+      if (n_ahead) start_reader();
+    } else
       rewind_store = true;
   }
 
@@ -129,7 +250,7 @@ struct serialize_batch {
   value_type &current()
   {
     if (use_file)
-      return current_from_f;
+      return n_ahead ? ring[(n_used - 1) % n_ahead] : current_from_f;
     else
       return *store_cursor;
   }
@@ -155,7 +276,30 @@ struct serialize_batch {
 
   std::string stored_in() const
   {
-    return use_file ? filename : "memory";
+    return !use_file ? "memory" : in_memory() ? "memory (serialized)" : filename;
+  }
+
+  bool in_memory() const {
+    return use_file && filename.empty();
+  }
+
+  /// size of the serialized records (after compression, if any); valid after mark_end
+  double stored_bytes() {
+    if (!use_file) return 0;
+    std::streambuf* under = in_memory() ? (std::streambuf*)&mem : f.rdbuf();
+    return (double)under->pubseekoff(0, std::ios::cur, std::ios::out);
+  }
+
+  /// n records (at least 2 if any) are read in a thread ahead of current().  only for a file (or in memory)
+  void set_read_ahead(unsigned n)
+  {
+    stop_reader();
+    n_ahead = use_file && n ? (n < 2 ? 2 : n) : 0;
+    ring.reset(n_ahead ? new value_type[n_ahead] : 0);
+  }
+
+  bool compressed() const {
+    return use_file && lz4buf.block_size();
   }
 
   void print_stats(std::ostream &out) const {
@@ -182,10 +326,11 @@ struct serialize_batch {
   }
 
   // large_bufsize = # of bytes for own fstream buffer, recommend 64*1024*1024
-  serialize_batch(bool use_file_, const std::string &filename_, bool delete_file_ = true, std::size_t large_bufsize = 0)
-      : ia(f), oa(f), delete_file(delete_file_), buf(use_file_?large_bufsize:0)
+  serialize_batch(bool use_file_, const std::string &filename_, bool delete_file_ = true, std::size_t large_bufsize = 0, std::size_t lz4_block = 0)
+      : lz4buf(use_file_?lz4_block:0), io(f.rdbuf()), ia(io), oa(io), delete_file(delete_file_), buf(use_file_ && !filename_.empty()?large_bufsize:0)
   {
     total_items = 0;
+    n_ahead = 0;
     if (use_file_)
       init_file(filename_);
     else
@@ -194,15 +339,25 @@ struct serialize_batch {
 
   void init_file(std::string const& fn) {
     use_file = true;
-    filename = maybe_tmpnam(fn);
-    buf.attach_to_stream(f);
-    f.open(filename.c_str(), ios::in|ios::out|ios::trunc|ios::binary);
-    if (!f.is_open())
-      throw serialize_batch_error();
+    std::streambuf* under = &mem;
+    if (!fn.empty()) {
+      filename = maybe_tmpnam(fn);
+      buf.attach_to_stream(f);
+      f.open(filename.c_str(), ios::in|ios::out|ios::trunc|ios::binary);
+      if (!f.is_open())
+        throw serialize_batch_error();
+      under = f.rdbuf();
+    }
+    if (compressed()) {
+      lz4buf.attach(under);
+      io.rdbuf(&lz4buf);
+    } else
+      io.rdbuf(under);
   }
 
   ~serialize_batch() {
-    if (use_file && delete_file) {
+    stop_reader();
+    if (use_file && delete_file && !in_memory()) {
       safe_unlink(filename, false);
     }
   }
@@ -223,7 +378,12 @@ struct serialize_batch {
   void clear()
   {
     if (use_file) {
-      f.seekp(0, std::ios::beg);
+      stop_reader();
+      if (compressed())
+        lz4buf.restart_write();
+      else
+        io.seekp(0, std::ios::beg);
+      io.clear();
     } else {
       store.clear();
     }
@@ -235,7 +395,7 @@ struct serialize_batch {
     if (use_file)
       return current_from_f;
     else {
-      store.push_back();
+      store.emplace_back();
       return store.back();
     }
   }
@@ -256,13 +416,53 @@ struct serialize_batch {
       store.pop_back();
   }
 
+  /* or, for items built elsewhere (e.g. by other threads), in place of start_new ... keep_new:
+
+     with a file, batch.keep(v) for each item to keep (v is saved, not held)
+
+     in memory, value_type *v = batch.start_n_new(n), then (once v[0...n) are built)
+     batch.drop_marked(drop) to remove those with drop[i] (of all the items, which for an index into v
+     should be none before it)
+  */
+  void keep(value_type &v)
+  {
+    assert(use_file);
+    ++total_items;
+    unsigned header = RECORD_FOLLOWS;
+    oa << header;
+    oa << v;
+  }
+
+  value_type *start_n_new(size_type n)
+  {
+    assert(!use_file);
+    size_type b = store.size();
+    store.reserve(b + n);
+    for (size_type i = 0; i < n; ++i) store.emplace_back();
+    total_items += n;
+    return store.data() + b;
+  }
+
+  void drop_marked(bool drop[])
+  {
+    assert(!use_file);
+    size_type f = 0;
+    for (size_type i = 0, n = store.size(); i < n; ++i)
+      if (!drop[i]) {
+        if (f != i) store[f] = std::move(store[i]);
+        ++f;
+      }
+    store.erase(store.begin() + f, store.end());
+    total_items = store.size();
+  }
+
   // no more calling start_new() after this, until clear()
   void mark_end()
   {
     if (use_file) {
       unsigned header = END_RECORDS;
       oa << header;
-      f.flush();
+      io.flush();
     }
   }
 
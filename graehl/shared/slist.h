@@ -517,6 +517,7 @@ class slist_shared :
   void swap(self_type& x)
   {
     std::swap(head, x.head);
+    std::swap(allocator(), x.allocator()); // nodes stay with the allocator they came from
   }
 
   // default operator =: shallow
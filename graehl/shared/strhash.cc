@@ -30,6 +30,7 @@ void dump_ht(HashTable<StringKey, unsigned> &ht)
 
 #ifdef STRINGPOOL
 HashTable<StringKey, unsigned> StringPool::counts;
+std::mutex StringPool::counts_mutex;
 
 #endif
 
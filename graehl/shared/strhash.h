@@ -24,6 +24,9 @@
 
 #include <graehl/shared/stringkey.h>
 #include <boost/config.hpp>
+#ifdef STRINGPOOL
+#include <mutex>
+#endif
 
 #ifdef GRAEHL_TEST
 #include <graehl/shared/test.hpp>
@@ -36,12 +39,14 @@ class StringPool {
 
 #ifdef STRINGPOOL
   static HT counts;
+  static std::mutex counts_mutex;  // alphabets may be built and destroyed by several threads at once
 #endif
  public:
   BOOST_STATIC_CONSTANT(bool, is_noop = 0);
   static StringKey borrow(StringKey s) {
     if (s.isDefault()) return s;
 #ifdef STRINGPOOL
+    std::lock_guard<std::mutex> lock(counts_mutex);
     hash_traits<HT>::insert_result_type i = counts.insert(HT::value_type(s, 1));
     StringKey& canonical = const_cast<StringKey&>(i.first->first);
     if (i.second)
@@ -57,6 +62,7 @@ class StringPool {
   static void giveBack(StringKey s) {
     if (s.isDefault()) return;
 #ifdef STRINGPOOL
+    std::lock_guard<std::mutex> lock(counts_mutex);
     Assert(has_key(counts, s) && counts[s] > 0);
     if (--*find_second(counts, s) == 0) {
       counts.erase(s);
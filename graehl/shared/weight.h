@@ -45,6 +45,7 @@
 */
 
 #include <boost/lexical_cast.hpp>
+#include <graehl/shared/atoi_fast.hpp>
 #include <graehl/shared/nan.hpp>
 #include <graehl/shared/stream_util.hpp>
 #include <graehl/shared/config.h>
@@ -53,7 +54,9 @@
 #include <graehl/shared/funcs.hpp>
 #include <graehl/shared/threadlocal.hpp>
 #include <graehl/shared/random.hpp>
+#include <boost/cstdint.hpp>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 
 #ifdef GRAEHL_TEST
@@ -501,13 +504,13 @@ struct logweight {  // capable of representing nonnegative reals
   char* setStringPartial(const char* b, const char* end) {
     char* e;
     if (b + 1 < end && b[0] == 'e' && b[1] == '^') {
-      setLn(std::strtod(b + 2, &e));
+      setLn(strtod_fast(b + 2, &e));
       return e;
     } else if (b + 2 < end && b[0] == '1' && b[1] == '0' && b[2] == '^') {
-      setLog10(std::strtod(b + 3, &e));
+      setLog10(strtod_fast(b + 3, &e));
       return e;
     } else {
-      double d = std::strtod(b, &e);
+      double d = strtod_fast(b, &e);
       if (e[0] == 'l') {
         if (e[1] == 'n') {
           setLn(d);
@@ -891,6 +894,87 @@ WEIGHT_FORWARD_OP_RET(>=, bool)
 WEIGHT_FORWARD_OP_RET(==, bool)
 WEIGHT_FORWARD_OP_RET(!=, bool)
 
+// batched addition.  log_add_exact uses libm exp/log; log_add_fast uses the polynomials below, which have no
+// calls or branches so that loops over them vectorize.  fast results are within 2e-8 (in ln, i.e. a relative
+// error) of exact ones
+enum log_add_mode { log_add_exact, log_add_fast };
+
+// exp(x) for x <= 0, relative error < 1e-8 (0 for x < -700)
+inline double log_add_fast_exp(double x) {
+  double t = x * 1.4426950408889634;  // log2(e)
+  t = t < -1010. ? -1010. : t;
+  double const round = 6755399441055744.;  // 1.5*2^52: t+round has t rounded to nearest in its low bits
+  double k = t + round, n = k - round;
+  double r = (t - n) * 0.6931471805599453;  // |r| <= ln(2)/2, so degree 7 Taylor is enough
+  static double const c[] = {1. / 5040, 1. / 720, 1. / 120, 1. / 24, 1. / 6, 1. / 2, 1., 1.};
+  double p = c[0];
+  for (unsigned i = 1; i < 8; ++i) p = p * r + c[i];
+  boost::int64_t bits;  // 2^n: n+1023 in the exponent field
+  std::memcpy(&bits, &k, sizeof(k));
+  bits = (bits + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return x < -700. ? 0. : p * scale;
+}
+
+// log(1+y) for 0 <= y <= 1, absolute error < 1.1e-8: 2*atanh(y/(2+y)), whose argument is <= 1/3
+inline double log_add_fast_log1p(double y) {
+  static double const c[] = {1. / 13, 1. / 11, 1. / 9, 1. / 7, 1. / 5, 1. / 3, 1.};
+  double s = y / (2. + y), s2 = s * s;
+  double p = c[0];
+  for (unsigned i = 1; i < 7; ++i) p = p * s2 + c[i];
+  return 2. * s * p;
+}
+
+// sum of [begin,end): max + log1p(sum(exp(w-max)) over the rest), i.e. one exp per weight but the largest
+// and a single log1p, instead of an exp and a log1p per +.  exact agrees with repeated + up to rounding
+template <class Real>
+logweight<Real> log_sum(logweight<Real> const* begin, logweight<Real> const* end,
+                        log_add_mode mode = log_add_exact) {
+  if (begin == end) return logweight<Real>();
+  logweight<Real> const* imax = begin;
+  for (logweight<Real> const* i = begin + 1; i < end; ++i)
+    if (i->weight > imax->weight) imax = i;
+  Real max = imax->weight;
+  if (end - begin == 1 || !(max > -logweight<Real>::FLOAT_INF())) return *imax;
+  double rest = 0;
+  if (mode == log_add_fast) {
+    for (logweight<Real> const* i = begin; i < imax; ++i) rest += log_add_fast_exp(i->weight - max);
+    for (logweight<Real> const* i = imax + 1; i < end; ++i) rest += log_add_fast_exp(i->weight - max);
+  } else {
+    for (logweight<Real> const* i = begin; i < imax; ++i) rest += std::exp(i->weight - max);
+    for (logweight<Real> const* i = imax + 1; i < end; ++i) rest += std::exp(i->weight - max);
+  }
+  logweight<Real> result;
+  if (mode == log_add_fast && rest <= 1.)
+    result.weight = (Real)(max + log_add_fast_log1p(rest));
+  else
+#ifdef GRAEHL_USE_LOG1P
+    result.weight = (Real)(max + log1p(rest));
+#else
+    result.weight = (Real)(max + std::log(1 + rest));
+#endif
+  return result;
+}
+
+// to[i] += from[i] * scale for i < n.  log_add_exact gives exactly what the loop with + would
+template <class Real>
+void log_add_scaled(logweight<Real>* to, logweight<Real> const* from, std::size_t n,
+                    logweight<Real> scale = logweight<Real>(one_weight()),
+                    log_add_mode mode = log_add_exact) {
+  if (mode == log_add_exact) {
+    for (std::size_t i = 0; i < n; ++i) to[i] += from[i] * scale;
+    return;
+  }
+  Real const zero = -logweight<Real>::FLOAT_INF();
+  for (std::size_t i = 0; i < n; ++i) {
+    Real a = to[i].weight, b = from[i].weight + scale.weight;
+    Real hi = a > b ? a : b, lo = a > b ? b : a;
+    double d = hi > zero ? (double)lo - hi : -1000.;
+    to[i].weight = (Real)(hi + log_add_fast_log1p(log_add_fast_exp(d)));
+  }
+}
+
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
@@ -931,6 +1015,48 @@ BOOST_AUTO_TEST_CASE(TEST_WEIGHT) {
   BOOST_CHECK(a == d);
   BOOST_CHECK(a == e);
 }
+
+BOOST_AUTO_TEST_CASE(TEST_WEIGHT_LOG_ADD) {
+  typedef logweight<double> W;
+  for (double x = -700; x <= 0; x += .0137)
+    BOOST_CHECK(std::fabs(log_add_fast_exp(x) - std::exp(x)) <= 1e-8 * std::exp(x));
+  for (double y = 0; y <= 1; y += 1e-4)
+    BOOST_CHECK(std::fabs(log_add_fast_log1p(y) - std::log(1 + y)) < 1.1e-8);
+  W zeros[2], to[3];
+  BOOST_CHECK(log_sum(zeros, zeros + 2, log_add_fast).isZero());
+  log_add_scaled(to, zeros, 2, W(2), log_add_fast);
+  BOOST_CHECK(to[0].isZero() && to[1].isZero());
+  unsigned r = 12345;  // spans of ln in [-50,50), some of them zero
+  W span[100], from[100], exact[100], fast[100];
+  for (unsigned trial = 0; trial < 100; ++trial) {
+    unsigned n = 1 + trial;
+    W sum;
+    for (unsigned i = 0; i < n; ++i) {
+      r = r * 1103515245 + 12345;
+      span[i] = (r >> 16) % 7 ? W((double)(r >> 8 & 0xffff) / 655.36 - 50, ln_weight()) : W();
+      sum += span[i];
+    }
+    for (unsigned i = 0; i < n; ++i) {
+      from[i] = span[(i * 7) % n];
+      exact[i] = fast[i] = span[(i * 3) % n];
+    }
+    W e = log_sum(span, span + n), f = log_sum(span, span + n, log_add_fast);
+    if (sum.isZero())
+      BOOST_CHECK(e.isZero() && f.isZero());
+    else {
+      BOOST_CHECK(std::fabs(e.getLn() - sum.getLn()) < 1e-12 * (1 + std::fabs(sum.getLn())));
+      BOOST_CHECK(std::fabs(f.getLn() - e.getLn()) < 2e-8);
+    }
+    W scale((double)trial / 10 - 5, ln_weight());
+    log_add_scaled(exact, from, n, scale);
+    log_add_scaled(fast, from, n, scale, log_add_fast);
+    for (unsigned i = 0; i < n; ++i) {
+      BOOST_CHECK(exact[i] == span[(i * 3) % n] + from[i] * scale);
+      BOOST_CHECK(fast[i].isZero() ? exact[i].isZero()
+                                   : std::fabs(fast[i].getLn() - exact[i].getLn()) < 2e-8);
+    }
+  }
+}
 #endif
 
 }  // ns